@@ -5,6 +5,12 @@ const { mkdir, mkdtemp } = require('fs/promises');
 
 const BUILD_FOLDER = 'build/';
 const SRC_FOLDER = 'src/';
+// `node build.js server --io-uring` builds the server with the io_uring socket backend (see src/uring.h)
+const IO_URING = process.argv.includes('--io-uring');
+// `node build.js server --stack-debug` makes the server report how much stack the connections use (see coroutine_stack_high_water())
+const STACK_DEBUG = process.argv.includes('--stack-debug');
+// `node build.js server --coroutine-stats` makes the server report the scheduler statistics of the connections (see coroutine_stats())
+const COROUTINE_STATS = process.argv.includes('--coroutine-stats');
 
 /**
  * TODO: this signature is outdated
@@ -103,6 +109,8 @@ async function buildCWS() {
             "-Wall", "-Wextra", "-ggdb",
             "-o", BUILD_FOLDER+"coroutine.o",
             "-fsanitize=address",
+            STACK_DEBUG ? ["-DCOROUTINE_STACK_DEBUG"] : [],
+            COROUTINE_STATS ? ["-DCOROUTINE_STATS"] : [],
             "-c",
             SRC_FOLDER+"cws/coroutine.c"
         ]),
@@ -129,9 +137,17 @@ async function buildServer() {
             "-Wall", "-Wextra", "-ggdb",
             "-I", SRC_FOLDER+"cws/",
             "-fsanitize=address",
+            IO_URING ? ["-DSERVER_IO_URING"] : [],
             "-c", SRC_FOLDER+"server.c",
             "-o", BUILD_FOLDER+"server.o",
         ]),
+        IO_URING ? cmdAsync("clang", [
+            "-Wall", "-Wextra", "-ggdb",
+            "-I", SRC_FOLDER+"cws/",
+            "-fsanitize=address",
+            "-c", SRC_FOLDER+"uring.c",
+            "-o", BUILD_FOLDER+"uring.o",
+        ]) : Promise.resolve(),
         cmdAsync("clang", [
             "-Wall", "-Wextra", "-ggdb",
             "-I", SRC_FOLDER+"cws/",
@@ -154,8 +170,63 @@ async function buildServer() {
         BUILD_FOLDER+"server.o",
         BUILD_FOLDER+"common.o",
         BUILD_FOLDER+"stats.o",
+        IO_URING ? [BUILD_FOLDER+"uring.o"] : [],
         BUILD_FOLDER+"libcws.a",
-        "-lm"
+        "-lm",
+        "-lpthread",
+    ]);
+}
+
+async function buildBench() {
+    await Promise.all([
+        cmdAsync("clang", [
+            "-Wall", "-Wextra", "-O3", "-ggdb",
+            "-I", SRC_FOLDER+"cws/",
+            "-o", BUILD_FOLDER+"mask_bench",
+            SRC_FOLDER+"bench/mask_bench.c",
+        ]),
+        cmdAsync("clang", [
+            "-Wall", "-Wextra", "-O3", "-ggdb",
+            "-I", SRC_FOLDER+"cws/",
+            "-o", BUILD_FOLDER+"handshake_bench",
+            SRC_FOLDER+"bench/handshake_bench.c",
+        ]),
+        cmdAsync("clang", [
+            "-Wall", "-Wextra", "-O3", "-ggdb",
+            "-I", SRC_FOLDER,
+            "-o", BUILD_FOLDER+"storm_bench",
+            SRC_FOLDER+"bench/storm_bench.c",
+        ]),
+        cmdAsync("clang", [
+            "-Wall", "-Wextra", "-O3", "-ggdb",
+            "-I", SRC_FOLDER+"cws/",
+            "-o", BUILD_FOLDER+"coroutine_bench",
+            SRC_FOLDER+"bench/coroutine_bench.c",
+            SRC_FOLDER+"cws/coroutine.c",
+        ]),
+        cmdAsync("clang", [
+            "-Wall", "-Wextra", "-O3", "-ggdb",
+            "-DCOROUTINE_NO_EPOLL",
+            "-I", SRC_FOLDER+"cws/",
+            "-o", BUILD_FOLDER+"coroutine_bench_poll",
+            SRC_FOLDER+"bench/coroutine_bench.c",
+            SRC_FOLDER+"cws/coroutine.c",
+        ]),
+        cmdAsync("clang", [
+            "-Wall", "-Wextra", "-O3", "-ggdb",
+            "-I", SRC_FOLDER+"cws/",
+            "-o", BUILD_FOLDER+"coroutine_mn_bench",
+            SRC_FOLDER+"bench/coroutine_mn_bench.c",
+            SRC_FOLDER+"cws/coroutine.c",
+            "-lpthread",
+        ]),
+        cmdAsync("clang", [
+            "-Wall", "-Wextra", "-O3", "-ggdb",
+            "-I", SRC_FOLDER+"cws/",
+            "-o", BUILD_FOLDER+"stackless_bench",
+            SRC_FOLDER+"bench/stackless_bench.c",
+            SRC_FOLDER+"cws/cws.c",
+        ]),
     ]);
 }
 
@@ -186,6 +257,9 @@ async function main () {
             case 'server':
                 await buildServer();
                 break;
+            case 'bench':
+                await buildBench();
+                break;
             default:
                 throw new Error(`unknown target \`${target}\``)
             }
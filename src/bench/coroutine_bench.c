@@ -0,0 +1,190 @@
+// Stress test of the coroutine scheduler with a lot of coroutines: spawning them, passing a token
+// around with coroutine_wake_up(), waking them up in random order while they sleep on an fd or a
+// timer, and finishing them. Every phase checks that every coroutine did what it was supposed to.
+//
+// $ node build.js bench
+// $ ./build/coroutine_bench [coroutines]
+// $ ./build/coroutine_bench_poll [coroutines]
+//
+// NOTE: poll() refuses to take more fds than RLIMIT_NOFILE, so the poll backend can not put more
+// coroutines to sleep on fds than that. coroutine_bench_poll runs with fewer coroutines accordingly.
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+#include "coroutine.h"
+
+static bool relaying = true;
+static size_t coroutines_count = 0;
+static size_t *ids = NULL;       // ids[i] is the id of the i-th coroutine
+static size_t *order = NULL;     // A random permutation of [0, coroutines_count)
+static uint64_t *deadlines = NULL;
+static size_t resumed = 0;       // How many coroutines resumed in the current phase
+static size_t relayed = 0;
+static size_t finished = 0;
+static size_t late = 0;          // Timers that woke up before their deadline
+static int idle_fd = -1;
+
+static void worker(void *arg)
+{
+    size_t index = (size_t)(uintptr_t)arg;
+    ids[index] = coroutine_id();
+
+    // Nobody can be woken up before it has run at least once, so everybody parks first
+    coroutine_sleep();
+    while (relaying) {
+        relayed += 1;
+        if (index + 1 < coroutines_count) coroutine_wake_up(ids[index + 1]);
+        coroutine_sleep();
+    }
+
+    coroutine_sleep();
+    resumed += 1;
+
+    // An fd that never becomes readable
+    coroutine_sleep_read(idle_fd);
+    resumed += 1;
+
+    // Waiting for the main coroutine to set up the deadlines
+    coroutine_sleep();
+
+    coroutine_sleep_until(deadlines[index]);
+    if (coroutine_now() < deadlines[index]) late += 1;
+    resumed += 1;
+    finished += 1;
+}
+
+static void shuffle(size_t *xs, size_t n)
+{
+    for (size_t i = 0; i < n; ++i) xs[i] = i;
+    for (size_t i = n; i > 1; --i) {
+        size_t j = (size_t)rand()%i;
+        size_t t = xs[i - 1];
+        xs[i - 1] = xs[j];
+        xs[j] = t;
+    }
+}
+
+// Lets every active coroutine run until all of them are asleep again
+static void settle(void)
+{
+    while (coroutine_alive() > 1) coroutine_yield();
+}
+
+static bool check(const char *what, size_t actual, size_t expected)
+{
+    if (actual == expected) return true;
+    fprintf(stderr, "ERROR: %s: %zu != %zu\n", what, actual, expected);
+    return false;
+}
+
+static void report(const char *what, uint64_t started_at, size_t ops)
+{
+    double elapsed = (double)(coroutine_now() - started_at)*1e-9;
+    printf("%-8s %8.3f s %8.1f ns/op\n", what, elapsed, elapsed/ops*1e9);
+}
+
+int main(int argc, char **argv)
+{
+    coroutines_count = argc > 1 ? strtoul(argv[1], NULL, 10) : 100*1000;
+    if (coroutines_count == 0) coroutines_count = 1;
+
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+#ifdef COROUTINE_NO_EPOLL
+    size_t max_count = limit.rlim_cur - 16;
+    if (coroutines_count > max_count) {
+        printf("NOTE: RLIMIT_NOFILE only allows poll() to take %zu coroutines\n", max_count);
+        coroutines_count = max_count;
+    }
+#endif // COROUTINE_NO_EPOLL
+    ids = calloc(coroutines_count, sizeof(*ids));
+    order = calloc(coroutines_count, sizeof(*order));
+    deadlines = calloc(coroutines_count, sizeof(*deadlines));
+    int pipe_fds[2];
+    if (ids == NULL || order == NULL || deadlines == NULL || pipe(pipe_fds) < 0) {
+        fprintf(stderr, "ERROR: could not set up %zu coroutines\n", coroutines_count);
+        return 1;
+    }
+    idle_fd = pipe_fds[0];
+
+    coroutine_init();
+    printf("Coroutines: %zu\n", coroutines_count);
+
+    uint64_t started_at = coroutine_now();
+    for (size_t i = 0; i < coroutines_count; ++i) {
+        coroutine_go(worker, (void*)(uintptr_t)i);
+    }
+    settle();
+    report("spawn", started_at, coroutines_count);
+
+    // The token goes through every coroutine, one context switch per coroutine
+    started_at = coroutine_now();
+    coroutine_wake_up(ids[0]);
+    settle();
+    report("relay", started_at, coroutines_count);
+    if (!check("relayed", relayed, coroutines_count)) return 1;
+
+    relaying = false;
+    for (size_t i = 0; i < coroutines_count; ++i) coroutine_wake_up(ids[i]);
+    settle();
+
+    shuffle(order, coroutines_count);
+    started_at = coroutine_now();
+    for (size_t i = 0; i < coroutines_count; ++i) coroutine_wake_up(ids[order[i]]);
+    // Waking up twice must be harmless
+    for (size_t i = 0; i < coroutines_count; ++i) coroutine_wake_up(ids[order[i]]);
+    settle();
+    report("wake_up", started_at, coroutines_count);
+    if (!check("woken up from coroutine_sleep()", resumed, coroutines_count)) return 1;
+
+    // Everybody is on the waiting list of the same fd now, so the wake-ups take them out of the middle
+    // of it
+    resumed = 0;
+    shuffle(order, coroutines_count);
+    started_at = coroutine_now();
+    for (size_t i = 0; i < coroutines_count; ++i) coroutine_wake_up(ids[order[i]]);
+    settle();
+    report("fd", started_at, coroutines_count);
+    if (!check("woken up from coroutine_sleep_read()", resumed, coroutines_count)) return 1;
+
+    // Half of the timers are cancelled by coroutine_wake_up() in random order, the rest expire on
+    // their own
+    resumed = 0;
+    uint64_t now = coroutine_now();
+    for (size_t i = 0; i < coroutines_count; ++i) {
+        deadlines[i] = now + 50*1000*1000 + (uint64_t)(rand()%(50*1000))*1000;
+    }
+    started_at = coroutine_now();
+    for (size_t i = 0; i < coroutines_count; ++i) coroutine_wake_up(ids[i]);
+    settle();
+    shuffle(order, coroutines_count);
+    for (size_t i = 0; i < coroutines_count/2; ++i) {
+        deadlines[order[i]] = 0;
+        coroutine_wake_up(ids[order[i]]);
+    }
+    settle();
+    report("timer", started_at, coroutines_count);
+    while (finished < coroutines_count) coroutine_sleep_until(coroutine_now() + 10*1000*1000);
+    if (!check("woken up from coroutine_sleep_until()", resumed, coroutines_count)) return 1;
+    if (!check("timers expired too early", late, 0)) return 1;
+    if (!check("alive", coroutine_alive(), 1)) return 1;
+
+    // The stacks of the finished coroutines are reused
+    relaying = true;
+    started_at = coroutine_now();
+    for (size_t i = 0; i < coroutines_count; ++i) {
+        coroutine_go(worker, (void*)(uintptr_t)i);
+    }
+    settle();
+    report("respawn", started_at, coroutines_count);
+
+    printf("OK\n");
+    return 0;
+}
@@ -0,0 +1,139 @@
+// Benchmark of the coroutine runtime running on several threads. Every thread runs its own scheduler,
+// the main one hands out coroutines doing some CPU work between the yields with
+// coroutine_go_anywhere() and the rest of the threads steal them. Then every thread gets a batch of
+// pinned coroutines with coroutine_go_on() which must not end up anywhere else.
+//
+// $ node build.js bench
+// $ ./build/coroutine_mn_bench [threads] [coroutines]
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "coroutine.h"
+
+#define MAX_THREADS 256
+#define WORK_ROUNDS 16
+#define WORK_PER_ROUND 20000
+
+typedef struct {
+    pthread_t thread;
+    Coroutine_Scheduler *scheduler;
+    size_t ran;         // Atomic. How many coroutines ran on the thread
+    size_t misplaced;   // Atomic. Pinned coroutines that ran on the wrong thread
+} Worker;
+
+static Worker workers[MAX_THREADS] = {0};
+static size_t threads_count = 0;
+static size_t ready = 0;     // Atomic
+static size_t finished = 0;  // Atomic
+static bool done = false;    // Atomic
+static uint64_t checksum = 0;
+
+static Worker *current_worker(void)
+{
+    Coroutine_Scheduler *s = coroutine_scheduler();
+    for (size_t i = 0; i < threads_count; ++i) {
+        if (workers[i].scheduler == s) return &workers[i];
+    }
+    abort();
+}
+
+// Something that looks like parsing a frame: a bit of CPU work between the yields
+static void task(void *arg)
+{
+    uint64_t x = (uint64_t)(uintptr_t)arg + 1;
+    for (size_t round = 0; round < WORK_ROUNDS; ++round) {
+        for (size_t i = 0; i < WORK_PER_ROUND; ++i) {
+            x ^= x << 13;
+            x ^= x >> 7;
+            x ^= x << 17;
+        }
+        coroutine_yield();
+    }
+    __atomic_fetch_xor(&checksum, x, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&current_worker()->ran, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&finished, 1, __ATOMIC_SEQ_CST);
+}
+
+static void pinned_task(void *arg)
+{
+    Worker *expected = arg;
+    for (size_t round = 0; round < 4; ++round) coroutine_yield();
+    if (current_worker() != expected) __atomic_fetch_add(&expected->misplaced, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&finished, 1, __ATOMIC_SEQ_CST);
+}
+
+static void *worker_thread(void *arg)
+{
+    Worker *worker = arg;
+    coroutine_init();
+    worker->scheduler = coroutine_scheduler();
+    __atomic_fetch_add(&ready, 1, __ATOMIC_SEQ_CST);
+    while (!__atomic_load_n(&done, __ATOMIC_SEQ_CST)) {
+        coroutine_sleep_until(coroutine_now() + 10*1000*1000);
+    }
+    return NULL;
+}
+
+// The main coroutine of the main thread waits for the others while serving its own share
+static void wait_finished(size_t count)
+{
+    while (__atomic_load_n(&finished, __ATOMIC_SEQ_CST) < count) {
+        if (coroutine_alive() > 1) coroutine_yield();
+        else coroutine_sleep_until(coroutine_now() + 1000*1000);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    threads_count = argc > 1 ? strtoul(argv[1], NULL, 10) : (size_t)(cpus > 0 ? cpus : 1);
+    size_t coroutines_count = argc > 2 ? strtoul(argv[2], NULL, 10) : 2000;
+    if (threads_count == 0) threads_count = 1;
+    if (threads_count > MAX_THREADS) threads_count = MAX_THREADS;
+
+    coroutine_init();
+    workers[0].scheduler = coroutine_scheduler();
+    for (size_t i = 1; i < threads_count; ++i) {
+        if (pthread_create(&workers[i].thread, NULL, worker_thread, &workers[i]) != 0) {
+            fprintf(stderr, "ERROR: could not start thread %zu\n", i);
+            return 1;
+        }
+    }
+    while (__atomic_load_n(&ready, __ATOMIC_SEQ_CST) < threads_count - 1) usleep(1000);
+    printf("Threads: %zu, coroutines: %zu\n", threads_count, coroutines_count);
+
+    uint64_t started_at = coroutine_now();
+    for (size_t i = 0; i < coroutines_count; ++i) {
+        coroutine_go_anywhere(task, (void*)(uintptr_t)i, 64*1024);
+    }
+    wait_finished(coroutines_count);
+    double elapsed = (double)(coroutine_now() - started_at)*1e-9;
+    printf("anywhere %8.3f s %8.1f us/coroutine (checksum %016llx)\n", elapsed, elapsed/coroutines_count*1e6, (unsigned long long)checksum);
+    for (size_t i = 0; i < threads_count; ++i) {
+        printf("    thread %zu ran %zu\n", i, workers[i].ran);
+    }
+
+    size_t pinned_count = 0;
+    for (size_t i = 0; i < threads_count; ++i) {
+        for (size_t j = 0; j < 100; ++j) {
+            coroutine_go_on(workers[i].scheduler, pinned_task, &workers[i], 0);
+            pinned_count += 1;
+        }
+    }
+    wait_finished(coroutines_count + pinned_count);
+    for (size_t i = 0; i < threads_count; ++i) {
+        if (workers[i].misplaced > 0) {
+            fprintf(stderr, "ERROR: %zu coroutines pinned to thread %zu ran elsewhere\n", workers[i].misplaced, i);
+            return 1;
+        }
+    }
+
+    __atomic_store_n(&done, true, __ATOMIC_SEQ_CST);
+    for (size_t i = 1; i < threads_count; ++i) pthread_join(workers[i].thread, NULL);
+    printf("OK\n");
+    return 0;
+}
@@ -0,0 +1,144 @@
+// Cost of computing Sec-WebSocket-Accept, which the server does for every connection during a
+// reconnect storm. Compares the SHA1 implementations from teenysha1.h.
+//
+// $ node build.js bench
+// $ ./build/handshake_bench
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define TEENY_SHA1_IMPLEMENTATION
+#include "teenysha1.h"
+#define B64_IMPLEMENTATION
+#include "b64.h"
+
+typedef void (*Compress_Fn)(digest32_t digest, const uint8_t *blocks, size_t count);
+
+typedef struct {
+    const char *name;
+    Compress_Fn fn;
+} Compress_Impl;
+
+static Compress_Impl impls[] = {
+    {"portable", sha1_compress_portable},
+#ifdef TEENY_SHA1_X86
+    {"shani",    sha1_compress_shani},
+#endif // TEENY_SHA1_X86
+};
+#define IMPLS_COUNT (sizeof(impls)/sizeof(impls[0]))
+
+#define WS_GUID "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+
+// How many keys to compute per measurement
+#define BENCH_KEYS (1000*1000)
+
+static double now_secs(void)
+{
+    struct timespec ts = {0};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec*1e-9;
+}
+
+// The 24 characters of Sec-WebSocket-Key followed by the GUID are always 60 bytes, so the padded
+// message is always exactly 2 blocks
+static void compute_accept(Compress_Fn compress, const char key[24], char accept[29])
+{
+    uint8_t blocks[128] = {0};
+    memcpy(blocks, key, 24);
+    memcpy(blocks + 24, WS_GUID, 36);
+    blocks[60] = 0x80;
+    blocks[126] = (60*8) >> 8;
+    blocks[127] = (60*8) & 0xFF;
+
+    digest32_t digest = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0};
+    compress(digest, blocks, 2);
+
+    digest8_t bytes;
+    for (size_t i = 0; i < 20; ++i) bytes[i] = (uint8_t)(digest[i/4] >> (24 - 8*(i%4)));
+    b64_encode(bytes, sizeof(bytes), accept, 28, B64_STD_ALPHA, B64_DEFAULT_PAD);
+    accept[28] = '\0';
+}
+
+static bool check_impls(void)
+{
+    // The example from RFC 6455, Section 1.3
+    const char *key = "dGhlIHNhbXBsZSBub25jZQ==";
+    const char *expected = "s3pPLMBiTxaQ9kYGzzhZRbK+xOo=";
+    for (size_t impl = 0; impl < IMPLS_COUNT; ++impl) {
+        char accept[29];
+        compute_accept(impls[impl].fn, key, accept);
+        if (strcmp(accept, expected) != 0) {
+            fprintf(stderr, "ERROR: %s is broken: %s != %s\n", impls[impl].name, accept, expected);
+            return false;
+        }
+    }
+
+    // The streaming API against all the implementations on random data of all sizes
+    static uint8_t data[64*5];
+    for (size_t i = 0; i < sizeof(data); ++i) data[i] = (uint8_t)rand();
+    for (size_t len = 0; len <= sizeof(data); ++len) {
+        SHA1 sha1;
+        sha1_reset(&sha1);
+        // Feeding it in uneven pieces to exercise the partial blocks
+        for (size_t i = 0; i < len; i += 13) sha1_process_bytes(&sha1, data + i, len - i < 13 ? len - i : 13);
+        digest32_t streamed;
+        sha1_get_digest(&sha1, streamed);
+
+        for (size_t impl = 0; impl < IMPLS_COUNT; ++impl) {
+            uint8_t padded[64*6] = {0};
+            memcpy(padded, data, len);
+            padded[len] = 0x80;
+            size_t count = (len + 8)/64 + 1;
+            uint64_t bits = (uint64_t)len*8;
+            for (size_t i = 0; i < 8; ++i) padded[count*64 - 1 - i] = (uint8_t)(bits >> (8*i));
+            digest32_t digest = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0};
+            impls[impl].fn(digest, padded, count);
+            if (memcmp(digest, streamed, sizeof(digest)) != 0) {
+                fprintf(stderr, "ERROR: %s disagrees with the streaming API (len=%zu)\n", impls[impl].name, len);
+                return false;
+            }
+        }
+    }
+
+    // b64_encode against the textbook one group at a time encoding
+    for (size_t len = 0; len <= 64; ++len) {
+        char actual[128], expected[128];
+        size_t actual_len = b64_encode(data, len, actual, sizeof(actual), B64_STD_ALPHA, B64_DEFAULT_PAD);
+        size_t expected_len = 0;
+        for (size_t i = 0; i < len; i += 3) {
+            uint32_t group = (uint32_t)data[i] << 16;
+            if (i + 1 < len) group |= (uint32_t)data[i + 1] << 8;
+            if (i + 2 < len) group |= (uint32_t)data[i + 2];
+            for (size_t j = 0; j < 4; ++j) {
+                expected[expected_len++] = j <= len - i ? B64_STD_ALPHA[(group >> (18 - 6*j)) & 0x3F] : B64_DEFAULT_PAD;
+            }
+        }
+        if (actual_len != expected_len || memcmp(actual, expected, expected_len) != 0) {
+            fprintf(stderr, "ERROR: b64_encode is broken (len=%zu)\n", len);
+            return false;
+        }
+    }
+    return true;
+}
+
+int main(void)
+{
+    if (!check_impls()) return 1;
+
+    char key[25] = "dGhlIHNhbXBsZSBub25jZQ==";
+    for (size_t impl = 0; impl < IMPLS_COUNT; ++impl) {
+        char accept[29];
+        double start = now_secs();
+        for (size_t i = 0; i < BENCH_KEYS; ++i) {
+            // Varying the key a bit, so nothing gets hoisted out of the loop
+            key[i%22] = B64_STD_ALPHA[i%64];
+            compute_accept(impls[impl].fn, key, accept);
+        }
+        double elapsed = now_secs() - start;
+        printf("%-8s %8.1f ns/key %10.0f keys/s\n", impls[impl].name, elapsed/BENCH_KEYS*1e9, BENCH_KEYS/elapsed);
+    }
+
+    return 0;
+}
@@ -0,0 +1,106 @@
+// Throughput of the WebSocket masking implementations from wsmask.h. The `scalar` one is the byte
+// by byte `i % 4` loop cws used before.
+//
+// $ node build.js bench
+// $ ./build/mask_bench
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define WSMASK_IMPLEMENTATION
+#include "wsmask.h"
+
+typedef void (*Mask_Fn)(unsigned char *buffer, size_t len, const unsigned char mask[4], size_t offset);
+
+typedef struct {
+    const char *name;
+    Mask_Fn fn;
+} Mask_Impl;
+
+static Mask_Impl impls[] = {
+    {"scalar", wsmask_apply_scalar},
+    {"word",   wsmask_apply_word},
+#ifdef WSMASK_X86
+    {"sse2",   wsmask_apply_sse2},
+    {"avx2",   wsmask_apply_avx2},
+#endif // WSMASK_X86
+    {"apply",  wsmask_apply},
+};
+#define IMPLS_COUNT (sizeof(impls)/sizeof(impls[0]))
+
+static const size_t sizes[] = {6, 125, 1024, 16*1024, 1024*1024};
+#define SIZES_COUNT (sizeof(sizes)/sizeof(sizes[0]))
+
+// How many bytes to process per measurement
+#define BENCH_TOTAL_BYTES (256ull*1024*1024)
+
+static double now_secs(void)
+{
+    struct timespec ts = {0};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec*1e-9;
+}
+
+static bool check_impls(void)
+{
+    const unsigned char mask[4] = {0x12, 0x34, 0x56, 0x78};
+    unsigned char expected[300], actual[300];
+    for (size_t i = 0; i < sizeof(expected); ++i) expected[i] = (unsigned char)(i*31);
+    for (size_t impl = 0; impl < IMPLS_COUNT; ++impl) {
+        for (size_t start = 0; start < 8; ++start) {
+            for (size_t len = 0; start + len <= sizeof(expected); len += 7) {
+                for (size_t offset = 0; offset < 4; ++offset) {
+                    memcpy(actual, expected, sizeof(actual));
+                    impls[impl].fn(actual + start, len, mask, offset);
+                    for (size_t i = 0; i < sizeof(actual); ++i) {
+                        unsigned char byte = expected[i];
+                        if (start <= i && i < start + len) byte ^= mask[(offset + i - start)%4];
+                        if (actual[i] != byte) {
+                            fprintf(stderr, "ERROR: %s is broken (start=%zu, len=%zu, offset=%zu)\n", impls[impl].name, start, len, offset);
+                            return false;
+                        }
+                    }
+                }
+            }
+        }
+    }
+    return true;
+}
+
+int main(void)
+{
+    if (!check_impls()) return 1;
+
+    unsigned char *buffer = malloc(sizes[SIZES_COUNT - 1] + 1);
+    if (buffer == NULL) {
+        fprintf(stderr, "ERROR: could not allocate the buffer\n");
+        return 1;
+    }
+    memset(buffer, 0x69, sizes[SIZES_COUNT - 1] + 1);
+    const unsigned char mask[4] = {0xDE, 0xAD, 0xBE, 0xEF};
+
+    printf("%-8s", "");
+    for (size_t size = 0; size < SIZES_COUNT; ++size) printf(" %10zuB", sizes[size]);
+    printf("   (GB/s)\n");
+    for (size_t impl = 0; impl < IMPLS_COUNT; ++impl) {
+        printf("%-8s", impls[impl].name);
+        for (size_t size = 0; size < SIZES_COUNT; ++size) {
+            size_t len = sizes[size];
+            size_t iterations = BENCH_TOTAL_BYTES/len/(impl == 0 ? 8 : 1);
+            double start = now_secs();
+            for (size_t i = 0; i < iterations; ++i) {
+                // Starting at an odd address with an odd offset into the mask to stay honest about
+                // the unaligned accesses
+                impls[impl].fn(buffer + 1, len, mask, i);
+            }
+            double elapsed = now_secs() - start;
+            printf(" %11.2f", (double)(iterations*len)/elapsed/1e9);
+        }
+        printf("\n");
+    }
+
+    free(buffer);
+    return 0;
+}
@@ -0,0 +1,279 @@
+// A single-threaded event loop serving a lot of WebSocket connections with the stackless mode of cws
+// (see cws_feed()) instead of a coroutine per connection. The clients are the other ends of
+// socketpairs. They complete the handshake, then echo a text message, a binary message fragmented
+// with a PING in between, all of it trickling in a few bytes at a time, and finally sit idle, which
+// is where the memory per connection is measured.
+//
+// $ node build.js bench
+// $ ./build/stackless_bench [connections]
+//
+// NOTE: every connection takes two fds here, so RLIMIT_NOFILE caps the amount of them.
+#include <assert.h>
+#include <errno.h>
+#include <malloc.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "cws.h"
+
+#define ROUNDS 4
+
+typedef struct {
+    Cws cws;
+    int fd;             // The server end of the socketpair
+    int client_fd;
+    bool handshaken;
+    bool writing;       // Waiting for EPOLLOUT
+    size_t echoed;      // Messages echoed back by the server
+    size_t received;    // Bytes of the replies the client got
+} Connection;
+
+static Connection *connections = NULL;
+static size_t connections_count = 0;
+static int epoll_fd = -1;
+
+static double now_secs(void)
+{
+    struct timespec ts = {0};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec*1e-9;
+}
+
+static size_t heap_used(void)
+{
+    struct mallinfo2 info = mallinfo2();
+    return info.uordblks + info.hblkhd;
+}
+
+static void connection_watch(Connection *connection, int op, bool writing)
+{
+    struct epoll_event event = {
+        .events = EPOLLIN | (writing ? EPOLLOUT : 0),
+        .data.ptr = connection,
+    };
+    if (epoll_ctl(epoll_fd, op, connection->fd, &event) < 0) {
+        fprintf(stderr, "ERROR: epoll_ctl: %s\n", strerror(errno));
+        exit(1);
+    }
+    connection->writing = writing;
+}
+
+// The whole server side: everything a connection does happens here, without ever blocking
+static bool connection_serve(Connection *connection)
+{
+    Cws *cws = &connection->cws;
+    unsigned char buffer[64*1024];
+    for (;;) {
+        ssize_t n = read(connection->fd, buffer, sizeof(buffer));
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+        if (n <= 0) return false;
+        cws_feed(cws, buffer, n);
+    }
+
+    if (!connection->handshaken) {
+        int ret = cws_next_handshake(cws);
+        if (ret == CWS_ERROR_WOULD_BLOCK) return true;
+        if (ret < 0) return false;
+        connection->handshaken = true;
+    }
+
+    for (;;) {
+        Cws_Message message;
+        int ret = cws_next_message(cws, &message, 0);
+        if (ret == CWS_ERROR_WOULD_BLOCK) break;
+        if (ret < 0) return false;
+        ret = cws_send_message(cws, message.kind, message.payload, message.payload_len);
+        if (ret < 0) return false;
+        connection->echoed += 1;
+    }
+
+    while (cws->queue.count > 0) {
+        Cws_Iovec output[64];
+        struct iovec iov[64];
+        size_t iovcnt = cws_output(cws, output, 64);
+        for (size_t i = 0; i < iovcnt; ++i) {
+            iov[i].iov_base = (void*)output[i].data;
+            iov[i].iov_len = output[i].len;
+        }
+        ssize_t n = writev(connection->fd, iov, iovcnt);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+        if (n < 0) return false;
+        cws_output_consume(cws, n);
+    }
+    if ((cws->queue.count > 0) != connection->writing) connection_watch(connection, EPOLL_CTL_MOD, cws->queue.count > 0);
+
+    cws_shrink(cws);
+    return true;
+}
+
+static void serve(void)
+{
+    struct epoll_event events[256];
+    for (;;) {
+        int n = epoll_wait(epoll_fd, events, 256, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return;
+        for (int i = 0; i < n; ++i) {
+            Connection *connection = events[i].data.ptr;
+            if (!connection_serve(connection)) {
+                fprintf(stderr, "ERROR: connection %zu failed\n", (size_t)(connection - connections));
+                exit(1);
+            }
+        }
+    }
+}
+
+static size_t client_frame(unsigned char *frame, bool fin, int opcode, const char *payload, size_t payload_len)
+{
+    assert(payload_len < 126);
+    size_t len = 0;
+    frame[len++] = (fin ? 0x80 : 0) | opcode;
+    frame[len++] = 0x80 | payload_len;
+    unsigned char mask[4] = {(unsigned char)rand(), (unsigned char)rand(), (unsigned char)rand(), (unsigned char)rand()};
+    memcpy(frame + len, mask, 4);
+    len += 4;
+    for (size_t i = 0; i < payload_len; ++i) frame[len++] = payload[i] ^ mask[i%4];
+    return len;
+}
+
+// Writes `bytes` to every client a few bytes at a time, letting the server run in between
+static void trickle(unsigned char (*bytes)[256], size_t *lens)
+{
+    size_t *sent = calloc(connections_count, sizeof(*sent));
+    assert(sent != NULL && "Buy more RAM lol");
+    bool done = false;
+    while (!done) {
+        done = true;
+        for (size_t i = 0; i < connections_count; ++i) {
+            if (sent[i] == lens[i]) continue;
+            size_t chunk = 1 + (size_t)rand()%7;
+            if (chunk > lens[i] - sent[i]) chunk = lens[i] - sent[i];
+            ssize_t n = write(connections[i].client_fd, bytes[i] + sent[i], chunk);
+            assert(n == (ssize_t)chunk);
+            sent[i] += chunk;
+            done = false;
+        }
+        serve();
+    }
+    free(sent);
+}
+
+static void drain_clients(void)
+{
+    for (size_t i = 0; i < connections_count; ++i) {
+        unsigned char buffer[4096];
+        ssize_t n;
+        while ((n = read(connections[i].client_fd, buffer, sizeof(buffer))) > 0) connections[i].received += n;
+    }
+}
+
+int main(int argc, char **argv)
+{
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+    connections_count = argc > 1 ? strtoul(argv[1], NULL, 10) : 50*1000;
+    size_t max_count = (limit.rlim_cur - 16)/2;
+    if (connections_count > max_count) {
+        printf("NOTE: RLIMIT_NOFILE only allows %zu connections\n", max_count);
+        connections_count = max_count;
+    }
+
+    connections = calloc(connections_count, sizeof(*connections));
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (connections == NULL || epoll_fd < 0) {
+        fprintf(stderr, "ERROR: could not set up %zu connections\n", connections_count);
+        return 1;
+    }
+    printf("Connections: %zu (sizeof(Connection) = %zu)\n", connections_count, sizeof(Connection));
+
+    for (size_t i = 0; i < connections_count; ++i) {
+        int fds[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0, fds) < 0) {
+            fprintf(stderr, "ERROR: socketpair: %s\n", strerror(errno));
+            return 1;
+        }
+        connections[i].fd = fds[0];
+        connections[i].client_fd = fds[1];
+        connections[i].cws.stackless = true;
+        connection_watch(&connections[i], EPOLL_CTL_ADD, false);
+    }
+
+    unsigned char (*bytes)[256] = calloc(connections_count, sizeof(*bytes));
+    size_t *lens = calloc(connections_count, sizeof(*lens));
+    assert(bytes != NULL && lens != NULL && "Buy more RAM lol");
+
+    size_t heap_before = heap_used();
+    double started_at = now_secs();
+    const char *request =
+        "GET / HTTP/1.1\r\n"
+        "Host: localhost\r\n"
+        "Upgrade: websocket\r\n"
+        "Connection: Upgrade\r\n"
+        "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+        "Sec-WebSocket-Version: 13\r\n"
+        "\r\n";
+    for (size_t i = 0; i < connections_count; ++i) {
+        lens[i] = strlen(request);
+        memcpy(bytes[i], request, lens[i]);
+    }
+    trickle(bytes, lens);
+    drain_clients();
+    double elapsed = now_secs() - started_at;
+    printf("handshake %8.3f s %8.1f us/connection\n", elapsed, elapsed/connections_count*1e6);
+    for (size_t i = 0; i < connections_count; ++i) {
+        if (!connections[i].handshaken || connections[i].received == 0) {
+            fprintf(stderr, "ERROR: connection %zu did not complete the handshake\n", i);
+            return 1;
+        }
+        connections[i].received = 0;
+    }
+
+    started_at = now_secs();
+    for (size_t round = 0; round < ROUNDS; ++round) {
+        for (size_t i = 0; i < connections_count; ++i) {
+            char text[64];
+            size_t text_len = snprintf(text, sizeof(text), "Hello from %zu in round %zu", i, round);
+            lens[i] = client_frame(bytes[i], true, 0x1, text, text_len);
+            lens[i] += client_frame(bytes[i] + lens[i], false, 0x2, "\x01\x02\x03", 3);
+            lens[i] += client_frame(bytes[i] + lens[i], true, 0x9, "ping", 4);
+            lens[i] += client_frame(bytes[i] + lens[i], true, 0x0, "\x04\x05", 2);
+        }
+        trickle(bytes, lens);
+        drain_clients();
+    }
+    elapsed = now_secs() - started_at;
+    printf("messages %8.3f s %8.1f us/message\n", elapsed, elapsed/(connections_count*ROUNDS*2)*1e6);
+    for (size_t i = 0; i < connections_count; ++i) {
+        // 2 echoed messages and a PONG per round
+        size_t text_len = snprintf(NULL, 0, "Hello from %zu in round 0", i);
+        size_t expected = ROUNDS*((2 + text_len) + (2 + 4) + (2 + 5));
+        if (connections[i].echoed != ROUNDS*2 || connections[i].received != expected) {
+            fprintf(stderr, "ERROR: connection %zu echoed %zu messages in %zu bytes, expected %d in %zu\n",
+                    i, connections[i].echoed, connections[i].received, ROUNDS*2, expected);
+            return 1;
+        }
+    }
+
+    // cws_shrink() has freed everything, so an idle connection costs just the Connection (and whatever
+    // the kernel holds for the socket)
+    size_t heap_after = heap_used();
+    printf("idle     %8zu bytes of heap per connection on top of sizeof(Connection)\n",
+           heap_after > heap_before ? (heap_after - heap_before)/connections_count : 0);
+    free(bytes);
+    free(lens);
+
+    printf("OK\n");
+    return 0;
+}
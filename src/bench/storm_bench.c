@@ -0,0 +1,203 @@
+// Reconnect storm against a running server: opens all the connections at once, like the clients do
+// right after a restart, and measures how long it takes until every one of them completes the
+// WebSocket handshake.
+//
+// $ node build.js bench
+// $ ./build/server &
+// $ ./build/storm_bench [connections] [host]
+#define _GNU_SOURCE
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "common.h"
+
+// Gives up on the connections that did not complete the handshake by then
+#define STORM_TIMEOUT_SECS 30.0
+
+typedef enum {
+    CS_CONNECTING = 0,
+    CS_READING,
+    CS_DONE,
+    CS_FAILED,
+} Conn_State;
+
+typedef struct {
+    int fd;
+    Conn_State state;
+    double started_at;
+    double latency;
+    char response[1024];
+    size_t response_len;
+} Conn;
+
+static const char request[] =
+    "GET / HTTP/1.1\r\n"
+    "Host: localhost\r\n"
+    "Upgrade: websocket\r\n"
+    "Connection: Upgrade\r\n"
+    "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+    "Sec-WebSocket-Version: 13\r\n"
+    "\r\n";
+
+static double now_secs(void)
+{
+    struct timespec ts = {0};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec*1e-9;
+}
+
+static int compare_doubles(const void *a, const void *b)
+{
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+static void conn_fail(Conn *conn)
+{
+    close(conn->fd);
+    conn->state = CS_FAILED;
+}
+
+static void conn_update(Conn *conn, short revents)
+{
+    if (revents & (POLLERR|POLLHUP|POLLNVAL)) {
+        conn_fail(conn);
+        return;
+    }
+    switch (conn->state) {
+        case CS_CONNECTING: {
+            if (!(revents & POLLOUT)) return;
+            // The request is tiny and the socket is fresh, so it fits into the send buffer at once
+            if (send(conn->fd, request, sizeof(request) - 1, MSG_NOSIGNAL) != sizeof(request) - 1) {
+                conn_fail(conn);
+                return;
+            }
+            conn->state = CS_READING;
+        } break;
+        case CS_READING: {
+            if (!(revents & POLLIN)) return;
+            ssize_t n = recv(conn->fd, conn->response + conn->response_len, sizeof(conn->response) - 1 - conn->response_len, 0);
+            if (n <= 0) {
+                conn_fail(conn);
+                return;
+            }
+            conn->response_len += n;
+            conn->response[conn->response_len] = '\0';
+            if (strstr(conn->response, "\r\n\r\n") == NULL) {
+                if (conn->response_len + 1 >= sizeof(conn->response)) conn_fail(conn);
+                return;
+            }
+            if (strncmp(conn->response, "HTTP/1.1 101", 12) != 0) {
+                conn_fail(conn);
+                return;
+            }
+            conn->latency = now_secs() - conn->started_at;
+            conn->state = CS_DONE;
+            close(conn->fd);
+        } break;
+        case CS_DONE:
+        case CS_FAILED:
+        default: break;
+    }
+}
+
+int main(int argc, char **argv)
+{
+    size_t conns_count = argc > 1 ? strtoul(argv[1], NULL, 10) : 1000;
+    const char *host = argc > 2 ? argv[2] : "127.0.0.1";
+
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    struct sockaddr_in addr = {0};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(SERVER_PORT);
+    addr.sin_addr.s_addr = inet_addr(host);
+
+    Conn *conns = calloc(conns_count, sizeof(*conns));
+    struct pollfd *pfds = calloc(conns_count, sizeof(*pfds));
+    size_t *pfd_conns = calloc(conns_count, sizeof(*pfd_conns));
+    double *latencies = calloc(conns_count, sizeof(*latencies));
+    if (conns == NULL || pfds == NULL || pfd_conns == NULL || latencies == NULL) {
+        fprintf(stderr, "ERROR: could not allocate %zu connections\n", conns_count);
+        return 1;
+    }
+
+    double started_at = now_secs();
+    for (size_t i = 0; i < conns_count; ++i) {
+        Conn *conn = &conns[i];
+        conn->started_at = now_secs();
+        conn->fd = socket(AF_INET, SOCK_STREAM|SOCK_NONBLOCK, 0);
+        if (conn->fd < 0) {
+            fprintf(stderr, "ERROR: could not create socket: %s\n", strerror(errno));
+            conn->state = CS_FAILED;
+            continue;
+        }
+        if (connect(conn->fd, (void*)&addr, sizeof(addr)) < 0 && errno != EINPROGRESS) {
+            conn_fail(conn);
+        }
+    }
+
+    while (now_secs() - started_at < STORM_TIMEOUT_SECS) {
+        size_t pfds_count = 0;
+        for (size_t i = 0; i < conns_count; ++i) {
+            Conn_State state = conns[i].state;
+            if (state == CS_DONE || state == CS_FAILED) continue;
+            pfds[pfds_count].fd = conns[i].fd;
+            pfds[pfds_count].events = state == CS_CONNECTING ? POLLOUT : POLLIN;
+            pfds[pfds_count].revents = 0;
+            pfd_conns[pfds_count] = i;
+            pfds_count += 1;
+        }
+        if (pfds_count == 0) break;
+
+        if (poll(pfds, pfds_count, 100) < 0 && errno != EINTR) {
+            fprintf(stderr, "ERROR: could not poll: %s\n", strerror(errno));
+            return 1;
+        }
+        for (size_t i = 0; i < pfds_count; ++i) {
+            if (pfds[i].revents) conn_update(&conns[pfd_conns[i]], pfds[i].revents);
+        }
+    }
+    double elapsed = now_secs() - started_at;
+
+    size_t done = 0, failed = 0, timed_out = 0;
+    for (size_t i = 0; i < conns_count; ++i) {
+        switch (conns[i].state) {
+            case CS_DONE:   latencies[done++] = conns[i].latency; break;
+            case CS_FAILED: failed += 1; break;
+            default:        timed_out += 1; close(conns[i].fd); break;
+        }
+    }
+    qsort(latencies, done, sizeof(*latencies), compare_doubles);
+
+    printf("Connections:     %zu (%zu done, %zu failed, %zu timed out)\n", conns_count, done, failed, timed_out);
+    printf("Storm took:      %.3f s\n", elapsed);
+    if (done > 0) {
+        printf("Handshakes/s:    %.0f\n", done/elapsed);
+        printf("Latency p50:     %.3f s\n", latencies[done*50/100]);
+        printf("Latency p90:     %.3f s\n", latencies[done*90/100]);
+        printf("Latency p99:     %.3f s\n", latencies[done*99/100]);
+        printf("Latency max:     %.3f s\n", latencies[done - 1]);
+    }
+
+    free(conns);
+    free(pfds);
+    free(pfd_conns);
+    free(latencies);
+    return 0;
+}
@@ -309,3 +309,156 @@ bool scene_can_rectangle_fit_here(float px, float py, float sx, float sy) {
     }
     return true;
 }
+
+// Spatial Grid //////////////////////////////
+
+IVector2 spatial_grid_cell(Vector2 position) {
+    return ivector2_from_vector2(vector2_floor(vector2_mul(position, vector2_xx(1.0f/SPATIAL_GRID_CELL_SIZE))));
+}
+
+static size_t spatial_grid_bucket(const Spatial_Grid *grid, IVector2 cell) {
+    uint32_t hash = ((uint32_t)cell.x*73856093u)^((uint32_t)cell.y*19349663u);
+    return hash&(grid->buckets_count - 1);
+}
+
+static void spatial_grid_link(Spatial_Grid *grid, size_t index) {
+    Spatial_Grid_Node *node = &grid->nodes[index];
+    uint32_t *head = &grid->buckets[spatial_grid_bucket(grid, node->cell)];
+    node->prev = 0;
+    node->next = *head;
+    if (*head != 0) grid->nodes[*head - 1].prev = index + 1;
+    *head = index + 1;
+}
+
+static void spatial_grid_unlink(Spatial_Grid *grid, size_t index) {
+    Spatial_Grid_Node *node = &grid->nodes[index];
+    if (node->prev != 0) {
+        grid->nodes[node->prev - 1].next = node->next;
+    } else {
+        grid->buckets[spatial_grid_bucket(grid, node->cell)] = node->next;
+    }
+    if (node->next != 0) grid->nodes[node->next - 1].prev = node->prev;
+}
+
+void spatial_grid_insert(Spatial_Grid *grid, size_t index, Vector2 position) {
+    if (index >= grid->nodes_count) return;
+    Spatial_Grid_Node *node = &grid->nodes[index];
+    if (node->inserted) {
+        spatial_grid_update(grid, index, position);
+        return;
+    }
+    node->position = position;
+    node->cell = spatial_grid_cell(position);
+    node->inserted = true;
+    spatial_grid_link(grid, index);
+}
+
+// Cheap unless the entity has moved to another cell
+void spatial_grid_update(Spatial_Grid *grid, size_t index, Vector2 position) {
+    if (index >= grid->nodes_count) return;
+    Spatial_Grid_Node *node = &grid->nodes[index];
+    if (!node->inserted) {
+        spatial_grid_insert(grid, index, position);
+        return;
+    }
+    node->position = position;
+    IVector2 cell = spatial_grid_cell(position);
+    if (cell.x == node->cell.x && cell.y == node->cell.y) return;
+    spatial_grid_unlink(grid, index);
+    node->cell = cell;
+    spatial_grid_link(grid, index);
+}
+
+void spatial_grid_remove(Spatial_Grid *grid, size_t index) {
+    if (index >= grid->nodes_count) return;
+    if (!grid->nodes[index].inserted) return;
+    spatial_grid_unlink(grid, index);
+    grid->nodes[index].inserted = false;
+}
+
+Spatial_Grid_Query spatial_grid_query_rect(const Spatial_Grid *grid, Vector2 min, Vector2 max) {
+    Spatial_Grid_Query query = spatial_grid_query_cells(grid, spatial_grid_cell(min), spatial_grid_cell(max));
+    query.min = min;
+    query.max = max;
+    query.whole_cells = false;
+    return query;
+}
+
+// The entities within the cells from cell_min to cell_max inclusive, wherever exactly they are within them
+Spatial_Grid_Query spatial_grid_query_cells(const Spatial_Grid *grid, IVector2 cell_min, IVector2 cell_max) {
+    Spatial_Grid_Query query = {
+        .grid        = grid,
+        .cell_min    = cell_min,
+        .cell_max    = cell_max,
+        .whole_cells = true,
+    };
+    query.cell = query.cell_min;
+    if (query.cell_min.x > query.cell_max.x || query.cell_min.y > query.cell_max.y) {
+        // Empty. There is nothing to iterate over
+        query.cell.y = query.cell_max.y + 1;
+        return query;
+    }
+    float cells = ((float)query.cell_max.x - query.cell_min.x + 1)*((float)query.cell_max.y - query.cell_min.y + 1);
+    query.linear = cells > (float)grid->buckets_count;
+    if (!query.linear) query.node = grid->buckets[spatial_grid_bucket(grid, query.cell)];
+    return query;
+}
+
+// The entities closer than `radius` to `center`
+Spatial_Grid_Query spatial_grid_query_radius(const Spatial_Grid *grid, Vector2 center, float radius) {
+    Spatial_Grid_Query query = spatial_grid_query_rect(grid, vector2_sub(center, vector2_xx(radius)), vector2_add(center, vector2_xx(radius)));
+    query.center = center;
+    query.radius = radius;
+    return query;
+}
+
+static bool spatial_grid_query_accepts(Spatial_Grid_Query *query, const Spatial_Grid_Node *node) {
+    if (query->whole_cells) {
+        return query->cell_min.x <= node->cell.x && node->cell.x <= query->cell_max.x
+            && query->cell_min.y <= node->cell.y && node->cell.y <= query->cell_max.y;
+    }
+    Vector2 p = node->position;
+    if (query->radius > 0) {
+        Vector2 d = vector2_sub(p, query->center);
+        return vector2_dot(d, d) < query->radius*query->radius;
+    }
+    return query->min.x <= p.x && p.x <= query->max.x && query->min.y <= p.y && p.y <= query->max.y;
+}
+
+bool spatial_grid_query_next(Spatial_Grid_Query *query, size_t *index) {
+    const Spatial_Grid *grid = query->grid;
+    if (query->linear) {
+        while (query->node < grid->nodes_count) {
+            const Spatial_Grid_Node *node = &grid->nodes[query->node++];
+            if (node->inserted && spatial_grid_query_accepts(query, node)) {
+                *index = query->node - 1;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    while (query->cell.y <= query->cell_max.y) {
+        while (query->node != 0) {
+            size_t i = query->node - 1;
+            const Spatial_Grid_Node *node = &grid->nodes[i];
+            query->node = node->next;
+            // NOTE: other cells may share the bucket, so every node is reported only by its own cell
+            if (node->cell.x != query->cell.x || node->cell.y != query->cell.y) continue;
+            if (spatial_grid_query_accepts(query, node)) {
+                *index = i;
+                return true;
+            }
+        }
+
+        if (query->cell.x < query->cell_max.x) {
+            query->cell.x += 1;
+        } else {
+            query->cell.x = query->cell_min.x;
+            query->cell.y += 1;
+            if (query->cell.y > query->cell_max.y) break;
+        }
+        query->node = grid->buckets[spatial_grid_bucket(grid, query->cell)];
+    }
+    return false;
+}
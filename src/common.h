@@ -92,6 +92,53 @@ typedef struct {
 bool scene_can_rectangle_fit_here(float px, float py, float sx, float sy);
 bool scene_get_tile(Vector2 p);
 
+// Spatial Grid //////////////////////////////
+
+// The cells of the grid are the tiles of the scene (see scene_get_tile()). The world is not bounded by
+// the scene though, so the cells are hashed into a fixed amount of buckets instead of being laid out
+// in a 2D array.
+#define SPATIAL_GRID_CELL_SIZE 1.0f
+
+typedef struct {
+    Vector2 position;
+    IVector2 cell;
+    uint32_t prev;      // Index + 1 of the previous node in the bucket. 0 if it is the first one
+    uint32_t next;      // Index + 1 of the next node in the bucket. 0 if it is the last one
+    bool inserted;
+} Spatial_Grid_Node;
+
+// NOTE: The grid does not allocate anything, so it works in the client too. The storage is provided by
+// the user and may be zero initialized: `buckets` must have a power of two elements and `nodes` has
+// one element per entity, indexed by the index of the entity (in items_ptr(), Bombs.items, etc).
+typedef struct {
+    uint32_t *buckets;          // Index + 1 of the first node in the bucket. 0 if the bucket is empty
+    size_t buckets_count;
+    Spatial_Grid_Node *nodes;
+    size_t nodes_count;
+} Spatial_Grid;
+
+// Iterates over the entities within a rectangle, a circle or a range of cells. Removing the entity that was just
+// returned by spatial_grid_query_next() from the grid while iterating is fine, anything else is not.
+typedef struct {
+    const Spatial_Grid *grid;
+    Vector2 min, max;
+    Vector2 center;
+    float radius;               // 0 for the rectangle queries
+    bool whole_cells;           // Everything in the cells goes, see spatial_grid_query_cells()
+    IVector2 cell_min, cell_max, cell;
+    uint32_t node;              // Index + 1 of the next node to look at in the bucket of `cell`, or the index of it if `linear`
+    bool linear;                // The area covers too many cells, so all the nodes are checked instead
+} Spatial_Grid_Query;
+
+IVector2 spatial_grid_cell(Vector2 position);
+void spatial_grid_insert(Spatial_Grid *grid, size_t index, Vector2 position);
+void spatial_grid_update(Spatial_Grid *grid, size_t index, Vector2 position);
+void spatial_grid_remove(Spatial_Grid *grid, size_t index);
+Spatial_Grid_Query spatial_grid_query_rect(const Spatial_Grid *grid, Vector2 min, Vector2 max);
+Spatial_Grid_Query spatial_grid_query_radius(const Spatial_Grid *grid, Vector2 center, float radius);
+Spatial_Grid_Query spatial_grid_query_cells(const Spatial_Grid *grid, IVector2 cell_min, IVector2 cell_max);
+bool spatial_grid_query_next(Spatial_Grid_Query *query, size_t *index);
+
 // Player //////////////////////////////
 
 typedef enum {
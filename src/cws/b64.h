@@ -25,6 +25,26 @@ size_t b64_encode(const unsigned char *in, size_t in_len, char *out, size_t out_
     size_t out_len = 0;
     size_t in_cur = 0;
     uint32_t group = 0;
+    // 6 bytes of input make exactly 8 characters of output, so twice as much is encoded per iteration
+    while (in_cur + 6 <= in_len) {
+        uint64_t group48 = 0;
+        group48 |= ((uint64_t)(in[in_cur + 0]))<<(5*8);
+        group48 |= ((uint64_t)(in[in_cur + 1]))<<(4*8);
+        group48 |= ((uint64_t)(in[in_cur + 2]))<<(3*8);
+        group48 |= ((uint64_t)(in[in_cur + 3]))<<(2*8);
+        group48 |= ((uint64_t)(in[in_cur + 4]))<<(1*8);
+        group48 |= ((uint64_t)(in[in_cur + 5]))<<(0*8);
+        in_cur += 6;
+        out[out_len + 0] = alpha[(group48>>(7*6))&0x3F];
+        out[out_len + 1] = alpha[(group48>>(6*6))&0x3F];
+        out[out_len + 2] = alpha[(group48>>(5*6))&0x3F];
+        out[out_len + 3] = alpha[(group48>>(4*6))&0x3F];
+        out[out_len + 4] = alpha[(group48>>(3*6))&0x3F];
+        out[out_len + 5] = alpha[(group48>>(2*6))&0x3F];
+        out[out_len + 6] = alpha[(group48>>(1*6))&0x3F];
+        out[out_len + 7] = alpha[(group48>>(0*6))&0x3F];
+        out_len += 8;
+    }
     while (in_cur + 3 <= in_len) {
         group = 0;
         group |= ((uint32_t)(in[in_cur++]))<<(2*8);
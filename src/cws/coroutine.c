@@ -4,15 +4,47 @@
 #include <stdbool.h>
 #include <string.h>
 
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <poll.h>
+#include <pthread.h>
+#include <time.h>
 #include <unistd.h>
 #include <sys/mman.h>
 
 #include "coroutine.h"
 
-// TODO: make the STACK_CAPACITY customizable by the user
-//#define STACK_CAPACITY (4*1024)
-#define STACK_CAPACITY (1024*getpagesize())
+// The epoll backend is used on Linux unless COROUTINE_NO_EPOLL is defined. If epoll_create1() fails
+// the runtime falls back to poll() as well.
+#if defined(__linux__) && !defined(COROUTINE_NO_EPOLL)
+#define COROUTINE_EPOLL
+#include <sys/epoll.h>
+#endif // __linux__ && !COROUTINE_NO_EPOLL
+
+// The stack size of coroutine_go(). See coroutine_go_with_stack() for the custom ones.
+#define DEFAULT_STACK_SIZE (1024*getpagesize())
+// How many stacks are mapped with a single mmap(). Every mapping counts against vm.max_map_count
+// (65530 by default), so mapping the stacks one by one caps the runtime at ~65k coroutines.
+#define STACKS_PER_MAPPING 64
+
+// Installs guard pages without splitting the mapping (Linux 6.13+). The older kernels get
+// mprotect(PROT_NONE) instead, which costs an extra mapping per stack.
+#ifndef MADV_GUARD_INSTALL
+#define MADV_GUARD_INSTALL 102
+#endif // MADV_GUARD_INSTALL
+
+// With COROUTINE_STACK_DEBUG the stacks are filled with this byte before a coroutine starts, so
+// coroutine_stack_high_water() can tell how deep it went
+#define STACK_DEBUG_FILL 0xAA
+
+// With COROUTINE_STATS the scheduler keeps the statistics of every coroutine (see coroutine_stats()).
+// It costs a clock_gettime() per context switch, so it is off by default.
+#ifdef COROUTINE_STATS
+#define stats_now() coroutine_now()
+#else
+#define stats_now() 0
+#endif // COROUTINE_STATS
 
 // Initial capacity of a dynamic array
 #ifndef DA_INIT_CAP
@@ -42,9 +74,31 @@
 #define TODO(message) do { fprintf(stderr, "%s:%d: TODO: %s\n", __FILE__, __LINE__, message); abort(); } while(0)
 #define UNREACHABLE(message) do { fprintf(stderr, "%s:%d: UNREACHABLE: %s\n", __FILE__, __LINE__, message); abort(); } while(0)
 
+typedef enum {
+    SM_NONE = 0,
+    SM_READ,
+    SM_WRITE,
+    SM_WAKE_UP, // Sleeps until coroutine_wake_up()
+    SM_TIMER,   // Sleeps until the deadline in timers
+} Sleep_Mode;
+
 typedef struct {
     void *rsp;
-    void *stack_base;
+    void *stack_base;       // The lowest address of the stack. The guard page is right below it
+    size_t stack_size;      // 0 for the main coroutine which runs on the stack of the process
+    Sleep_Mode sleep_mode;  // SM_NONE if the coroutine is not sleeping
+    size_t timer_index;     // Where the coroutine is in timers while it is in SM_TIMER
+    // poll backend only
+    size_t poll_index;      // Where the coroutine is in asleep and polls while it is in SM_READ or SM_WRITE
+    // epoll backend only
+    int sleep_fd;           // The fd the coroutine is sleeping on, -1 if it is not sleeping
+    size_t prev_waiter;     // id+1 of the previous coroutine sleeping on the same fd in the same mode, 0 if it is the first
+    size_t next_waiter;     // id+1 of the next coroutine sleeping on the same fd in the same mode, 0 ends the list
+#ifdef COROUTINE_STATS
+    Coroutine_Stats stats;
+    uint64_t ready_at;      // When the coroutine was woken up, 0 if it was not sleeping
+    uint64_t resumed_at;    // When the coroutine got on the CPU the last time
+#endif // COROUTINE_STATS
 } Context;
 
 typedef struct {
@@ -65,23 +119,112 @@ typedef struct {
     size_t capacity;
 } Polls;
 
-// TODO: coroutines library probably does not work well in multithreaded environment
-static size_t current     = 0;
-static Indices active     = {0};
-static Indices dead       = {0};
-static Contexts contexts  = {0};
-static Indices asleep     = {0};
-static Polls polls        = {0};
+typedef struct {
+    uint64_t deadline;
+    size_t id;
+} Timer;
+
+// Binary min-heap of the coroutines sleeping in coroutine_sleep_until() ordered by the deadline
+typedef struct {
+    Timer *items;
+    size_t count;
+    size_t capacity;
+} Timers;
+
+#ifdef COROUTINE_EPOLL
+// The coroutines sleeping on a particular fd. Indexed by the fd.
+typedef struct {
+    size_t readers;   // id+1 of the first coroutine waiting to read, 0 if none (see Context.next_waiter)
+    size_t writers;   // id+1 of the first coroutine waiting to write, 0 if none
+    bool registered;  // The fd is in the epoll set. Stays there until coroutine_forget_fd()
+    // NOTE: the registrations are edge-triggered, so an edge that came while nobody was waiting is
+    // remembered here. Otherwise the next coroutine going to sleep on the fd would never be woken up.
+    bool readable;
+    bool writable;
+} Fd_Waiters;
+
+typedef struct {
+    Fd_Waiters *items;
+    size_t count;
+    size_t capacity;
+} Fd_Table;
+#endif // COROUTINE_EPOLL
+
+// The finished coroutines grouped by the size of their stacks. coroutine_go_with_stack() reuses
+// the context together with the stack of a finished coroutine if there is one with the same stack
+// size, and carves a new stack out of the mapping of the pool otherwise.
+typedef struct {
+    size_t stack_size;
+    Indices dead;
+    char *mapping;          // The stacks that were never used yet
+    size_t mapping_left;
+} Stack_Pool;
+
+typedef struct {
+    Stack_Pool *items;
+    size_t count;
+    size_t capacity;
+} Stack_Pools;
+
+// A coroutine that was handed over to a scheduler (see coroutine_go_on() and
+// coroutine_go_anywhere()) but has not started yet
+typedef struct {
+    void (*f)(void*);
+    void *arg;
+    size_t stack_size;
+    bool pinned;  // Can not be stolen by the other schedulers
+} Task;
+
+typedef struct {
+    Task *items;
+    size_t count;
+    size_t capacity;
+} Tasks;
+
+// The part of a scheduler the other threads can touch. Everything else in the runtime is thread
+// local and is only ever touched by the thread that owns it.
+struct Coroutine_Scheduler {
+    pthread_mutex_t lock;
+    Tasks tasks;          // Protected by lock
+    size_t tasks_count;   // Atomic copy of tasks.count, so the owner can check it without locking
+    bool idle;            // Atomic. The owner is about to block in poll()/epoll_wait() or is blocked there
+    int wake_fds[2];      // A pipe that wakes up the idle owner. Registered in its poll()/epoll_wait()
+};
+
+typedef struct {
+    Coroutine_Scheduler **items;
+    size_t count;
+    size_t capacity;
+} Schedulers;
+
+// Every thread that called coroutine_init() has its own scheduler with its own coroutines. The
+// coroutines never move between the threads once they have started: their stacks, fds and timers
+// belong to the scheduler that started them. Only the tasks that did not start yet are stolen.
+static _Thread_local size_t current     = 0;
+static _Thread_local Indices active     = {0};
+static _Thread_local Contexts contexts  = {0};
+static _Thread_local Indices asleep     = {0};
+static _Thread_local Polls polls        = {0};
+static _Thread_local int epoll_fd       = -1;
+static _Thread_local Timers timers      = {0};
+static _Thread_local Stack_Pools pools  = {0};
+static _Thread_local uint64_t idle_time = 0; // See coroutine_idle_time()
+static _Thread_local Coroutine_Scheduler *scheduler = NULL;
+static _Thread_local Coroutine_Scheduler_Stats scheduler_stats = {0}; // See coroutine_scheduler_stats()
+static _Thread_local size_t finished = 0; // The coroutine whose stack is not back in the pool yet. See coroutine__finish_current()
+#ifdef COROUTINE_EPOLL
+static _Thread_local Fd_Table fds       = {0};
+static _Thread_local size_t sleeping    = 0; // How many coroutines are waiting in fds
+#endif // COROUTINE_EPOLL
+
+static pthread_mutex_t schedulers_lock = PTHREAD_MUTEX_INITIALIZER;
+static Schedulers schedulers           = {0}; // Protected by schedulers_lock
+static size_t schedulers_count         = 0;   // Atomic copy of schedulers.count
+static size_t schedulers_next          = 0;   // Round robin of coroutine_go_anywhere() from the threads without a scheduler
 
 // TODO: ARM support
 //   Requires modifications in all the @arch places
 
-typedef enum {
-    SM_NONE = 0,
-    SM_READ,
-    SM_WRITE,
-} Sleep_Mode;
-
 // Linux x86_64 call convention
 // %rdi, %rsi, %rdx, %rcx, %r8, and %r9
 
@@ -135,6 +278,39 @@ void __attribute__((naked)) coroutine_sleep_write(int fd __attribute__((unused))
     "    jmp coroutine_switch_context\n");
 }
 
+void __attribute__((naked)) coroutine_sleep(void)
+{
+    // @arch
+    asm(
+    "    pushq %rdi\n"
+    "    pushq %rbp\n"
+    "    pushq %rbx\n"
+    "    pushq %r12\n"
+    "    pushq %r13\n"
+    "    pushq %r14\n"
+    "    pushq %r15\n"
+    "    movq %rsp, %rdi\n"     // rsp
+    "    movq $3, %rsi\n"       // sm = SM_WAKE_UP
+    "    jmp coroutine_switch_context\n");
+}
+
+void __attribute__((naked)) coroutine_sleep_until(uint64_t deadline __attribute__((unused)))
+{
+    // @arch
+    asm(
+    "    pushq %rdi\n"
+    "    pushq %rbp\n"
+    "    pushq %rbx\n"
+    "    pushq %r12\n"
+    "    pushq %r13\n"
+    "    pushq %r14\n"
+    "    pushq %r15\n"
+    "    movq %rdi, %rdx\n"     // deadline
+    "    movq %rsp, %rdi\n"     // rsp
+    "    movq $4, %rsi\n"       // sm = SM_TIMER
+    "    jmp coroutine_switch_context\n");
+}
+
 void __attribute__((naked)) coroutine_restore_context(void *rsp __attribute__((unused)))
 {
     // @arch
@@ -150,103 +326,676 @@ void __attribute__((naked)) coroutine_restore_context(void *rsp __attribute__((u
     "    ret\n");
 }
 
-void coroutine_switch_context(void *rsp, Sleep_Mode sm, int fd)
+uint64_t coroutine_now(void)
 {
-    contexts.items[active.items[current]].rsp = rsp;
+    struct timespec ts = {0};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec*1000*1000*1000 + (uint64_t)ts.tv_nsec;
+}
+
+// Puts a coroutine that was sleeping back to active. `ready_at` is when whatever it was waiting for
+// has happened.
+static void coroutine__activate(size_t id, uint64_t ready_at)
+{
+#ifdef COROUTINE_STATS
+    contexts.items[id].ready_at = ready_at;
+#else
+    UNUSED(ready_at);
+#endif // COROUTINE_STATS
+    da_append(&active, id);
+}
+
+// Accounts the time the current coroutine was running when it switches away or finishes
+static void coroutine__stats_leave(void)
+{
+#ifdef COROUTINE_STATS
+    Context *context = &contexts.items[active.items[current]];
+    uint64_t cpu_time = coroutine_now() - context->resumed_at;
+    context->stats.cpu_time += cpu_time;
+    scheduler_stats.cpu_time += cpu_time;
+#endif // COROUTINE_STATS
+}
+
+static void coroutine__stats_sleep(size_t id)
+{
+#ifdef COROUTINE_STATS
+    contexts.items[id].stats.sleeps += 1;
+#else
+    UNUSED(id);
+#endif // COROUTINE_STATS
+}
+
+static void coroutine__stats_resume(size_t id)
+{
+#ifdef COROUTINE_STATS
+    Context *context = &contexts.items[id];
+    uint64_t now = coroutine_now();
+    context->resumed_at = now;
+    context->stats.switches += 1;
+    scheduler_stats.switches += 1;
+    if (context->ready_at != 0) {
+        uint64_t latency = now > context->ready_at ? now - context->ready_at : 0;
+        context->stats.wake_latency += latency;
+        context->stats.wakes += 1;
+        if (latency > context->stats.max_wake_latency) context->stats.max_wake_latency = latency;
+        scheduler_stats.wake_latency += latency;
+        scheduler_stats.wakes += 1;
+        context->ready_at = 0;
+    }
+#else
+    UNUSED(id);
+#endif // COROUTINE_STATS
+}
+
+static void coroutine__timers_swap(size_t i, size_t j)
+{
+    Timer t = timers.items[i];
+    timers.items[i] = timers.items[j];
+    timers.items[j] = t;
+    contexts.items[timers.items[i].id].timer_index = i;
+    contexts.items[timers.items[j].id].timer_index = j;
+}
+
+static void coroutine__timers_sift_up(size_t i)
+{
+    while (i > 0 && timers.items[(i - 1)/2].deadline > timers.items[i].deadline) {
+        coroutine__timers_swap(i, (i - 1)/2);
+        i = (i - 1)/2;
+    }
+}
 
+static void coroutine__timers_sift_down(size_t i)
+{
+    while (true) {
+        size_t min = i;
+        size_t left = 2*i + 1;
+        size_t right = 2*i + 2;
+        if (left < timers.count && timers.items[left].deadline < timers.items[min].deadline) min = left;
+        if (right < timers.count && timers.items[right].deadline < timers.items[min].deadline) min = right;
+        if (min == i) return;
+        coroutine__timers_swap(i, min);
+        i = min;
+    }
+}
+
+static void coroutine__timers_push(size_t id, uint64_t deadline)
+{
+    da_append(&timers, ((Timer){.deadline = deadline, .id = id}));
+    contexts.items[id].timer_index = timers.count - 1;
+    coroutine__timers_sift_up(timers.count - 1);
+}
+
+static void coroutine__timers_remove(size_t i)
+{
+    assert(i < timers.count);
+    size_t last = timers.count - 1;
+    if (i != last) {
+        coroutine__timers_swap(i, last);
+        timers.count -= 1;
+        coroutine__timers_sift_down(i);
+        coroutine__timers_sift_up(i);
+    } else {
+        timers.count -= 1;
+    }
+}
+
+// Wakes up all the coroutines whose deadline has come
+static void coroutine__timers_wake_up(uint64_t now)
+{
+    while (timers.count > 0 && timers.items[0].deadline <= now) {
+        size_t id = timers.items[0].id;
+        uint64_t deadline = timers.items[0].deadline;
+        coroutine__timers_remove(0);
+        contexts.items[id].sleep_mode = SM_NONE;
+        coroutine__activate(id, deadline);
+    }
+}
+
+// The timeout for poll()/epoll_wait() when there is nothing active to run: until the nearest
+// deadline, or forever if there are no timers
+static int coroutine__timers_timeout(uint64_t now)
+{
+    if (timers.count == 0) return -1;
+    uint64_t deadline = timers.items[0].deadline;
+    if (deadline <= now) return 0;
+    // NOTE: rounding up, so the scheduler does not wake up a bit too early and spin until the deadline
+    uint64_t msecs = (deadline - now + 1000*1000 - 1)/(1000*1000);
+    return msecs > INT_MAX ? INT_MAX : (int)msecs;
+}
+
+#ifdef COROUTINE_EPOLL
+static Fd_Waiters *coroutine__fd_waiters(int fd)
+{
+    assert(fd >= 0);
+    if ((size_t)fd >= fds.count) {
+        size_t count = (size_t)fd + 1;
+        if (count > fds.capacity) {
+            size_t capacity = fds.capacity == 0 ? DA_INIT_CAP : fds.capacity;
+            while (capacity < count) capacity *= 2;
+            fds.items = realloc(fds.items, capacity*sizeof(*fds.items));
+            assert(fds.items != NULL && "Buy more RAM lol");
+            fds.capacity = capacity;
+        }
+        memset(fds.items + fds.count, 0, (count - fds.count)*sizeof(*fds.items));
+        fds.count = count;
+    }
+    return &fds.items[fd];
+}
+
+// Puts coroutine `id` on the waiting list of `fd`. Returns false if the fd is already ready, in which
+// case the coroutine should just keep running.
+static bool coroutine__epoll_sleep(size_t id, Sleep_Mode sm, int fd)
+{
+    Fd_Waiters *waiters = coroutine__fd_waiters(fd);
+    if (!waiters->registered) {
+        // NOTE: registering for both directions at once, so the fd never has to be modified later.
+        // If the fd is already ready epoll reports that right away.
+        struct epoll_event event = {
+            .events = EPOLLIN|EPOLLOUT|EPOLLRDHUP|EPOLLET,
+            .data.fd = fd,
+        };
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+            if (errno != EEXIST) {
+                // Most likely a bad fd. Let the coroutine find that out on its own.
+                return false;
+            }
+        }
+        waiters->registered = true;
+    }
+
+    size_t *list;
+    bool *ready;
     switch (sm) {
-    case SM_NONE: current += 1; break;
-    case SM_READ: {
-        da_append(&asleep, active.items[current]);
-        struct pollfd pfd = {.fd = fd, .events = POLLRDNORM,};
-        da_append(&polls, pfd);
-        da_remove_unordered(&active, current);
-    } break;
+    case SM_READ:  list = &waiters->readers; ready = &waiters->readable; break;
+    case SM_WRITE: list = &waiters->writers; ready = &waiters->writable; break;
+    default: UNREACHABLE("coroutine__epoll_sleep");
+    }
 
-    case SM_WRITE: {
-        da_append(&asleep, active.items[current]);
-        struct pollfd pfd = {.fd = fd, .events = POLLWRNORM,};
-        da_append(&polls, pfd);
-        da_remove_unordered(&active, current);
-    } break;
+    if (*ready) {
+        *ready = false;
+        return false;
+    }
 
-    default: UNREACHABLE("coroutine_switch_context");
+    contexts.items[id].sleep_fd = fd;
+    contexts.items[id].sleep_mode = sm;
+    contexts.items[id].prev_waiter = 0;
+    contexts.items[id].next_waiter = *list;
+    if (*list != 0) contexts.items[*list - 1].prev_waiter = id + 1;
+    *list = id + 1;
+    sleeping += 1;
+    return true;
+}
+
+// Takes coroutine `id` off the waiting list of its fd
+static void coroutine__epoll_unlink(size_t id)
+{
+    Context *context = &contexts.items[id];
+    assert(context->sleep_fd >= 0);
+    Fd_Waiters *waiters = &fds.items[context->sleep_fd];
+    if (context->prev_waiter != 0) {
+        contexts.items[context->prev_waiter - 1].next_waiter = context->next_waiter;
+    } else if (context->sleep_mode == SM_READ) {
+        waiters->readers = context->next_waiter;
+    } else {
+        waiters->writers = context->next_waiter;
+    }
+    if (context->next_waiter != 0) {
+        contexts.items[context->next_waiter - 1].prev_waiter = context->prev_waiter;
+    }
+    context->sleep_mode = SM_NONE;
+    context->sleep_fd = -1;
+    context->prev_waiter = 0;
+    context->next_waiter = 0;
+    sleeping -= 1;
+}
+
+static void coroutine__epoll_wake_list(size_t *list, uint64_t ready_at)
+{
+    while (*list != 0) {
+        size_t id = *list - 1;
+        *list = contexts.items[id].next_waiter;
+        contexts.items[id].sleep_mode = SM_NONE;
+        contexts.items[id].sleep_fd = -1;
+        contexts.items[id].prev_waiter = 0;
+        contexts.items[id].next_waiter = 0;
+        sleeping -= 1;
+        coroutine__activate(id, ready_at);
+    }
+}
+
+static void coroutine__epoll_wake_up(int timeout)
+{
+    struct epoll_event events[256];
+    while (true) {
+        int n = epoll_wait(epoll_fd, events, sizeof(events)/sizeof(events[0]), timeout);
+        if (n < 0) {
+            // Interrupted by a signal. Retrying with the same timeout would never end if the signals keep
+            // coming, so coroutine__switch_to_next() comes back here with the one left to the timers instead.
+            if (errno == EINTR) return;
+            fprintf(stderr, "ERROR: epoll_wait: %s\n", strerror(errno));
+            abort();
+        }
+        scheduler_stats.polls += 1;
+        scheduler_stats.ready_fds += n;
+        uint64_t ready_at = n > 0 ? stats_now() : 0;
+        for (int i = 0; i < n; ++i) {
+            Fd_Waiters *waiters = &fds.items[events[i].data.fd];
+            uint32_t e = events[i].events;
+            if (e & (EPOLLIN|EPOLLRDHUP|EPOLLHUP|EPOLLERR)) {
+                if (waiters->readers) coroutine__epoll_wake_list(&waiters->readers, ready_at);
+                else waiters->readable = true;
+            }
+            if (e & (EPOLLOUT|EPOLLHUP|EPOLLERR)) {
+                if (waiters->writers) coroutine__epoll_wake_list(&waiters->writers, ready_at);
+                else waiters->writable = true;
+            }
+        }
+        // The buffer was not big enough to fit all the events. Collect the rest without blocking.
+        if ((size_t)n < sizeof(events)/sizeof(events[0])) break;
+        timeout = 0;
+    }
+}
+#endif // COROUTINE_EPOLL
+
+// Takes the coroutine at `i` out of asleep and polls. Returns its id.
+static size_t coroutine__poll_remove(size_t i)
+{
+    size_t id = asleep.items[i];
+    da_remove_unordered(&polls, i);
+    da_remove_unordered(&asleep, i);
+    if (i < asleep.count) contexts.items[asleep.items[i]].poll_index = i;
+    contexts.items[id].sleep_mode = SM_NONE;
+    return id;
+}
+
+static void coroutine__poll_wake_up(int timeout)
+{
+    // The wake up pipe of the scheduler goes right past the sleeping coroutines only for the time of
+    // the poll()
+    da_append(&polls, ((struct pollfd){.fd = scheduler->wake_fds[0], .events = POLLRDNORM}));
+    int result = poll(polls.items, polls.count, timeout);
+    polls.count -= 1;
+    if (result < 0) {
+        // Interrupted by a signal. See coroutine__epoll_wake_up()
+        if (errno == EINTR) return;
+        // NOTE: EINVAL means there are more sleeping coroutines than RLIMIT_NOFILE allows poll() to take
+        fprintf(stderr, "ERROR: poll() of %zu fds: %s\n", polls.count + 1, strerror(errno));
+        abort();
     }
+    scheduler_stats.polls += 1;
+    scheduler_stats.ready_fds += result;
+
+    uint64_t ready_at = result > 0 ? stats_now() : 0;
+    for (size_t i = 0; i < polls.count;) {
+        if (polls.items[i].revents) {
+            coroutine__activate(coroutine__poll_remove(i), ready_at);
+        } else {
+            ++i;
+        }
+    }
+}
+
+static void coroutine__drain_wake_fd(void)
+{
+    char buffer[64];
+    while (read(scheduler->wake_fds[0], buffer, sizeof(buffer)) > 0);
+}
+
+// Wakes up the owner of `s` if it is blocked in poll()/epoll_wait(). Returns false if it was not.
+static bool coroutine__scheduler_kick(Coroutine_Scheduler *s)
+{
+    // NOTE: the owner sets idle before it checks tasks_count for the last time and goes to sleep (see
+    // coroutine__switch_to_next()), and the tasks are pushed before the kick. So either the owner sees
+    // the new task, or we see it idle and wake it up.
+    if (!__atomic_exchange_n(&s->idle, false, __ATOMIC_SEQ_CST)) return false;
+    while (write(s->wake_fds[1], "", 1) < 0 && errno == EINTR);
+    return true;
+}
+
+static void coroutine__push_task(Coroutine_Scheduler *s, Task task)
+{
+    pthread_mutex_lock(&s->lock);
+    da_append(&s->tasks, task);
+    __atomic_store_n(&s->tasks_count, s->tasks.count, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&s->lock);
+}
+
+// Starts the tasks handed over to the current scheduler. With more than one scheduler it leaves a
+// fair share of the ones that are not pinned for the idle schedulers to steal, and gets to the rest
+// on the next round if nobody does.
+static void coroutine__take_tasks(void)
+{
+    if (__atomic_load_n(&scheduler->tasks_count, __ATOMIC_SEQ_CST) == 0) return;
+    size_t shared = __atomic_load_n(&schedulers_count, __ATOMIC_SEQ_CST);
+    pthread_mutex_lock(&scheduler->lock);
+    size_t share = (scheduler->tasks.count + shared - 1)/shared;
+    size_t count = 0;
+    for (size_t i = 0; i < scheduler->tasks.count; ++i) {
+        Task task = scheduler->tasks.items[i];
+        if (task.pinned || share > 0) {
+            if (!task.pinned) share -= 1;
+            coroutine_go_with_stack(task.f, task.arg, task.stack_size);
+        } else {
+            scheduler->tasks.items[count++] = task;
+        }
+    }
+    scheduler->tasks.count = count;
+    __atomic_store_n(&scheduler->tasks_count, count, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&scheduler->lock);
+}
 
-    if (polls.count > 0) {
-        int timeout = active.count == 0 ? -1 : 0;
-        int result = poll(polls.items, polls.count, timeout);
-        if (result < 0) TODO("poll");
-
-        for (size_t i = 0; i < polls.count;) {
-            if (polls.items[i].revents) {
-                size_t id = asleep.items[i];
-                da_remove_unordered(&polls, i);
-                da_remove_unordered(&asleep, i);
-                da_append(&active, id);
+// Starts a half of the tasks that are not pinned from the scheduler with the most tasks waiting.
+// Returns false if there was nothing to steal.
+static bool coroutine__steal_tasks(void)
+{
+    if (__atomic_load_n(&schedulers_count, __ATOMIC_SEQ_CST) < 2) return false;
+
+    Coroutine_Scheduler *victim = NULL;
+    size_t most = 0;
+    pthread_mutex_lock(&schedulers_lock);
+    for (size_t i = 0; i < schedulers.count; ++i) {
+        size_t count = __atomic_load_n(&schedulers.items[i]->tasks_count, __ATOMIC_SEQ_CST);
+        if (schedulers.items[i] != scheduler && count > most) {
+            victim = schedulers.items[i];
+            most = count;
+        }
+    }
+    pthread_mutex_unlock(&schedulers_lock);
+    // NOTE: the schedulers are never freed, so the victim stays valid without holding schedulers_lock
+    if (victim == NULL) return false;
+
+    pthread_mutex_lock(&victim->lock);
+    size_t unpinned = 0;
+    for (size_t i = 0; i < victim->tasks.count; ++i) {
+        if (!victim->tasks.items[i].pinned) unpinned += 1;
+    }
+    // The owner starts its tasks from the front, so we take the ones from the back
+    size_t keep = unpinned/2;
+    size_t count = 0;
+    for (size_t i = 0; i < victim->tasks.count; ++i) {
+        Task task = victim->tasks.items[i];
+        if (task.pinned || keep > 0) {
+            if (!task.pinned) keep -= 1;
+            victim->tasks.items[count++] = task;
+        } else {
+            coroutine_go_with_stack(task.f, task.arg, task.stack_size);
+        }
+    }
+    size_t stolen = victim->tasks.count - count;
+    victim->tasks.count = count;
+    __atomic_store_n(&victim->tasks_count, count, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&victim->lock);
+    return stolen > 0;
+}
+
+static Stack_Pool *coroutine__stack_pool(size_t stack_size)
+{
+    for (size_t i = 0; i < pools.count; ++i) {
+        if (pools.items[i].stack_size == stack_size) return &pools.items[i];
+    }
+    da_append(&pools, ((Stack_Pool){.stack_size = stack_size}));
+    return &pools.items[pools.count - 1];
+}
+
+// Puts the stack of the coroutine that has finished back to the pool. Must be called on some other stack.
+static void coroutine__release_finished(void)
+{
+    if (finished == 0) return;
+    da_append(&coroutine__stack_pool(contexts.items[finished].stack_size)->dead, finished);
+    finished = 0;
+}
+
+// Switches to the next active coroutine. The sleeping ones are checked only after every active
+// coroutine had its turn, so a full round costs a single poll()/epoll_wait() no matter how many
+// coroutines there are. If nobody is active the scheduler blocks in there until some IO is ready or
+// the nearest timer is due.
+static void coroutine__switch_to_next(void)
+{
+    while (current >= active.count) {
+        coroutine__take_tasks();
+        if (active.count == 0) coroutine__steal_tasks();
+
+        uint64_t now = timers.count > 0 ? coroutine_now() : 0;
+        int timeout = active.count == 0 ? coroutine__timers_timeout(now) : 0;
+        bool waiting = false;
+        if (epoll_fd >= 0) {
+#ifdef COROUTINE_EPOLL
+            waiting = sleeping > 0;
+#endif // COROUTINE_EPOLL
+        } else {
+            waiting = polls.count > 0;
+        }
+        // With more than one scheduler the next task may come from another thread
+        bool shared = __atomic_load_n(&schedulers_count, __ATOMIC_SEQ_CST) > 1;
+        assert((waiting || timers.count > 0 || active.count > 0 || shared) && "All the coroutines are asleep forever");
+
+        if (waiting || timeout > 0 || (shared && timeout != 0)) {
+            bool blocking = timeout != 0;
+            if (blocking) {
+                // NOTE: see coroutine__scheduler_kick()
+                __atomic_store_n(&scheduler->idle, true, __ATOMIC_SEQ_CST);
+                if (__atomic_load_n(&scheduler->tasks_count, __ATOMIC_SEQ_CST) > 0) timeout = 0;
+            }
+            uint64_t idle_started_at = blocking ? coroutine_now() : 0;
+            if (epoll_fd >= 0) {
+#ifdef COROUTINE_EPOLL
+                coroutine__epoll_wake_up(timeout);
+#endif // COROUTINE_EPOLL
             } else {
-                ++i;
+                coroutine__poll_wake_up(timeout);
+            }
+            if (blocking) {
+                __atomic_store_n(&scheduler->idle, false, __ATOMIC_SEQ_CST);
+                coroutine__drain_wake_fd();
+                now = coroutine_now();
+                idle_time += now - idle_started_at;
             }
         }
+        if (timers.count > 0) coroutine__timers_wake_up(now);
+        current = 0;
     }
 
     assert(active.count > 0);
-    current %= active.count;
+    coroutine__stats_resume(active.items[current]);
     coroutine_restore_context(contexts.items[active.items[current]].rsp);
 }
 
+// NOTE: the functions above jump here after pushing the registers, and coroutine__finish_current()
+// is entered by the ret of the coroutine function. Either way the stack is not aligned the way the ABI
+// expects on a function entry, which breaks as soon as the compiler uses aligned SSE stores on it.
+// @arch
+void __attribute__((force_align_arg_pointer)) coroutine_switch_context(void *rsp, Sleep_Mode sm, uint64_t arg)
+{
+    coroutine__release_finished();
+    contexts.items[active.items[current]].rsp = rsp;
+    coroutine__stats_leave();
+
+    switch (sm) {
+    case SM_NONE: current += 1; break;
+    case SM_READ:
+    case SM_WRITE: {
+        if (epoll_fd >= 0) {
+#ifdef COROUTINE_EPOLL
+            if (coroutine__epoll_sleep(active.items[current], sm, (int)arg)) {
+                coroutine__stats_sleep(active.items[current]);
+                da_remove_unordered(&active, current);
+            } else {
+                current += 1;
+            }
+#endif // COROUTINE_EPOLL
+        } else {
+            contexts.items[active.items[current]].sleep_mode = sm;
+            contexts.items[active.items[current]].poll_index = asleep.count;
+            da_append(&asleep, active.items[current]);
+            struct pollfd pfd = {.fd = (int)arg, .events = sm == SM_READ ? POLLRDNORM : POLLWRNORM,};
+            da_append(&polls, pfd);
+            coroutine__stats_sleep(active.items[current]);
+            da_remove_unordered(&active, current);
+        }
+    } break;
+
+    case SM_WAKE_UP: {
+        contexts.items[active.items[current]].sleep_mode = SM_WAKE_UP;
+        coroutine__stats_sleep(active.items[current]);
+        da_remove_unordered(&active, current);
+    } break;
+
+    case SM_TIMER: {
+        contexts.items[active.items[current]].sleep_mode = SM_TIMER;
+        coroutine__timers_push(active.items[current], arg);
+        coroutine__stats_sleep(active.items[current]);
+        da_remove_unordered(&active, current);
+    } break;
+
+    default: UNREACHABLE("coroutine_switch_context");
+    }
+
+    coroutine__switch_to_next();
+}
+
 // TODO: think how to get rid of coroutine_init() call at all
 void coroutine_init(void)
 {
     if (contexts.count != 0) return;
-    da_append(&contexts, (Context){0});
+    da_append(&contexts, ((Context){.sleep_fd = -1}));
     da_append(&active, 0);
+#ifdef COROUTINE_STATS
+    contexts.items[0].resumed_at = coroutine_now();
+#endif // COROUTINE_STATS
+#ifdef COROUTINE_EPOLL
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+#endif // COROUTINE_EPOLL
+
+    scheduler = calloc(1, sizeof(*scheduler));
+    assert(scheduler != NULL && "Buy more RAM lol");
+    pthread_mutex_init(&scheduler->lock, NULL);
+    int result = pipe(scheduler->wake_fds);
+    assert(result == 0 && "Could not create the wake up pipe of the scheduler");
+    UNUSED(result);
+    for (size_t i = 0; i < 2; ++i) {
+        fcntl(scheduler->wake_fds[i], F_SETFL, O_NONBLOCK);
+        fcntl(scheduler->wake_fds[i], F_SETFD, FD_CLOEXEC);
+    }
+#ifdef COROUTINE_EPOLL
+    if (epoll_fd >= 0) {
+        struct epoll_event event = {
+            .events = EPOLLIN|EPOLLET,
+            .data.fd = scheduler->wake_fds[0],
+        };
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, scheduler->wake_fds[0], &event) == 0) {
+            // Nobody ever sleeps on it, the readiness is only remembered
+            coroutine__fd_waiters(scheduler->wake_fds[0])->registered = true;
+        }
+    }
+#endif // COROUTINE_EPOLL
+
+    pthread_mutex_lock(&schedulers_lock);
+    da_append(&schedulers, scheduler);
+    __atomic_store_n(&schedulers_count, schedulers.count, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&schedulers_lock);
 }
 
-void coroutine__finish_current(void)
+Coroutine_Scheduler *coroutine_scheduler(void)
 {
-    if (active.items[current] == 0) {
-        UNREACHABLE("Main Coroutine with id == 0 should never reach this place");
+    return scheduler;
+}
+
+void coroutine_go_on(Coroutine_Scheduler *s, void (*f)(void*), void *arg, size_t stack_size)
+{
+    assert(s != NULL);
+    if (s == scheduler) {
+        coroutine_go_with_stack(f, arg, stack_size);
+        return;
     }
+    coroutine__push_task(s, ((Task){.f = f, .arg = arg, .stack_size = stack_size, .pinned = true}));
+    coroutine__scheduler_kick(s);
+}
 
-    da_append(&dead, active.items[current]);
-    da_remove_unordered(&active, current);
+void coroutine_go_anywhere(void (*f)(void*), void *arg, size_t stack_size)
+{
+    Coroutine_Scheduler *s = scheduler;
+    pthread_mutex_lock(&schedulers_lock);
+    assert(schedulers.count > 0 && "coroutine_init() was not called by any thread");
+    if (s == NULL) s = schedulers.items[schedulers_next++%schedulers.count];
+    coroutine__push_task(s, ((Task){.f = f, .arg = arg, .stack_size = stack_size, .pinned = false}));
+    // The owner gets to the task on its next round anyway, but an idle scheduler may steal it sooner
+    if (!coroutine__scheduler_kick(s)) {
+        for (size_t i = 0; i < schedulers.count; ++i) {
+            if (schedulers.items[i] != s && coroutine__scheduler_kick(schedulers.items[i])) break;
+        }
+    }
+    pthread_mutex_unlock(&schedulers_lock);
+}
 
-    if (polls.count > 0) {
-        int timeout = active.count == 0 ? -1 : 0;
-        int result = poll(polls.items, polls.count, timeout);
-        if (result < 0) TODO("poll");
-
-        for (size_t i = 0; i < polls.count;) {
-            if (polls.items[i].revents) {
-                size_t id = asleep.items[i];
-                da_remove_unordered(&polls, i);
-                da_remove_unordered(&asleep, i);
-                da_append(&active, id);
-            } else {
-                ++i;
+static void *coroutine__stack_alloc(Stack_Pool *pool)
+{
+    size_t page_size = getpagesize();
+    size_t slot_size = page_size + pool->stack_size;
+    if (pool->mapping_left == 0) {
+        // NOTE: MAP_NORESERVE, because only the top few pages of a stack are ever touched usually
+        pool->mapping = mmap(NULL, STACKS_PER_MAPPING*slot_size, PROT_WRITE|PROT_READ, MAP_PRIVATE|MAP_STACK|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+        assert(pool->mapping != MAP_FAILED && "Buy more RAM lol");
+        pool->mapping_left = STACKS_PER_MAPPING;
+
+        // Every slot starts with a guard page, so a stack overflow crashes right away instead of
+        // silently corrupting the stack below
+        for (size_t i = 0; i < STACKS_PER_MAPPING; ++i) {
+            char *guard = pool->mapping + i*slot_size;
+            if (madvise(guard, page_size, MADV_GUARD_INSTALL) < 0) {
+                int result = mprotect(guard, page_size, PROT_NONE);
+                assert(result == 0 && "Could not install a stack guard page");
+                UNUSED(result);
             }
         }
     }
+    pool->mapping_left -= 1;
+    return pool->mapping + pool->mapping_left*slot_size + page_size;
+}
 
-    assert(active.count > 0);
-    current %= active.count;
-    coroutine_restore_context(contexts.items[active.items[current]].rsp);
+void __attribute__((force_align_arg_pointer)) coroutine__finish_current(void)
+{
+    if (active.items[current] == 0) {
+        UNREACHABLE("Main Coroutine with id == 0 should never reach this place");
+    }
+
+    // NOTE: we are still running on the stack of the coroutine, and coroutine__switch_to_next() may start
+    // the tasks of the scheduler, which would take the stack right from under us if it was in the pool
+    // already. So it only goes there on the next switch, when somebody else's stack is in use.
+    size_t id = active.items[current];
+    coroutine__stats_leave();
+    coroutine__release_finished();
+    finished = id;
+    da_remove_unordered(&active, current);
+
+    coroutine__switch_to_next();
 }
 
-void coroutine_go(void (*f)(void*), void *arg)
+void coroutine_go_with_stack(void (*f)(void*), void *arg, size_t stack_size)
 {
+    size_t page_size = getpagesize();
+    if (stack_size == 0) stack_size = DEFAULT_STACK_SIZE;
+    stack_size = (stack_size + page_size - 1)/page_size*page_size;
+
+    Stack_Pool *pool = coroutine__stack_pool(stack_size);
     size_t id;
-    if (dead.count > 0) {
-        id = dead.items[--dead.count];
+    if (pool->dead.count > 0) {
+        id = pool->dead.items[--pool->dead.count];
     } else {
-        da_append(&contexts, ((Context){0}));
+        da_append(&contexts, ((Context){.sleep_fd = -1}));
         id = contexts.count-1;
-        contexts.items[id].stack_base = mmap(NULL, STACK_CAPACITY, PROT_WRITE|PROT_READ, MAP_PRIVATE|MAP_STACK|MAP_ANONYMOUS|MAP_GROWSDOWN, -1, 0);
-        assert(contexts.items[id].stack_base != MAP_FAILED);
+        contexts.items[id].stack_base = coroutine__stack_alloc(pool);
+        contexts.items[id].stack_size = stack_size;
     }
 
-    void **rsp = (void**)((char*)contexts.items[id].stack_base + STACK_CAPACITY);
+#ifdef COROUTINE_STACK_DEBUG
+    memset(contexts.items[id].stack_base, STACK_DEBUG_FILL, stack_size);
+#endif // COROUTINE_STACK_DEBUG
+#ifdef COROUTINE_STATS
+    contexts.items[id].stats = (Coroutine_Stats){0};
+    contexts.items[id].ready_at = 0;
+#endif // COROUTINE_STATS
+
+    void **rsp = (void**)((char*)contexts.items[id].stack_base + stack_size);
     // @arch
     *(--rsp) = coroutine__finish_current;
     *(--rsp) = f;
@@ -262,6 +1011,24 @@ void coroutine_go(void (*f)(void*), void *arg)
     da_append(&active, id);
 }
 
+void coroutine_go(void (*f)(void*), void *arg)
+{
+    coroutine_go_with_stack(f, arg, DEFAULT_STACK_SIZE);
+}
+
+size_t coroutine_stack_high_water(size_t id)
+{
+    assert(id < contexts.count);
+#ifdef COROUTINE_STACK_DEBUG
+    const unsigned char *stack = contexts.items[id].stack_base;
+    size_t untouched = 0;
+    while (untouched < contexts.items[id].stack_size && stack[untouched] == STACK_DEBUG_FILL) untouched += 1;
+    return contexts.items[id].stack_size - untouched;
+#else
+    return 0;
+#endif // COROUTINE_STACK_DEBUG
+}
+
 size_t coroutine_id(void)
 {
     return active.items[current];
@@ -272,15 +1039,77 @@ size_t coroutine_alive(void)
     return active.count;
 }
 
+uint64_t coroutine_idle_time(void)
+{
+    return idle_time;
+}
+
+Coroutine_Stats coroutine_stats(size_t id)
+{
+    assert(id < contexts.count);
+#ifdef COROUTINE_STATS
+    Coroutine_Stats stats = contexts.items[id].stats;
+    // The current coroutine is still on the CPU
+    if (id == active.items[current]) stats.cpu_time += coroutine_now() - contexts.items[id].resumed_at;
+    return stats;
+#else
+    return (Coroutine_Stats){0};
+#endif // COROUTINE_STATS
+}
+
+Coroutine_Scheduler_Stats coroutine_scheduler_stats(void)
+{
+    return scheduler_stats;
+}
+
 void coroutine_wake_up(size_t id)
 {
-    // @speed coroutine_wake_up is linear
-    for (size_t i = 0; i < asleep.count; ++i) {
-        if (asleep.items[i] == id) {
-            da_remove_unordered(&asleep, id);
-            da_remove_unordered(&polls, id);
-            da_append(&active, id);
-            return;
+    assert(id < contexts.count);
+    Context *context = &contexts.items[id];
+    switch (context->sleep_mode) {
+    case SM_NONE: return; // Already running, active or dead
+
+    case SM_READ:
+    case SM_WRITE: {
+        if (epoll_fd >= 0) {
+#ifdef COROUTINE_EPOLL
+            coroutine__epoll_unlink(id);
+#endif // COROUTINE_EPOLL
+        } else {
+            coroutine__poll_remove(context->poll_index);
         }
+    } break;
+
+    case SM_WAKE_UP: {
+        context->sleep_mode = SM_NONE;
+    } break;
+
+    case SM_TIMER: {
+        coroutine__timers_remove(context->timer_index);
+        context->sleep_mode = SM_NONE;
+    } break;
+
+    default: UNREACHABLE("coroutine_wake_up");
+    }
+
+    coroutine__activate(id, stats_now());
+}
+
+void coroutine_forget_fd(int fd)
+{
+#ifdef COROUTINE_EPOLL
+    if (epoll_fd < 0 || fd < 0 || (size_t)fd >= fds.count) return;
+    Fd_Waiters *waiters = &fds.items[fd];
+    // Whoever is still sleeping on the fd would never be woken up otherwise
+    uint64_t ready_at = stats_now();
+    coroutine__epoll_wake_list(&waiters->readers, ready_at);
+    coroutine__epoll_wake_list(&waiters->writers, ready_at);
+    if (waiters->registered) {
+        // NOTE: closing the fd removes it from the epoll set anyway, unless it was dup()-ed
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
     }
+    *waiters = (Fd_Waiters){0};
+#else
+    UNUSED(fd);
+#endif // COROUTINE_EPOLL
 }
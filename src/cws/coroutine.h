@@ -20,10 +20,29 @@
 // # How does it work?
 //
 // Each coroutine has its own separate call stack. Every time a new coroutine is
-// created with coroutine_go() a new call stack is allocated in dynamic memory.
+// created with coroutine_go() it gets a call stack from a pool, which is
+// refilled by the coroutines that have finished (see coroutine_go_with_stack()).
 // The library manages a global array of coroutine stacks and switches between
 // them (on x86_64 literally swaps out the value of the RSP register) on every
 // coroutine_yield(), coroutine_sleep_read(), or coroutine_sleep_write().
+//
+// The sleeping coroutines are checked for IO once every active coroutine had
+// its turn. On Linux that is done with epoll (define COROUTINE_NO_EPOLL to use
+// poll() instead), so the cost does not depend on how many coroutines sleep.
+//
+// # Threads
+//
+// Every thread that calls coroutine_init() gets its own scheduler with its own
+// coroutines, and the rest of the API works on the scheduler of the calling
+// thread. The coroutines of different threads do run in parallel. A coroutine
+// can be started on another thread with coroutine_go_on(), or handed over to
+// whichever thread gets to it first with coroutine_go_anywhere(). The idle
+// schedulers steal such coroutines from the busy ones, but only before they
+// have started: a running coroutine never moves to another thread, because its
+// fds and timers are registered in the scheduler of its thread.
+
+#include <stddef.h>
+#include <stdint.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -48,6 +67,37 @@ void coroutine_yield(void);
 // handling the chains of coroutine_yield()-s.
 void coroutine_go(void (*f)(void*), void *arg);
 
+// Same as coroutine_go(), but the new coroutine gets a stack of `stack_size`
+// bytes (rounded up to whole pages) instead of the default 1024 pages (also
+// used if `stack_size` is 0). The stacks
+// are pooled by size and reused by the next coroutines of the same size. Below
+// every stack there is a guard page, so an overflow crashes right away.
+void coroutine_go_with_stack(void (*f)(void*), void *arg, size_t stack_size);
+
+// The scheduler of the calling thread. NULL if the thread did not call
+// coroutine_init().
+typedef struct Coroutine_Scheduler Coroutine_Scheduler;
+Coroutine_Scheduler *coroutine_scheduler(void);
+
+// Create a new coroutine on the thread of scheduler `s`. It can be called from
+// any thread, and the coroutine never leaves the thread of `s`, so that is the
+// way to pin a coroutine to a thread. `stack_size` is the same as in
+// coroutine_go_with_stack(), 0 means the default one. The scheduler is woken up
+// if it was waiting for IO.
+void coroutine_go_on(Coroutine_Scheduler *s, void (*f)(void*), void *arg, size_t stack_size);
+
+// Create a new coroutine on any of the threads that called coroutine_init().
+// It goes to the scheduler of the calling thread (or to the next one in turn if
+// the thread has no scheduler), but an idle scheduler of another thread may
+// steal it before it has started. Once started it stays on that thread.
+void coroutine_go_anywhere(void (*f)(void*), void *arg, size_t stack_size);
+
+// How many bytes of its stack the coroutine `id` has touched so far. Only
+// tracked if the runtime is compiled with COROUTINE_STACK_DEBUG, which fills
+// every stack with a pattern before the coroutine starts. Returns 0 otherwise.
+// Useful to pick the size for coroutine_go_with_stack().
+size_t coroutine_stack_high_water(size_t id);
+
 // The id of the current coroutine.
 size_t coroutine_id(void);
 
@@ -71,11 +121,71 @@ void coroutine_sleep_read(int fd);
 // treat this function as a flavor of coroutine_yield().
 void coroutine_sleep_write(int fd);
 
+// Put the current coroutine to sleep until somebody calls coroutine_wake_up()
+// with its id. Useful when the coroutine waits for an event the runtime does not
+// know about (like a completion of io_uring).
+void coroutine_sleep(void);
+
+// Put the current coroutine to sleep until coroutine_now() reaches `deadline`.
+// The other coroutines keep running and serving their IO in the meantime, and
+// if there is nothing else to do the runtime blocks in poll()/epoll_wait() no
+// longer than until the nearest deadline. A deadline in the past works like
+// coroutine_yield().
+void coroutine_sleep_until(uint64_t deadline);
+
+// The time of CLOCK_MONOTONIC in nanoseconds. The clock of
+// coroutine_sleep_until().
+uint64_t coroutine_now(void);
+
+// How many nanoseconds in total the runtime spent blocked waiting for IO or
+// timers, because none of the coroutines had anything to do.
+uint64_t coroutine_idle_time(void);
+
+// The scheduler statistics of a coroutine. See coroutine_stats().
+typedef struct {
+    uint64_t switches;          // How many times the coroutine got on the CPU
+    uint64_t cpu_time;          // Nanoseconds the coroutine spent on the CPU
+    uint64_t sleeps;            // How many times it went to sleep on an fd, a timer or coroutine_sleep()
+    uint64_t wakes;             // How many times it was woken up
+    uint64_t wake_latency;      // Nanoseconds in total between being woken up and getting on the CPU
+    uint64_t max_wake_latency;  // The longest of them
+} Coroutine_Stats;
+
+// The statistics of the coroutine `id` since it was started. Only collected if
+// the runtime is compiled with COROUTINE_STATS, which costs a clock_gettime()
+// per context switch. Returns all zeros otherwise. Useful to find the
+// coroutines that eat the time of the scheduler.
+Coroutine_Stats coroutine_stats(size_t id);
+
+// The statistics of the scheduler of the calling thread since
+// coroutine_init(). The poll()/epoll_wait() counters are always collected, the
+// rest only with COROUTINE_STATS.
+typedef struct {
+    uint64_t polls;         // How many times the scheduler called poll()/epoll_wait()
+    uint64_t ready_fds;     // How many ready fds they returned in total
+    uint64_t switches;      // Same as in Coroutine_Stats, but for all the coroutines together
+    uint64_t cpu_time;
+    uint64_t wakes;
+    uint64_t wake_latency;
+} Coroutine_Scheduler_Stats;
+
+Coroutine_Scheduler_Stats coroutine_scheduler_stats(void);
+
 // Wake up coroutine by id if it is currently sleeping due to
-// coroutine_sleep_read() or coroutine_sleep_write() calls.
+// coroutine_sleep_read(), coroutine_sleep_write(), coroutine_sleep() or
+// coroutine_sleep_until() calls. Does nothing if it is not sleeping. Takes
+// constant time (logarithmic for coroutine_sleep_until()), so it is fine to use
+// for signalling between a lot of coroutines. Only works for the coroutines of
+// the calling thread, the ids are per thread.
 void coroutine_wake_up(size_t id);
 
-// TODO: implement sleeping by timeout
+// Must be called before closing `fd` if it was ever passed to
+// coroutine_sleep_read() or coroutine_sleep_write(). On Linux the runtime keeps
+// the fds registered in epoll between the sleeps, and a new fd with the same
+// number would never wake anybody up otherwise. The coroutines still sleeping
+// on the fd are woken up.
+void coroutine_forget_fd(int fd);
+
 // TODO: add timeouts to coroutine_sleep_read() and coroutine_sleep_write()
 
 #ifdef __cplusplus
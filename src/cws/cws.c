@@ -1,16 +1,15 @@
 #include <stdbool.h>
+#if defined(__x86_64__) && defined(__GNUC__)
+#define CWS_SSE2
+#include <emmintrin.h>
+#endif // __x86_64__ && __GNUC__
 #include "cws.h"
 #define NOB_STRIP_PREFIX
 #include "nob.h"
 #undef rename                   // stupid prefix bug in nob.h
 #include "teenysha1.h"
 #include "b64.h"
-
-typedef struct {
-    unsigned char *items;
-    size_t count;
-    size_t capacity;
-} Cws_Payload_Buffer;
+#include "wsmask.h"
 
 typedef enum {
     CWS_OPCODE_CONT  = 0x0,
@@ -32,9 +31,14 @@ typedef struct {
     uint8_t mask[4];
 } Cws_Frame_Header;
 
-// TODO: Make the CHUNK_SIZE customizable somehow
-// Maybe make it a runtime parameter of Cws, like the client flag.
-#define CHUNK_SIZE 1024
+// FIN/OPCODE + MASK/LEN + 64 bit extended length + mask
+#define CWS_FRAME_HEADER_MAX_SIZE (1 + 1 + 8 + 4)
+
+// Initial capacity of Cws.input. It grows if a single read needs more than that.
+#define CWS_INPUT_INIT_CAP (4*1024)
+
+// The maximum size of the HTTP request/response of the handshake
+#define CWS_HTTP_HEAD_MAX_SIZE (8*1024)
 
 #define CWS_FIN(header)         (((header)[0] >> 7)&0x1);
 #define CWS_RSV1(header)        (((header)[0] >> 6)&0x1);
@@ -45,22 +49,37 @@ typedef struct {
 #define CWS_PAYLOAD_LEN(header) ((header)[1] & 0x7F);
 
 // `cws__` with double underscore means that the function is private
-static int cws__socket_read_entire_buffer_raw(Cws_Socket socket, void *buffer, size_t len);
 static int cws__socket_write_entire_buffer_raw(Cws_Socket socket, const void *buffer, size_t len);
+static int cws__socket_writev_entire_buffer_raw(Cws_Socket socket, Cws_Iovec *iov, size_t iovcnt);
+static int cws__input_fill(Cws *cws, size_t size);
+static int cws__input_read_entire_buffer(Cws *cws, void *buffer, size_t len);
+static int cws__input_read_http_head(Cws *cws, String_View *head);
 static int cws__parse_sec_websocket_key_from_request(String_View *request, String_View *sec_websocket_key);
 static int cws__parse_sec_websocket_accept_from_response(String_View *response, String_View *sec_websocket_accept);
 static const char *cws__compute_sec_websocket_accept(Cws *cws, String_View sec_websocket_key);
 static int32_t cws__utf8_to_char32_fixed(unsigned char* ptr, size_t* size);
-static void cws__extend_unfinished_utf8(Cws *cws, Cws_Payload_Buffer *payload, size_t pos);
+static size_t cws__extend_unfinished_utf8(unsigned char extended[4], const unsigned char *unfinished, size_t unfinished_len);
+static int cws__verify_utf8(unsigned char *payload, size_t payload_len, size_t *verify_pos, bool fin);
+static size_t cws__ascii_prefix_len(const unsigned char *buffer, size_t len);
 static int cws__read_frame_header(Cws *cws, Cws_Frame_Header *frame_header);
-static int cws__read_frame_payload_chunk(Cws *cws, Cws_Frame_Header frame_header, unsigned char *payload, size_t payload_capacity, size_t payload_size);
-static int cws__read_frame_entire_payload(Cws *cws, Cws_Frame_Header frame_header, unsigned char **payload, size_t *payload_len);
+static int cws__read_frame(Cws *cws);
+static bool cws__input_frame_ready(Cws *cws);
+static void cws__finish_message(Cws *cws, Cws_Message *message, size_t headroom);
+static int cws__server_handshake_response(Cws *cws, String_View request, const char **response);
+static size_t cws__write_frame_header(unsigned char *header, bool fin, Cws_Opcode opcode, bool masked, size_t payload_len);
+static void cws__generate_mask(unsigned char mask[4]);
 static int cws__send_frame(Cws *cws, bool fin, Cws_Opcode opcode, unsigned char *payload, size_t payload_len);
+static size_t cws__max_frame_size(size_t max_frame_size);
+static int cws__queue_push(Cws *cws, Cws_Shared_Message *message, size_t tag);
+static void cws__queue_remove(Cws_Send_Queue *queue, size_t index);
+static void cws__queue_consume(Cws_Send_Queue *queue, size_t written);
 static const char *cws__opcode_name(Cws *cws, Cws_Opcode opcode);
 static bool cws__opcode_is_control(Cws_Opcode opcode);
 
 void cws_close(Cws *cws)
 {
+    if (cws->stackless) goto defer;
+
     // Ignoring any errors of socket operations because we are closing the connection anyway
 
     // TODO: The sender may give a reason of the close via the status code
@@ -83,18 +102,22 @@ void cws_close(Cws *cws)
 
     // Actually destroying the socket
     cws->socket.close(cws->socket.data);
-    arena_free(&cws->arena);
-}
 
-static int cws__socket_read_entire_buffer_raw(Cws_Socket socket, void *buffer, size_t len) {
-    char *buf = buffer;
-    while (len > 0) {
-        int n = socket.read(socket.data, buf, len);
-        if (n < 0) return n;
-        buf += n;
-        len -= n;
+defer:
+    arena_free(&cws->arena);
+    free(cws->input.items);
+    cws->input = (Cws_Input_Buffer) {0};
+    // Whatever did not make it out of the queue by now is lost
+    for (size_t i = 0; i < cws->queue.count; ++i) {
+        cws_shared_message_release(cws->queue.items[i].message);
     }
-    return 0;
+    free(cws->queue.items);
+    cws->queue.items = NULL;
+    cws->queue.count = 0;
+    cws->queue.capacity = 0;
+    cws->queue.sent = 0;
+    cws->queue.size = 0;
+    cws->reader = (Cws_Reader) {0};
 }
 
 static int cws__socket_write_entire_buffer_raw(Cws_Socket socket, const void *buffer, size_t len) {
@@ -108,30 +131,150 @@ static int cws__socket_write_entire_buffer_raw(Cws_Socket socket, const void *bu
     return 0;
 }
 
-int cws_server_handshake(Cws *cws)
+// Makes sure that at least `size` unconsumed bytes are available in cws->input. Every read from the
+// socket asks for as much as fits into the buffer, so a burst of small frames is usually pulled in
+// by a single read. The bytes starting from cws->input.begin are preserved, but may be moved around.
+static int cws__input_fill(Cws *cws, size_t size)
 {
-    // TODO: cws_server_handshake assumes that request fits into 1024 bytes
-    char buffer[1024];
-    int ret = cws->socket.peek(cws->socket.data, buffer, ARRAY_LEN(buffer));
-    if (ret < 0) return ret;
-    size_t buffer_size = ret;
-    String_View request = nob_sv_from_parts(buffer, buffer_size);
+    Cws_Input_Buffer *input = &cws->input;
+    if (input->begin == input->count) {
+        input->begin = 0;
+        input->pos = 0;
+        input->count = 0;
+    }
+    while (input->count - input->pos < size) {
+        if (input->capacity - input->pos < size) {
+            // Not enough space for the requested amount of bytes. Move the bytes we need to keep to
+            // the beginning of the buffer and grow it if that is still not enough.
+            size_t kept = input->count - input->begin;
+            memmove(input->items, input->items + input->begin, kept);
+            input->pos -= input->begin;
+            input->count = kept;
+            input->begin = 0;
+            if (input->capacity < input->pos + size) {
+                size_t capacity = input->capacity == 0 ? CWS_INPUT_INIT_CAP : input->capacity;
+                while (capacity < input->pos + size) capacity *= 2;
+                input->items = realloc(input->items, capacity);
+                assert(input->items != NULL && "Buy more RAM lol");
+                input->capacity = capacity;
+            }
+        }
+        int n = cws->socket.read(cws->socket.data, input->items + input->count, input->capacity - input->count);
+        if (n < 0) return n;
+        input->count += n;
+    }
+    return 0;
+}
 
-    String_View sec_websocket_key = {0};
-    ret = cws__parse_sec_websocket_key_from_request(&request, &sec_websocket_key);
+static int cws__input_read_entire_buffer(Cws *cws, void *buffer, size_t len)
+{
+    int ret = cws__input_fill(cws, len);
     if (ret < 0) return ret;
+    memcpy(buffer, cws->input.items + cws->input.pos, len);
+    cws->input.pos += len;
+    return 0;
+}
+
+// Reads the HTTP request/response up to and including the empty line that ends its headers. Whatever
+// the peer has sent after that (for instance, the first frames) stays in cws->input. The head
+// stays valid until the next read from cws->input.
+static int cws__input_read_http_head(Cws *cws, String_View *head)
+{
+    Cws_Input_Buffer *input = &cws->input;
+    input->begin = input->pos;
+    size_t scanned = 0; // Relative to input->begin, because cws__input_fill() may move the bytes around
+    for (;;) {
+        size_t available = input->count - input->begin;
+        const char *bytes = (const char*)input->items + input->begin;
+        for (size_t i = scanned < 3 ? 0 : scanned - 3; i + 4 <= available; ++i) {
+            if (memcmp(bytes + i, "\r\n\r\n", 4) == 0) {
+                *head = sv_from_parts(bytes, i + 4);
+                input->pos = input->begin + i + 4;
+                return 0;
+            }
+        }
+        if (available >= CWS_HTTP_HEAD_MAX_SIZE) return CWS_ERROR_HANDSHAKE_TOO_BIG;
+        scanned = available;
 
-    ret = cws__socket_read_entire_buffer_raw(cws->socket, buffer, buffer_size - request.count);
+        input->pos = input->count;
+        int ret = cws__input_fill(cws, 1);
+        if (ret < 0) return ret;
+    }
+}
+
+// NOTE: modifies the iov array in place to keep track of the partial writes
+static int cws__socket_writev_entire_buffer_raw(Cws_Socket socket, Cws_Iovec *iov, size_t iovcnt) {
+    if (socket.writev == NULL) {
+        // Fallback for the backends without writev. Small frames are glued together in a local
+        // buffer so they still go out with a single write.
+        char buf[1024];
+        size_t buf_len = 0;
+        for (size_t i = 0; i < iovcnt; ++i) buf_len += iov[i].len;
+        if (buf_len <= ARRAY_LEN(buf)) {
+            buf_len = 0;
+            for (size_t i = 0; i < iovcnt; ++i) {
+                if (iov[i].len == 0) continue;
+                memcpy(buf + buf_len, iov[i].data, iov[i].len);
+                buf_len += iov[i].len;
+            }
+            return cws__socket_write_entire_buffer_raw(socket, buf, buf_len);
+        }
+        for (size_t i = 0; i < iovcnt; ++i) {
+            int ret = cws__socket_write_entire_buffer_raw(socket, iov[i].data, iov[i].len);
+            if (ret < 0) return ret;
+        }
+        return 0;
+    }
+
+    while (iovcnt > 0) {
+        if (iov->len == 0) {
+            iov += 1;
+            iovcnt -= 1;
+            continue;
+        }
+        int n = socket.writev(socket.data, iov, iovcnt);
+        if (n < 0) return n;
+        size_t written = n;
+        while (iovcnt > 0 && written >= iov->len) {
+            written -= iov->len;
+            iov += 1;
+            iovcnt -= 1;
+        }
+        if (written > 0) {
+            iov->data = (const char*)iov->data + written;
+            iov->len -= written;
+        }
+    }
+    return 0;
+}
+
+// The response allocated in cws->arena
+static int cws__server_handshake_response(Cws *cws, String_View request, const char **response)
+{
+    String_View sec_websocket_key = {0};
+    int ret = cws__parse_sec_websocket_key_from_request(&request, &sec_websocket_key);
     if (ret < 0) return ret;
 
     const char *sec_websocket_accept = cws__compute_sec_websocket_accept(cws, sec_websocket_key);
 
-    char *response = arena_sprintf(&cws->arena,
+    *response = arena_sprintf(&cws->arena,
         "HTTP/1.1 101 Switching Protocols\r\n"
         "Upgrade: websocket\r\n"
         "Connection: Upgrade\r\n"
         "Sec-WebSocket-Accept: %s\r\n"
         "\r\n", sec_websocket_accept);
+    return 0;
+}
+
+int cws_server_handshake(Cws *cws)
+{
+    String_View request = {0};
+    int ret = cws__input_read_http_head(cws, &request);
+    if (ret < 0) return ret;
+
+    const char *response = NULL;
+    ret = cws__server_handshake_response(cws, request, &response);
+    if (ret < 0) return ret;
 
     ret = cws__socket_write_entire_buffer_raw(cws->socket, response, strlen(response));
     if (ret < 0) return ret;
@@ -157,17 +300,12 @@ int cws_client_handshake(Cws *cws, const char *host, const char *endpoint)
     int ret = cws__socket_write_entire_buffer_raw(cws->socket, handshake, strlen(handshake));
     if (ret < 0) return ret;
 
-    // TODO: Ws.client_handshake assumes that response fits into 1024 bytes
-    char buffer[1024];
-    ret = cws->socket.peek(cws->socket.data, buffer, ARRAY_LEN(buffer));
+    String_View response = {0};
+    ret = cws__input_read_http_head(cws, &response);
     if (ret < 0) return ret;
-    size_t buffer_size = ret;
-    String_View response = sv_from_parts(buffer, buffer_size);
     String_View sec_websocket_accept = {0};
     ret = cws__parse_sec_websocket_accept_from_response(&response, &sec_websocket_accept);
     if (ret < 0) return ret;
-    ret = cws->socket.read(cws->socket.data, buffer, buffer_size - response.count);
-    if (ret < 0) return ret;
     if (!sv_eq(sec_websocket_accept, sv_from_cstr("s3pPLMBiTxaQ9kYGzzhZRbK+xOo="))) return CWS_ERROR_CLIENT_HANDSHAKE_BAD_ACCEPT;
     return 0;
 }
@@ -199,6 +337,42 @@ static int cws__parse_sec_websocket_accept_from_response(String_View *response,
     return 0;
 }
 
+// Writes everything except the mask. Returns the size of the written header.
+static size_t cws__write_frame_header(unsigned char *header, bool fin, Cws_Opcode opcode, bool masked, size_t payload_len)
+{
+    size_t header_len = 0;
+
+    // FIN and OPCODE
+    header[header_len] = (unsigned char) opcode;
+    if (fin) header[header_len] |= (1 << 7);
+    header_len += 1;
+
+    // Masked and payload length
+    // TODO: do we need to reverse the bytes on a machine with a different endianess than x86?
+    unsigned char mask_bit = masked ? (1 << 7) : 0;
+    if (payload_len < 126) {
+        header[header_len++] = mask_bit | (unsigned char) payload_len;
+    } else if (payload_len <= UINT16_MAX) {
+        header[header_len++] = mask_bit | 126;
+        header[header_len++] = (unsigned char)(payload_len >> (8 * 1)) & 0xFF;
+        header[header_len++] = (unsigned char)(payload_len >> (8 * 0)) & 0xFF;
+    } else {
+        header[header_len++] = mask_bit | 127;
+        for (int i = 7; i >= 0; --i) {
+            header[header_len++] = (unsigned char)(payload_len >> (8 * i)) & 0xFF;
+        }
+    }
+
+    return header_len;
+}
+
+static void cws__generate_mask(unsigned char mask[4])
+{
+    for (size_t i = 0; i < 4; ++i) {
+        mask[i] = (unsigned char)(rand() % 0x100);
+    }
+}
+
 static int cws__send_frame(Cws *cws, bool fin, Cws_Opcode opcode, unsigned char *payload, size_t payload_len)
 {
     int ret;
@@ -210,96 +384,81 @@ static int cws__send_frame(Cws *cws, bool fin, Cws_Opcode opcode, unsigned char
                payload_len);
     }
 
-    // Send FIN and OPCODE
-    {
-        // NOTE: FIN is always set
-        unsigned char data = (unsigned char) opcode;
-        if (fin) data |= (1 << 7);
-        ret = cws__socket_write_entire_buffer_raw(cws->socket, &data, 1);
+    if (cws->stackless || cws->socket.try_writev != NULL) {
+        // Everything goes through the queue, so a frame never gets in the middle of a partially sent one
+        Cws_Shared_Message *frame = malloc(sizeof(*frame) + CWS_FRAME_HEADER_MAX_SIZE + payload_len);
+        assert(frame != NULL && "Buy more RAM lol");
+        frame->refcount = 1;
+        frame->payload_len = payload_len;
+        frame->size = cws__write_frame_header(frame->bytes, fin, opcode, cws->client, payload_len);
+        if (cws->client) {
+            cws__generate_mask(&frame->bytes[frame->size]);
+            frame->size += 4;
+        }
+        if (payload_len > 0) memcpy(frame->bytes + frame->size, payload, payload_len);
+        if (cws->client) wsmask_apply(frame->bytes + frame->size, payload_len, frame->bytes + frame->size - 4, 0);
+        frame->size += payload_len;
+
+        ret = cws__queue_push(cws, frame, 0);
+        cws_shared_message_release(frame);
+        if (ret < 0) return ret;
+        ret = cws_flush(cws);
         if (ret < 0) return ret;
+        return 0;
     }
 
-    // Send masked and payload length
-    {
-        // TODO: do we need to reverse the bytes on a machine with a different endianess than x86?
-        // NOTE: client frames are always masked
-        if (payload_len < 126) {
-            unsigned char data = cws->client ? (1 << 7) : 0;
-            data |= (unsigned char) payload_len;
-            ret = cws__socket_write_entire_buffer_raw(cws->socket, &data, 1);
-            if (ret < 0) return ret;
-        } else if (payload_len <= UINT16_MAX) {
-            unsigned char data = cws->client ? (1 << 7) : 0;
-            data |= 126;
-            ret = cws__socket_write_entire_buffer_raw(cws->socket, &data, 1);
-            if (ret < 0) return ret;
-
-            unsigned char len[2] = {
-                (unsigned char)(payload_len >> (8 * 1)) & 0xFF,
-                (unsigned char)(payload_len >> (8 * 0)) & 0xFF
-            };
-
-            ret = cws__socket_write_entire_buffer_raw(cws->socket, len, ARRAY_LEN(len));
-            if (ret < 0) return ret;
-        } else if (payload_len > UINT16_MAX) {
-            unsigned char data = cws->client ? (1 << 7) : 0;
-            data |= 127;
-            unsigned char len[8] = {
-                (unsigned char) (payload_len >> (8 * 7)) & 0xFF,
-                (unsigned char) (payload_len >> (8 * 6)) & 0xFF,
-                (unsigned char) (payload_len >> (8 * 5)) & 0xFF,
-                (unsigned char) (payload_len >> (8 * 4)) & 0xFF,
-                (unsigned char) (payload_len >> (8 * 3)) & 0xFF,
-                (unsigned char) (payload_len >> (8 * 2)) & 0xFF,
-                (unsigned char) (payload_len >> (8 * 1)) & 0xFF,
-                (unsigned char) (payload_len >> (8 * 0)) & 0xFF
-            };
-
-            ret = cws__socket_write_entire_buffer_raw(cws->socket, &data, 1);
-            if (ret < 0) return ret;
-            ret = cws__socket_write_entire_buffer_raw(cws->socket, len, ARRAY_LEN(len));
-            if (ret < 0) return ret;
-        }
+    // The whole header is assembled upfront so it goes out together with the payload in a single writev
+    // NOTE: client frames are always masked
+    unsigned char header[CWS_FRAME_HEADER_MAX_SIZE];
+    size_t header_len = cws__write_frame_header(header, fin, opcode, cws->client, payload_len);
+
+    if (!cws->client) {
+        Cws_Iovec iov[] = {
+            {header, header_len},
+            {payload, payload_len},
+        };
+        ret = cws__socket_writev_entire_buffer_raw(cws->socket, iov, ARRAY_LEN(iov));
+        if (ret < 0) return ret;
+        return 0;
     }
 
-    if (cws->client) {
-        unsigned char mask[4] = {0};
-
-        // Generate and send mask
-        {
-            for (size_t i = 0; i < ARRAY_LEN(mask); ++i) {
-                mask[i] = (unsigned char)(rand() % 0x100);
-            }
-            ret = cws__socket_write_entire_buffer_raw(cws->socket, mask, ARRAY_LEN(mask));
-            if (ret < 0) return ret;
-        }
+    unsigned char *mask = &header[header_len];
+    cws__generate_mask(mask);
+    header_len += 4;
 
-        // Mask the payload and send it
-        for (size_t i = 0; i < payload_len; ) {
-            unsigned char chunk[1024];
-            size_t chunk_size = 0;
-            while (i < payload_len && chunk_size < ARRAY_LEN(chunk)) {
-                chunk[chunk_size] = payload[i] ^ mask[i % 4];
-                chunk_size += 1;
-                i += 1;
-            }
-            ret = cws__socket_write_entire_buffer_raw(cws->socket, chunk, chunk_size);
-            if (ret < 0) return ret;
-        }
-    } else {
-        ret = cws__socket_write_entire_buffer_raw(cws->socket, payload, payload_len);
+    // Mask the payload and send it. The header goes out together with the first chunk.
+    size_t i = 0;
+    do {
+        unsigned char chunk[1024];
+        size_t chunk_size = payload_len - i;
+        if (chunk_size > ARRAY_LEN(chunk)) chunk_size = ARRAY_LEN(chunk);
+        if (chunk_size > 0) memcpy(chunk, payload + i, chunk_size);
+        wsmask_apply(chunk, chunk_size, mask, i);
+        i += chunk_size;
+        Cws_Iovec iov[] = {
+            {header, header_len},
+            {chunk, chunk_size},
+        };
+        ret = cws__socket_writev_entire_buffer_raw(cws->socket, iov, ARRAY_LEN(iov));
         if (ret < 0) return ret;
-    }
+        header_len = 0;
+    } while (i < payload_len);
 
     return 0;
 }
 
+static size_t cws__max_frame_size(size_t max_frame_size)
+{
+    return max_frame_size == 0 ? CWS_DEFAULT_MAX_FRAME_SIZE : max_frame_size;
+}
+
 int cws_send_message(Cws *cws, Cws_Message_Kind kind, unsigned char *payload, size_t payload_len)
 {
+    size_t max_frame_size = cws__max_frame_size(cws->max_frame_size);
     bool first = true;
     do {
-        uint len = payload_len;
-        if (len > CHUNK_SIZE) len = CHUNK_SIZE;
+        size_t len = payload_len;
+        if (len > max_frame_size) len = max_frame_size;
         bool fin = payload_len - len == 0;
         Cws_Opcode opcode = first ? (Cws_Opcode) kind : CWS_OPCODE_CONT;
 
@@ -314,6 +473,213 @@ int cws_send_message(Cws *cws, Cws_Message_Kind kind, unsigned char *payload, si
     return 0;
 }
 
+Cws_Shared_Message *cws_shared_message_new(Cws_Message_Kind kind, const unsigned char *payload, size_t payload_len, size_t max_frame_size)
+{
+    // Fragmenting the same way cws_send_message() does
+    max_frame_size = cws__max_frame_size(max_frame_size);
+    size_t frames_count = payload_len == 0 ? 1 : (payload_len - 1)/max_frame_size + 1;
+    Cws_Shared_Message *message = malloc(sizeof(*message) + frames_count*CWS_FRAME_HEADER_MAX_SIZE + payload_len);
+    assert(message != NULL && "Buy more RAM lol");
+    message->refcount = 1;
+    message->payload_len = payload_len;
+    message->size = 0;
+
+    bool first = true;
+    do {
+        size_t len = payload_len;
+        if (len > max_frame_size) len = max_frame_size;
+        bool fin = payload_len - len == 0;
+        Cws_Opcode opcode = first ? (Cws_Opcode) kind : CWS_OPCODE_CONT;
+
+        message->size += cws__write_frame_header(message->bytes + message->size, fin, opcode, false, len);
+        memcpy(message->bytes + message->size, payload, len);
+        message->size += len;
+
+        payload += len;
+        payload_len -= len;
+        first = false;
+    } while (payload_len > 0);
+
+    return message;
+}
+
+Cws_Shared_Message *cws_shared_message_acquire(Cws_Shared_Message *message)
+{
+    message->refcount += 1;
+    return message;
+}
+
+void cws_shared_message_release(Cws_Shared_Message *message)
+{
+    assert(message->refcount > 0);
+    message->refcount -= 1;
+    if (message->refcount == 0) free(message);
+}
+
+int cws_send_shared_message(Cws *cws, Cws_Shared_Message *message)
+{
+    assert(!cws->client && "Client frames must be masked individually, so they cannot be shared");
+
+    if (cws->debug) {
+        printf("CWS DEBUG: TX SHARED MESSAGE: SIZE: %zu\n", message->size);
+    }
+
+    int ret;
+    if (cws->stackless || cws->socket.try_writev != NULL) {
+        ret = cws__queue_push(cws, message, 0);
+        if (ret < 0) return ret;
+        ret = cws_flush(cws);
+        if (ret < 0) return ret;
+        return 0;
+    }
+
+    // Holding a reference, because writing may yield to the other coroutines
+    cws_shared_message_acquire(message);
+    ret = cws__socket_write_entire_buffer_raw(cws->socket, message->bytes, message->size);
+    cws_shared_message_release(message);
+    if (ret < 0) return ret;
+    return 0;
+}
+
+int cws_queue_shared_message(Cws *cws, Cws_Shared_Message *message, size_t tag)
+{
+    assert(!cws->client && "Client frames must be masked individually, so they cannot be shared");
+
+    if (cws->debug) {
+        printf("CWS DEBUG: TX QUEUE SHARED MESSAGE: SIZE: %zu, TAG: %zu\n", message->size, tag);
+    }
+
+    return cws__queue_push(cws, message, tag);
+}
+
+static int cws__queue_push(Cws *cws, Cws_Shared_Message *message, size_t tag)
+{
+    Cws_Send_Queue *queue = &cws->queue;
+
+    if (queue->limit > 0 && queue->size + message->size > queue->limit) {
+        // items[0] may be partially sent already, so it must stay no matter what
+        size_t first = queue->sent > 0 ? 1 : 0;
+        switch (queue->policy) {
+            case CWS_OVERFLOW_DISCONNECT: break;
+            case CWS_OVERFLOW_DROP_OLDEST: {
+                for (size_t i = first; i < queue->count && queue->size + message->size > queue->limit;) {
+                    if (queue->items[i].tag != 0) {
+                        cws__queue_remove(queue, i);
+                    } else {
+                        i += 1;
+                    }
+                }
+            } break;
+            case CWS_OVERFLOW_COALESCE: {
+                // The newer state update goes to the end of the queue, so it never overtakes the
+                // messages that were queued after the one it replaces
+                if (tag == 0) break;
+                for (size_t i = first; i < queue->count; ++i) {
+                    if (queue->items[i].tag == tag) {
+                        cws__queue_remove(queue, i);
+                        break;
+                    }
+                }
+            } break;
+            default: UNREACHABLE("Cws_Overflow_Policy");
+        }
+
+        if (queue->size + message->size > queue->limit) {
+            if (queue->policy != CWS_OVERFLOW_DISCONNECT && tag != 0) {
+                // Nothing else can be dropped, but the new message is just a state update itself
+                queue->dropped += 1;
+                return 0;
+            }
+            return CWS_ERROR_SEND_QUEUE_OVERFLOW;
+        }
+    }
+
+    Cws_Send_Queue_Item item = {
+        .message = cws_shared_message_acquire(message),
+        .tag = tag,
+    };
+    da_append(queue, item);
+    queue->size += message->size;
+    return 0;
+}
+
+static void cws__queue_remove(Cws_Send_Queue *queue, size_t index)
+{
+    assert(index < queue->count);
+    assert(!(index == 0 && queue->sent > 0) && "Partially sent message cannot be removed from the queue");
+    queue->size -= queue->items[index].message->size;
+    cws_shared_message_release(queue->items[index].message);
+    memmove(queue->items + index, queue->items + index + 1, (queue->count - index - 1)*sizeof(*queue->items));
+    queue->count -= 1;
+    queue->dropped += 1;
+}
+
+// Forgets about the first `written` bytes of the queue
+static void cws__queue_consume(Cws_Send_Queue *queue, size_t written)
+{
+    queue->size -= written;
+    size_t done = 0;
+    while (done < queue->count) {
+        size_t left = queue->items[done].message->size - queue->sent;
+        if (written < left) break;
+        written -= left;
+        queue->sent = 0;
+        cws_shared_message_release(queue->items[done].message);
+        done += 1;
+    }
+    queue->sent += written;
+    memmove(queue->items, queue->items + done, (queue->count - done)*sizeof(*queue->items));
+    queue->count -= done;
+}
+
+size_t cws_output(Cws *cws, Cws_Iovec *iov, size_t iovcnt)
+{
+    Cws_Send_Queue *queue = &cws->queue;
+    size_t count = 0;
+    while (count < queue->count && count < iovcnt) {
+        Cws_Shared_Message *message = queue->items[count].message;
+        iov[count].data = message->bytes;
+        iov[count].len = message->size;
+        count += 1;
+    }
+    if (count > 0) {
+        iov[0].data = (const char*)iov[0].data + queue->sent;
+        iov[0].len -= queue->sent;
+    }
+    return count;
+}
+
+void cws_output_consume(Cws *cws, size_t written)
+{
+    assert(written <= cws->queue.size);
+    cws__queue_consume(&cws->queue, written);
+}
+
+int cws_flush(Cws *cws)
+{
+    Cws_Send_Queue *queue = &cws->queue;
+    // Nothing to send the queue to. The caller takes it with cws_output().
+    while (!cws->stackless && queue->count > 0) {
+        Cws_Iovec iov[64];
+        size_t iovcnt = cws_output(cws, iov, ARRAY_LEN(iov));
+        size_t len = 0;
+        for (size_t i = 0; i < iovcnt; ++i) len += iov[i].len;
+
+        if (cws->socket.try_writev != NULL) {
+            int n = cws->socket.try_writev(cws->socket.data, iov, iovcnt);
+            if (n == CWS_ERROR_WOULD_BLOCK) break;
+            if (n < 0) return n;
+            cws__queue_consume(queue, n);
+        } else {
+            // Nothing to wait for without try_writev, so just blocking until everything is sent
+            int ret = cws__socket_writev_entire_buffer_raw(cws->socket, iov, iovcnt);
+            if (ret < 0) return ret;
+            cws__queue_consume(queue, len);
+        }
+    }
+    return queue->size > INT_MAX ? INT_MAX : (int)queue->size;
+}
+
 const char *cws_message_kind_name(Cws *cws, Cws_Message_Kind kind)
 {
     return cws__opcode_name(cws, (Cws_Opcode) kind);
@@ -352,7 +718,7 @@ static int cws__read_frame_header(Cws *cws, Cws_Frame_Header *frame_header)
     unsigned char header[2];
 
     // Read the header
-    int ret = cws__socket_read_entire_buffer_raw(cws->socket, header, ARRAY_LEN(header));
+    int ret = cws__input_read_entire_buffer(cws, header, ARRAY_LEN(header));
     if (ret < 0) return ret;
     frame_header->fin = (bool) CWS_FIN(header);
     frame_header->rsv1 = (bool) CWS_RSV1(header);
@@ -368,7 +734,7 @@ static int cws__read_frame_header(Cws *cws, Cws_Frame_Header *frame_header)
         switch (len) {
         case 126: {
             unsigned char ext_len[2] = {0};
-            ret = cws__socket_read_entire_buffer_raw(cws->socket, ext_len, ARRAY_LEN(ext_len));
+            ret = cws__input_read_entire_buffer(cws, ext_len, ARRAY_LEN(ext_len));
             if (ret < 0) return ret;
 
             for (size_t i = 0; i < ARRAY_LEN(ext_len); ++i) {
@@ -377,7 +743,7 @@ static int cws__read_frame_header(Cws *cws, Cws_Frame_Header *frame_header)
         } break;
         case 127: {
             unsigned char ext_len[8] = {0};
-            ret = cws__socket_read_entire_buffer_raw(cws->socket, ext_len, ARRAY_LEN(ext_len));
+            ret = cws__input_read_entire_buffer(cws, ext_len, ARRAY_LEN(ext_len));
             if (ret < 0) return ret;
 
             for (size_t i = 0; i < ARRAY_LEN(ext_len); ++i) {
@@ -419,131 +785,324 @@ static int cws__read_frame_header(Cws *cws, Cws_Frame_Header *frame_header)
 
     // Read the mask if masked
     if (frame_header->masked) {
-        ret = cws__socket_read_entire_buffer_raw(cws->socket, frame_header->mask, ARRAY_LEN(frame_header->mask));
+        ret = cws__input_read_entire_buffer(cws, frame_header->mask, ARRAY_LEN(frame_header->mask));
         if (ret < 0) return ret;
     }
 
     return 0;
 }
 
-int cws__read_frame_payload_chunk(Cws *cws, Cws_Frame_Header frame_header, unsigned char *payload, size_t payload_len, size_t finished_payload_len)
+// Reads a single frame and handles it. The data frames are added to the message in cws->reader.
+// Returns 1 if the frame has finished the message, 0 otherwise.
+static int cws__read_frame(Cws *cws)
 {
-    assert(frame_header.payload_len == payload_len);
-    if (finished_payload_len >= payload_len) return 0;
-    unsigned char *unfinished_payload = payload + finished_payload_len;
-    size_t unfinished_payload_len = payload_len - finished_payload_len;
-    int ret = cws->socket.read(cws->socket.data, unfinished_payload, unfinished_payload_len);
+    Cws_Input_Buffer *input = &cws->input;
+    Cws_Reader *reader = &cws->reader;
+
+    Cws_Frame_Header frame = {0};
+    int ret = cws__read_frame_header(cws, &frame);
     if (ret < 0) return ret;
-    size_t n = ret;
-    if (frame_header.masked) {
-        for (size_t i = 0; i < unfinished_payload_len; ++i) {
-            unfinished_payload[i] ^= frame_header.mask[(finished_payload_len + i) % 4];
+
+    // NOTE: control frames are limited by cws__read_frame_header() already
+    if (!cws__opcode_is_control(frame.opcode) && cws->max_message_size > 0) {
+        if (frame.payload_len > cws->max_message_size - reader->payload_len) return CWS_ERROR_MESSAGE_TOO_BIG;
+    }
+
+    ret = cws__input_fill(cws, frame.payload_len);
+    if (ret < 0) return ret;
+    unsigned char *frame_payload = input->items + input->pos;
+    if (frame.masked) wsmask_apply(frame_payload, frame.payload_len, frame.mask, 0);
+    size_t frame_offset = input->pos - input->begin;
+    input->pos += frame.payload_len;
+
+    if (cws__opcode_is_control(frame.opcode)) {
+        switch (frame.opcode) {
+        case CWS_OPCODE_CLOSE:
+            return CWS_ERROR_FRAME_CLOSE_SENT;
+        case CWS_OPCODE_PING:
+            ret = cws__send_frame(cws, true, CWS_OPCODE_PONG, frame_payload, frame.payload_len);
+            if (ret < 0) return ret;
+            return 0;
+        case CWS_OPCODE_PONG:
+            // Unsolicited PONGs are just ignored
+            return 0;
+        default:
+            return CWS_ERROR_FRAME_UNEXPECTED_OPCODE;
+        }
+    }
+
+    if (!reader->cont) {
+        switch (frame.opcode) {
+        case CWS_OPCODE_TEXT:
+        case CWS_OPCODE_BIN:
+            reader->kind = (Cws_Message_Kind) frame.opcode;
+            break;
+        default:
+            return CWS_ERROR_FRAME_UNEXPECTED_OPCODE;
+        }
+        reader->cont = true;
+        reader->payload_offset = frame_offset;
+    } else {
+        if (frame.opcode != CWS_OPCODE_CONT) {
+            return CWS_ERROR_FRAME_UNEXPECTED_OPCODE;
+        }
+        // Gluing the continuation to the payload over the headers of the frames in between
+        memmove(input->items + input->begin + reader->payload_offset + reader->payload_len, frame_payload, frame.payload_len);
+    }
+    reader->payload_len += frame.payload_len;
+
+    if (reader->kind == CWS_MESSAGE_TEXT) {
+        ret = cws__verify_utf8(input->items + input->begin + reader->payload_offset, reader->payload_len, &reader->verify_pos, frame.fin);
+        if (ret < 0) return ret;
+    }
+
+    return frame.fin ? 1 : 0;
+}
+
+// Hands the message assembled in cws->reader over to the caller and gets ready for the next one
+static void cws__finish_message(Cws *cws, Cws_Message *message, size_t headroom)
+{
+    Cws_Input_Buffer *input = &cws->input;
+    Cws_Reader *reader = &cws->reader;
+
+    if (reader->payload_offset < headroom) {
+        // Not enough space in front of the payload. Only possible when the message is at the very
+        // beginning of the buffer and its header is shorter than the requested headroom. Making
+        // space by shifting the payload along with the rest of the unconsumed bytes.
+        size_t shift = headroom - reader->payload_offset;
+        if (input->capacity < input->count + shift) {
+            size_t capacity = input->capacity;
+            while (capacity < input->count + shift) capacity *= 2;
+            input->items = realloc(input->items, capacity);
+            assert(input->items != NULL && "Buy more RAM lol");
+            input->capacity = capacity;
         }
+        unsigned char *payload = input->items + input->begin + reader->payload_offset;
+        memmove(input->items + input->pos + shift, input->items + input->pos, input->count - input->pos);
+        memmove(payload + shift, payload, reader->payload_len);
+        input->pos += shift;
+        input->count += shift;
+        reader->payload_offset += shift;
     }
-    return n;
+
+    message->kind = reader->kind;
+    message->payload = input->items + input->begin + reader->payload_offset;
+    message->payload_len = reader->payload_len;
+    *reader = (Cws_Reader) {0};
 }
 
-static int cws__read_frame_entire_payload(Cws *cws, Cws_Frame_Header frame_header, unsigned char **payload, size_t *payload_len)
+int cws_read_message_view(Cws *cws, Cws_Message *message, size_t headroom)
 {
-    *payload_len = frame_header.payload_len;
-    *payload = arena_alloc(&cws->arena, *payload_len);
-    size_t finished_payload_len = 0;
-    while (finished_payload_len < *payload_len) {
-        int ret = cws__read_frame_payload_chunk(cws, frame_header, *payload, *payload_len, finished_payload_len);
+    assert(!cws->stackless && "Use cws_next_message() in the stackless mode");
+
+    // The previous view is not needed anymore
+    cws->input.begin = cws->input.pos;
+    cws->reader = (Cws_Reader) {0};
+
+    for (;;) {
+        int ret = cws__read_frame(cws);
         if (ret < 0) return ret;
-        size_t n = ret;
-        finished_payload_len += n;
+        if (ret > 0) break;
     }
+    cws__finish_message(cws, message, headroom);
     return 0;
 }
 
-int cws_read_message(Cws *cws, Cws_Message *message)
+// Stackless mode //////////////////////////////
+
+void cws_feed(Cws *cws, const void *bytes, size_t len)
+{
+    assert(cws->stackless);
+    Cws_Input_Buffer *input = &cws->input;
+    if (input->begin == input->count) {
+        input->begin = 0;
+        input->pos = 0;
+        input->count = 0;
+    }
+    if (input->capacity - input->count < len) {
+        // Same as in cws__input_fill(): keeping only the bytes starting from begin
+        size_t kept = input->count - input->begin;
+        memmove(input->items, input->items + input->begin, kept);
+        input->pos -= input->begin;
+        input->count = kept;
+        input->begin = 0;
+        if (input->capacity < input->count + len) {
+            size_t capacity = input->capacity == 0 ? CWS_INPUT_INIT_CAP : input->capacity;
+            while (capacity < input->count + len) capacity *= 2;
+            input->items = realloc(input->items, capacity);
+            assert(input->items != NULL && "Buy more RAM lol");
+            input->capacity = capacity;
+        }
+    }
+    memcpy(input->items + input->count, bytes, len);
+    input->count += len;
+}
+
+// Checks if the next frame is in cws->input entirely, so cws__read_frame() can read it without
+// asking the socket for more. Also true if the frame is going to be rejected by its header alone,
+// so a huge frame fails right away instead of being buffered first.
+static bool cws__input_frame_ready(Cws *cws)
+{
+    Cws_Input_Buffer *input = &cws->input;
+    size_t available = input->count - input->pos;
+    if (available < 2) return false;
+    const unsigned char *header = input->items + input->pos;
+
+    size_t header_len = 2;
+    size_t payload_len = CWS_PAYLOAD_LEN(header);
+    size_t ext_len = payload_len == 126 ? 2 : payload_len == 127 ? 8 : 0;
+    header_len += ext_len;
+    bool masked = CWS_MASK(header);
+    if (masked) header_len += 4;
+    if (available < header_len) return false;
+    if (ext_len > 0) {
+        payload_len = 0;
+        for (size_t i = 0; i < ext_len; ++i) payload_len = (payload_len << 8) | header[2 + i];
+    }
+
+    Cws_Opcode opcode = (Cws_Opcode) CWS_OPCODE(header);
+    if (cws__opcode_is_control(opcode)) {
+        if (payload_len > 125) return true;
+    } else if (cws->max_message_size > 0) {
+        if (payload_len > cws->max_message_size - cws->reader.payload_len) return true;
+    }
+    return available - header_len >= payload_len;
+}
+
+int cws_next_message(Cws *cws, Cws_Message *message, size_t headroom)
 {
-    Cws_Payload_Buffer payload = {0};
-    bool cont = false;
-    size_t verify_pos = 0;
+    assert(cws->stackless);
+    Cws_Input_Buffer *input = &cws->input;
+
+    // The previous view is not needed anymore. Unless we are in the middle of a fragmented
+    // message, which is kept from begin.
+    if (!cws->reader.cont) input->begin = input->pos;
 
     for (;;) {
-        Cws_Frame_Header frame = {0};
-        int ret =  cws__read_frame_header(cws, &frame);
+        if (!cws__input_frame_ready(cws)) return CWS_ERROR_WOULD_BLOCK;
+        int ret = cws__read_frame(cws);
         if (ret < 0) return ret;
-        if (cws__opcode_is_control(frame.opcode)) {
-            unsigned char *payload;
-            size_t payload_len;
-            switch (frame.opcode) {
-            case CWS_OPCODE_CLOSE:
-                return CWS_ERROR_FRAME_CLOSE_SENT;
-            case CWS_OPCODE_PING:
-                ret = cws__read_frame_entire_payload(cws, frame, &payload, &payload_len);
-                if (ret < 0) return ret;
-                ret = cws__send_frame(cws, true, CWS_OPCODE_PONG, payload, payload_len);
-                if (ret < 0) return ret;
-                break;
-            case CWS_OPCODE_PONG:
-                ret = cws__read_frame_entire_payload(cws, frame, &payload, &payload_len);
-                if (ret < 0) return ret;
-                // Unsolicited PONGs are just ignored
-                break;
-            default:
-                return CWS_ERROR_FRAME_UNEXPECTED_OPCODE;
-            }
-        } else {
-            if (!cont) {
-                switch (frame.opcode) {
-                case CWS_OPCODE_TEXT:
-                case CWS_OPCODE_BIN:
-                    message->kind = (Cws_Message_Kind) frame.opcode;
-                    break;
-                default:
-                    return CWS_ERROR_FRAME_UNEXPECTED_OPCODE;
-                }
-                cont = true;
-            } else {
-                if (frame.opcode != CWS_OPCODE_CONT) {
-                    return CWS_ERROR_FRAME_UNEXPECTED_OPCODE;
-                }
-            }
-            size_t frame_payload_len = frame.payload_len;
-            unsigned char* frame_payload = arena_alloc(&cws->arena, frame_payload_len);
-            size_t frame_finished_payload_len = 0;
-            while (frame_finished_payload_len < frame_payload_len) {
-                int ret = cws__read_frame_payload_chunk(cws, frame, frame_payload, frame_payload_len, frame_finished_payload_len);
-                if (ret < 0) return ret;
-                size_t n = ret;
-                arena_sb_append_buf(&cws->arena, &payload, frame_payload + frame_finished_payload_len, n);
-                frame_finished_payload_len += n;
-
-                if (message->kind == CWS_MESSAGE_TEXT) {
-                    // Verifying UTF-8
-                    while (verify_pos < payload.count) {
-                        size_t size = payload.count - verify_pos;
-                        ret = cws__utf8_to_char32_fixed(&payload.items[verify_pos], &size);
-                        if (ret < 0) {
-                            if (ret != CWS_ERROR_UTF8_SHORT) return ret; // Fail-fast on invalid UTF-8 that is not unfinished UTF-8
-                            if (frame.fin)             return ret; // Not tolerating unfinished UTF-8 if the message is finished
-                            // Extending the finished UTF-8 to check if it fixes the problem
-                            size_t saved_len = payload.count;
-                            cws__extend_unfinished_utf8(cws, &payload, verify_pos);
-                            size = payload.count - verify_pos;
-                            ret = cws__utf8_to_char32_fixed(&payload.items[verify_pos], &size);
-                            if (ret < 0) return ret;
-                            payload.count = saved_len;
-                            break; // Tolerating the unfinished UTF-8 sequences if the message is unfinished
-                        }
-                        verify_pos += size;
-                    }
-                }
-            }
-            if (frame.fin) break;
+        if (ret > 0) break;
+    }
+    cws__finish_message(cws, message, headroom);
+    return 0;
+}
+
+int cws_next_handshake(Cws *cws)
+{
+    assert(cws->stackless);
+    assert(!cws->client && "The stackless mode only supports the server side of the handshake");
+    Cws_Input_Buffer *input = &cws->input;
+
+    input->begin = input->pos;
+    size_t available = input->count - input->begin;
+    const char *bytes = (const char*)input->items + input->begin;
+    size_t head_len = 0;
+    for (size_t i = 0; i + 4 <= available; ++i) {
+        if (memcmp(bytes + i, "\r\n\r\n", 4) == 0) {
+            head_len = i + 4;
+            break;
         }
     }
+    if (head_len == 0) {
+        if (available >= CWS_HTTP_HEAD_MAX_SIZE) return CWS_ERROR_HANDSHAKE_TOO_BIG;
+        return CWS_ERROR_WOULD_BLOCK;
+    }
+    // Whatever the client has sent after the head (for instance, the first frames) stays in cws->input
+    input->pos = input->begin + head_len;
+
+    const char *response = NULL;
+    int ret = cws__server_handshake_response(cws, sv_from_parts(bytes, head_len), &response);
+    if (ret < 0) return ret;
+
+    size_t response_len = strlen(response);
+    Cws_Shared_Message *message = malloc(sizeof(*message) + response_len);
+    assert(message != NULL && "Buy more RAM lol");
+    message->refcount = 1;
+    message->payload_len = response_len;
+    message->size = response_len;
+    memcpy(message->bytes, response, response_len);
+    // NOTE: bypassing the limit of the queue, the response is never dropped
+    Cws_Send_Queue_Item item = {.message = message, .tag = 0};
+    da_append(&cws->queue, item);
+    cws->queue.size += message->size;
+    return 0;
+}
+
+void cws_shrink(Cws *cws)
+{
+    Cws_Input_Buffer *input = &cws->input;
+    if (input->pos == input->count && !cws->reader.cont) {
+        free(input->items);
+        *input = (Cws_Input_Buffer) {0};
+    }
+    if (cws->queue.count == 0) {
+        free(cws->queue.items);
+        cws->queue.items = NULL;
+        cws->queue.capacity = 0;
+    }
+    arena_free(&cws->arena);
+}
 
-    message->payload = payload.items;
-    message->payload_len = payload.count;
+int cws_read_message(Cws *cws, Cws_Message *message)
+{
+    int ret = cws_read_message_view(cws, message, 0);
+    if (ret < 0) return ret;
+    message->payload = arena_memdup(&cws->arena, message->payload, message->payload_len);
+    return 0;
+}
 
+// Validates payload[*verify_pos..payload_len) and advances *verify_pos past the validated code points.
+// An unfinished sequence at the end of an unfinished message is left for the next call, so
+// *verify_pos is the whole state that has to be carried between the fragments.
+static int cws__verify_utf8(unsigned char *payload, size_t payload_len, size_t *verify_pos, bool fin)
+{
+    while (*verify_pos < payload_len) {
+        // ASCII is always valid UTF-8, so only the rest goes through the decoder
+        *verify_pos += cws__ascii_prefix_len(&payload[*verify_pos], payload_len - *verify_pos);
+        if (*verify_pos >= payload_len) break;
+
+        size_t size = payload_len - *verify_pos;
+        int ret = cws__utf8_to_char32_fixed(&payload[*verify_pos], &size);
+        if (ret < 0) {
+            if (ret != CWS_ERROR_UTF8_SHORT) return ret; // Fail-fast on invalid UTF-8 that is not unfinished UTF-8
+            if (fin)                         return ret; // Not tolerating unfinished UTF-8 if the message is finished
+            // Extending the unfinished UTF-8 to check if it fixes the problem
+            unsigned char extended[4];
+            size = cws__extend_unfinished_utf8(extended, &payload[*verify_pos], payload_len - *verify_pos);
+            ret = cws__utf8_to_char32_fixed(extended, &size);
+            if (ret < 0) return ret;
+            break; // Tolerating the unfinished UTF-8 sequences if the message is unfinished
+        }
+        *verify_pos += size;
+    }
     return 0;
 }
 
+// Returns the amount of ASCII bytes at the beginning of the buffer
+static size_t cws__ascii_prefix_len(const unsigned char *buffer, size_t len)
+{
+    size_t i = 0;
+#ifdef CWS_SSE2
+    for (; i + 32 <= len; i += 32) {
+        __m128i a = _mm_loadu_si128((const __m128i*)(buffer + i));
+        __m128i b = _mm_loadu_si128((const __m128i*)(buffer + i + 16));
+        if (_mm_movemask_epi8(_mm_or_si128(a, b)) != 0) break;
+    }
+    for (; i + 16 <= len; i += 16) {
+        int non_ascii = _mm_movemask_epi8(_mm_loadu_si128((const __m128i*)(buffer + i)));
+        if (non_ascii != 0) return i + __builtin_ctz(non_ascii);
+    }
+#endif // CWS_SSE2
+    for (; i + 8 <= len; i += 8) {
+        uint64_t word;
+        memcpy(&word, buffer + i, sizeof(word));
+        if (word & 0x8080808080808080ull) break;
+    }
+    while (i < len && buffer[i] < 0x80) i += 1;
+    return i;
+}
+
 static int32_t cws__utf8_to_char32_fixed(unsigned char* ptr, size_t* size)
 {
     size_t max_size = *size;
@@ -611,9 +1170,11 @@ static int32_t cws__utf8_to_char32_fixed(unsigned char* ptr, size_t* size)
     return uc;
 }
 
-static void cws__extend_unfinished_utf8(Cws *cws, Cws_Payload_Buffer *payload, size_t pos)
+// Copies the unfinished UTF-8 sequence into `extended` and pads it with continuation bytes up to the
+// size declared by its first byte. Returns the size of the extended sequence.
+static size_t cws__extend_unfinished_utf8(unsigned char extended[4], const unsigned char *unfinished, size_t unfinished_len)
 {
-    unsigned char c = payload->items[pos];
+    unsigned char c = unfinished[0];
     size_t size = 0;
     if ((c & 0x80) == 0) {
         size = 1;
@@ -624,7 +1185,10 @@ static void cws__extend_unfinished_utf8(Cws *cws, Cws_Payload_Buffer *payload, s
     } else {
         size = 4;
     }
-    while (payload->count - pos < size) arena_da_append(&cws->arena, payload, 0x80);
+    assert(unfinished_len < size);
+    memcpy(extended, unfinished, unfinished_len);
+    for (size_t i = unfinished_len; i < size; ++i) extended[i] = 0x80;
+    return size;
 }
 
 static int cws__parse_sec_websocket_key_from_request(String_View *request, String_View *sec_websocket_key)
@@ -685,6 +1249,10 @@ const char *cws_error_message(Cws *cws, Cws_Error error)
         case CWS_ERROR_CLIENT_HANDSHAKE_BAD_ACCEPT:        return "Client Handshake: bad Sec-WebSocket-Accept";
         case CWS_ERROR_CLIENT_HANDSHAKE_DUPLICATE_ACCEPT:  return "Client Handshake: duplicate Sec-WebSocket-Accept";
         case CWS_ERROR_CLIENT_HANDSHAKE_NO_ACCEPT:         return "Client Handshake: no Sec-WebSocket-Accept";
+        case CWS_ERROR_WOULD_BLOCK:                        return "Operation would block";
+        case CWS_ERROR_SEND_QUEUE_OVERFLOW:                return "Send queue overflow";
+        case CWS_ERROR_MESSAGE_TOO_BIG:                    return "Message too big";
+        case CWS_ERROR_HANDSHAKE_TOO_BIG:                  return "Handshake: HTTP head is too big";
         default: if (error <= CWS_ERROR_CUSTOM) {
             return arena_sprintf(&cws->arena, "Custom error (%d)", error);
         } else if (CWS_ERROR_CUSTOM < error && error < CWS_OK) {
@@ -703,3 +1271,5 @@ const char *cws_error_message(Cws *cws, Cws_Error error)
 #include "teenysha1.h"
 #define B64_IMPLEMENTATION
 #include "b64.h"
+#define WSMASK_IMPLEMENTATION
+#include "wsmask.h"
@@ -29,6 +29,10 @@ typedef enum {
     CWS_ERROR_CLIENT_HANDSHAKE_BAD_ACCEPT        =  -11,
     CWS_ERROR_CLIENT_HANDSHAKE_DUPLICATE_ACCEPT  =  -12,
     CWS_ERROR_CLIENT_HANDSHAKE_NO_ACCEPT         =  -13,
+    CWS_ERROR_WOULD_BLOCK                        =  -14,
+    CWS_ERROR_SEND_QUEUE_OVERFLOW                =  -15,
+    CWS_ERROR_MESSAGE_TOO_BIG                    =  -16,
+    CWS_ERROR_HANDSHAKE_TOO_BIG                  =  -17,
     CWS_ERROR_CUSTOM                             = -100,
 } Cws_Error;
 
@@ -39,7 +43,13 @@ typedef enum {
 // - TLS async on coroutines (if coroutines even work with OpenSSL)
 // Some of them are already implemented in examples
 
-// NOTE: read, write, and peek must never return 0. On internally returning 0 they must return CWS_ERROR_CONNECTION_CLOSED
+// A single buffer of a gather write (see Cws_Socket.writev)
+typedef struct {
+    const void *data;
+    size_t len;
+} Cws_Iovec;
+
+// NOTE: read, write, writev, try_writev, and peek must never return 0. On internally returning 0 they must return CWS_ERROR_CONNECTION_CLOSED
 typedef struct {
     void *data;
     int (*read)(void *data, void *buffer, size_t len);
@@ -49,33 +59,169 @@ typedef struct {
     int (*write)(void *data, const void *buffer, size_t len);
     int (*shutdown)(void *data, Cws_Shutdown_How how);
     int (*close)(void *data);
+    // writev: like write, but sends several buffers at once. Returns the total amount of bytes written
+    // which may be less than the sum of the lengths of the buffers, just like writev(2).
+    // Usually implemented via sendmsg. Optional: if NULL cws falls back to write.
+    int (*writev)(void *data, const Cws_Iovec *iov, size_t iovcnt);
+    // try_writev: like writev, but never blocks. Returns CWS_ERROR_WOULD_BLOCK if the socket cannot accept
+    // anything at the moment. Usually implemented via sendmsg with MSG_DONTWAIT. Optional: if it is provided
+    // all the outgoing frames go through Cws.queue (see cws_flush()), otherwise they are written right away.
+    int (*try_writev)(void *data, const Cws_Iovec *iov, size_t iovcnt);
 } Cws_Socket;
 
+// Bytes received from the socket, but not parsed yet
 typedef struct {
-    Cws_Socket socket;
-    Arena arena;   // All the dynamic memory allocations done by cws go into this arena
-    bool debug;    // Enable debug logging
-    bool client;
-} Cws;
+    unsigned char *items;
+    size_t count;
+    size_t capacity;
+    size_t begin;  // The bytes before begin are not needed anymore
+    size_t pos;    // The bytes before pos were already consumed by the parser
+} Cws_Input_Buffer;
+
+// What to do when a message does not fit into Cws_Send_Queue.limit
+typedef enum {
+    CWS_OVERFLOW_DISCONNECT = 0, // Fail with CWS_ERROR_SEND_QUEUE_OVERFLOW, so the caller drops the connection
+    CWS_OVERFLOW_DROP_OLDEST,    // Drop the oldest queued state updates (items with nonzero tag) to make room
+    CWS_OVERFLOW_COALESCE,       // Replace the queued state update that has the same tag with the new one
+} Cws_Overflow_Policy;
+
+typedef struct Cws_Shared_Message Cws_Shared_Message;
+
+typedef struct {
+    Cws_Shared_Message *message;
+    // 0 means that the message must be delivered. Anything else marks a state update that may be
+    // dropped or superseded by a newer message with the same tag when the queue overflows.
+    size_t tag;
+} Cws_Send_Queue_Item;
+
+// Frames waiting for the socket to become writable
+typedef struct {
+    Cws_Send_Queue_Item *items;
+    size_t count;
+    size_t capacity;
+    size_t sent;                // How many bytes of items[0] were already sent
+    size_t size;                // How many bytes are still waiting to be sent
+    size_t limit;               // The maximum of size. 0 means unlimited
+    Cws_Overflow_Policy policy;
+    size_t dropped;             // How many messages were dropped or coalesced so far
+} Cws_Send_Queue;
 
 typedef enum {
     CWS_MESSAGE_TEXT = 0x1,
     CWS_MESSAGE_BIN  = 0x2,
 } Cws_Message_Kind;
 
+// The message that is being read
+typedef struct {
+    bool cont;              // Some of its frames were read already
+    Cws_Message_Kind kind;
+    size_t verify_pos;      // How much of a text payload is verified to be UTF-8
+    size_t payload_offset;  // Where the payload starts relative to Cws_Input_Buffer.begin
+    size_t payload_len;
+} Cws_Reader;
+
+#define CWS_DEFAULT_MAX_FRAME_SIZE 1024
+
+typedef struct {
+    Cws_Socket socket;
+    Arena arena;   // All the dynamic memory allocations done by cws go into this arena
+    bool debug;    // Enable debug logging
+    bool client;
+    // There is no socket. The caller does all the IO and passes the bytes in and out of cws (see
+    // cws_feed() and cws_output()), so nothing ever blocks. Only for the server side connections.
+    bool stackless;
+    // The maximum payload of a single outgoing frame. Bigger messages are split into continuation
+    // frames. 0 means CWS_DEFAULT_MAX_FRAME_SIZE, SIZE_MAX means never split the messages at all.
+    size_t max_frame_size;
+    // The maximum size of an incoming message after reassembling all of its frames. Anything bigger
+    // fails with CWS_ERROR_MESSAGE_TOO_BIG before it is read into memory. 0 means unlimited.
+    size_t max_message_size;
+    Cws_Input_Buffer input; // Survives arena_reset() of the arena above. Freed by cws_close()
+    Cws_Send_Queue queue;   // Survives arena_reset() of the arena above. Freed by cws_close()
+    Cws_Reader reader;
+} Cws;
+
 typedef struct {
     Cws_Message_Kind kind;
     unsigned char *payload;
     size_t payload_len;
 } Cws_Message;
 
+// Frames of a server message serialized once to be sent to many connections. Immutable after the
+// creation. Reference counted, so the same buffer can be kept around by several connections.
+struct Cws_Shared_Message {
+    size_t refcount;
+    size_t payload_len;    // The size of the original payload
+    size_t size;           // The size of the serialized frames
+    unsigned char bytes[];
+};
+
 const char *cws_message_kind_name(Cws *cws, Cws_Message_Kind kind);
 const char *cws_error_message(Cws *cws, Cws_Error error);
 // TODO: cws_server_handshake should allow you to inspect endpoints requested by clients and reject them
 int cws_server_handshake(Cws *cws);
 int cws_client_handshake(Cws *cws, const char *host, const char *endpoint);
 int cws_send_message(Cws *cws, Cws_Message_Kind kind, unsigned char *payload, size_t payload_len);
+// Serializes the message into frames the same way cws_send_message() would on the server side with
+// the given Cws.max_frame_size. The result is allocated with malloc and has the refcount of 1.
+Cws_Shared_Message *cws_shared_message_new(Cws_Message_Kind kind, const unsigned char *payload, size_t payload_len, size_t max_frame_size);
+Cws_Shared_Message *cws_shared_message_acquire(Cws_Shared_Message *message);
+// Frees the message when the last reference is released
+void cws_shared_message_release(Cws_Shared_Message *message);
+// Sends the frames serialized by cws_shared_message_new(). Only for the server side connections,
+// because the client frames must be masked individually.
+int cws_send_shared_message(Cws *cws, Cws_Shared_Message *message);
+// Puts the message into cws->queue without sending anything, applying cws->queue.policy if it does
+// not fit into cws->queue.limit. The queue holds its own reference to the message. See
+// Cws_Send_Queue_Item for the meaning of the tag. Only for the server side connections.
+int cws_queue_shared_message(Cws *cws, Cws_Shared_Message *message, size_t tag);
+// Sends as much of cws->queue as the socket accepts without blocking (if Cws_Socket.try_writev is
+// provided). Returns the amount of bytes still left in the queue.
+int cws_flush(Cws *cws);
+// The payload of the message is allocated in cws->arena
 int cws_read_message(Cws *cws, Cws_Message *message);
+// Zero-copy version of cws_read_message(). The payload is unmasked and assembled in place right
+// in cws->input, so message->payload stays valid only until the next cws_read_message*() call.
+// It is guaranteed that `headroom` bytes right before message->payload may be overwritten by the
+// caller (for instance, to prepend a header of their own protocol without copying the payload).
+int cws_read_message_view(Cws *cws, Cws_Message *message, size_t headroom);
+// Sends the close frame, shuts the socket down and frees everything. In the stackless mode only
+// frees everything, the socket is up to the caller.
 void cws_close(Cws *cws);
 
+// # Stackless mode
+//
+// The functions above block (or yield the coroutine) in the socket until they are done, so every
+// connection needs a thread or a coroutine with a stack of its own. With Cws.stackless set, cws
+// never touches the socket and an event loop drives any number of connections with just a Cws each:
+//
+//     read() whatever came from the socket and cws_feed() it
+//     cws_next_handshake() until it stops returning CWS_ERROR_WOULD_BLOCK
+//     cws_next_message() until it returns CWS_ERROR_WOULD_BLOCK
+//     writev() what cws_output() returns and cws_output_consume() what was written
+//
+// The replies to PINGs and the messages sent with cws_send_message() and friends go to cws->queue
+// just like with Cws_Socket.try_writev.
+
+// Appends the bytes received from the socket to cws->input. May move the payload of the last
+// message returned by cws_next_message() around, so that one is not valid anymore.
+void cws_feed(Cws *cws, const void *bytes, size_t len);
+// Stackless cws_server_handshake(). Returns CWS_ERROR_WOULD_BLOCK until the whole HTTP request has
+// been fed, then queues the response.
+int cws_next_handshake(Cws *cws);
+// Stackless cws_read_message_view(). Returns CWS_ERROR_WOULD_BLOCK if the rest of the message has
+// not been fed yet. The frames that were already fed are handled right away, so a half of a
+// message costs nothing to resume.
+int cws_next_message(Cws *cws, Cws_Message *message, size_t headroom);
+// Fills `iov` with at most `iovcnt` buffers of what is waiting to be sent. Returns how many were
+// filled. They stay valid until cws_output_consume() or the next cws_*() call that queues something.
+size_t cws_output(Cws *cws, Cws_Iovec *iov, size_t iovcnt);
+// Forgets the first `written` bytes returned by cws_output()
+void cws_output_consume(Cws *cws, size_t written);
+// Frees the buffers of an idle connection: cws->input if everything in it has been read, the
+// storage of cws->queue if it is empty, and cws->arena. They are allocated again when needed, so
+// a connection that sits there doing nothing only costs sizeof(Cws). Invalidates the payload of the
+// last message and whatever was allocated in cws->arena.
+void cws_shrink(Cws *cws);
+
 #endif // CWS_H_
@@ -50,6 +50,19 @@ void sha1_process_bytes(SHA1 *sha1, const void* const data, size_t len);
 const uint32_t* sha1_get_digest(SHA1 *sha1, digest32_t digest);
 const uint8_t* sha1_get_digest_bytes(SHA1 *sha1, digest8_t digest);
 
+// Runs the SHA1 compression function over `count` consecutive 64 byte blocks.
+//
+// sha1_compress() picks the fastest implementation supported by the CPU. The rest of the functions
+// are exposed for benchmarking and testing.
+void sha1_compress(digest32_t digest, const uint8_t *blocks, size_t count);
+void sha1_compress_portable(digest32_t digest, const uint8_t *blocks, size_t count);
+#if defined(__x86_64__) && defined(__GNUC__)
+#define TEENY_SHA1_X86
+// Uses the SHA extensions (SHA-NI). Check sha1_shani_supported() before calling it.
+void sha1_compress_shani(digest32_t digest, const uint8_t *blocks, size_t count);
+int sha1_shani_supported(void);
+#endif // __x86_64__ && __GNUC__
+
 #endif // _TEENY_SHA1_HPP_
 
 #ifdef TEENY_SHA1_IMPLEMENTATION
@@ -59,24 +72,24 @@ static inline uint32_t sha1__left_rotate(uint32_t value, size_t count)
     return (value << count) ^ (value >> (32-count));
 }
 
-void sha1__process_block(SHA1 *sha1)
+static void sha1__compress_block_portable(digest32_t digest, const uint8_t *block)
 {
     uint32_t w[80];
     for (size_t i = 0; i < 16; i++) {
-        w[i]  = (sha1->block[i*4 + 0] << 24);
-        w[i] |= (sha1->block[i*4 + 1] << 16);
-        w[i] |= (sha1->block[i*4 + 2] << 8);
-        w[i] |= (sha1->block[i*4 + 3]);
+        w[i]  = ((uint32_t)block[i*4 + 0] << 24);
+        w[i] |= ((uint32_t)block[i*4 + 1] << 16);
+        w[i] |= ((uint32_t)block[i*4 + 2] << 8);
+        w[i] |= ((uint32_t)block[i*4 + 3]);
     }
     for (size_t i = 16; i < 80; i++) {
         w[i] = sha1__left_rotate((w[i-3] ^ w[i-8] ^ w[i-14] ^ w[i-16]), 1);
     }
 
-    uint32_t a = sha1->digest[0];
-    uint32_t b = sha1->digest[1];
-    uint32_t c = sha1->digest[2];
-    uint32_t d = sha1->digest[3];
-    uint32_t e = sha1->digest[4];
+    uint32_t a = digest[0];
+    uint32_t b = digest[1];
+    uint32_t c = digest[2];
+    uint32_t d = digest[3];
+    uint32_t e = digest[4];
 
     for (size_t i=0; i<80; ++i) {
         uint32_t f = 0;
@@ -103,11 +116,119 @@ void sha1__process_block(SHA1 *sha1)
         a = temp;
     }
 
-    sha1->digest[0] += a;
-    sha1->digest[1] += b;
-    sha1->digest[2] += c;
-    sha1->digest[3] += d;
-    sha1->digest[4] += e;
+    digest[0] += a;
+    digest[1] += b;
+    digest[2] += c;
+    digest[3] += d;
+    digest[4] += e;
+}
+
+void sha1_compress_portable(digest32_t digest, const uint8_t *blocks, size_t count)
+{
+    for (size_t i = 0; i < count; ++i) {
+        sha1__compress_block_portable(digest, blocks + i*64);
+    }
+}
+
+#ifdef TEENY_SHA1_X86
+#include <immintrin.h>
+#include <cpuid.h>
+
+int sha1_shani_supported(void)
+{
+    static int supported = -1;
+    if (supported < 0) {
+        unsigned int eax, ebx, ecx, edx;
+        supported = 0;
+        if (__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+            int ssse3  = (ecx & bit_SSSE3) != 0;
+            int sse4_1 = (ecx & bit_SSE4_1) != 0;
+            if (ssse3 && sse4_1 && __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) {
+                supported = (ebx & (1u << 29)) != 0; // SHA
+            }
+        }
+    }
+    return supported;
+}
+
+// Rounds 4*g..4*g+3 of the compression function. The message schedule lives in msg[4] and runs 3
+// groups ahead of the rounds (see Intel's "New Instructions Supporting the Secure Hash Algorithm on
+// Intel Architecture Processors"). Every condition is on a constant, so the compiler drops them.
+#define SHA1__SHANI_ROUNDS(g, e_next, e_prev)                                                            \
+    do {                                                                                                \
+        e_next = _mm_sha1nexte_epu32(e_next, msg[(g)%4]);                                               \
+        e_prev = abcd;                                                                                  \
+        if ((g) >= 3 && (g) <= 18) msg[((g)+1)%4] = _mm_sha1msg2_epu32(msg[((g)+1)%4], msg[(g)%4]);     \
+        abcd = _mm_sha1rnds4_epu32(abcd, e_next, (g)/5);                                                \
+        if ((g) >= 1 && (g) <= 16) msg[((g)+3)%4] = _mm_sha1msg1_epu32(msg[((g)+3)%4], msg[(g)%4]);     \
+        if ((g) >= 2 && (g) <= 17) msg[((g)+2)%4] = _mm_xor_si128(msg[((g)+2)%4], msg[(g)%4]);          \
+    } while (0)
+
+__attribute__((target("sha,ssse3,sse4.1")))
+void sha1_compress_shani(digest32_t digest, const uint8_t *blocks, size_t count)
+{
+    const __m128i byte_swap = _mm_set_epi64x(0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL);
+    __m128i abcd = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)digest), 0x1B);
+    __m128i e0 = _mm_set_epi32((int)digest[4], 0, 0, 0);
+    __m128i e1;
+    __m128i msg[4];
+
+    for (size_t i = 0; i < count; ++i) {
+        const uint8_t *block = blocks + i*64;
+        __m128i abcd_saved = abcd;
+        __m128i e0_saved = e0;
+        for (size_t j = 0; j < 4; ++j) {
+            msg[j] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(block + j*16)), byte_swap);
+        }
+
+        e0 = _mm_add_epi32(e0, msg[0]);
+        e1 = abcd;
+        abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+        SHA1__SHANI_ROUNDS(1,  e1, e0);
+        SHA1__SHANI_ROUNDS(2,  e0, e1);
+        SHA1__SHANI_ROUNDS(3,  e1, e0);
+        SHA1__SHANI_ROUNDS(4,  e0, e1);
+        SHA1__SHANI_ROUNDS(5,  e1, e0);
+        SHA1__SHANI_ROUNDS(6,  e0, e1);
+        SHA1__SHANI_ROUNDS(7,  e1, e0);
+        SHA1__SHANI_ROUNDS(8,  e0, e1);
+        SHA1__SHANI_ROUNDS(9,  e1, e0);
+        SHA1__SHANI_ROUNDS(10, e0, e1);
+        SHA1__SHANI_ROUNDS(11, e1, e0);
+        SHA1__SHANI_ROUNDS(12, e0, e1);
+        SHA1__SHANI_ROUNDS(13, e1, e0);
+        SHA1__SHANI_ROUNDS(14, e0, e1);
+        SHA1__SHANI_ROUNDS(15, e1, e0);
+        SHA1__SHANI_ROUNDS(16, e0, e1);
+        SHA1__SHANI_ROUNDS(17, e1, e0);
+        SHA1__SHANI_ROUNDS(18, e0, e1);
+        SHA1__SHANI_ROUNDS(19, e1, e0);
+
+        e0 = _mm_sha1nexte_epu32(e0, e0_saved);
+        abcd = _mm_add_epi32(abcd, abcd_saved);
+    }
+
+    _mm_storeu_si128((__m128i*)digest, _mm_shuffle_epi32(abcd, 0x1B));
+    digest[4] = (uint32_t)_mm_extract_epi32(e0, 3);
+}
+
+#undef SHA1__SHANI_ROUNDS
+#endif // TEENY_SHA1_X86
+
+void sha1_compress(digest32_t digest, const uint8_t *blocks, size_t count)
+{
+#ifdef TEENY_SHA1_X86
+    if (sha1_shani_supported()) {
+        sha1_compress_shani(digest, blocks, count);
+        return;
+    }
+#endif // TEENY_SHA1_X86
+    sha1_compress_portable(digest, blocks, count);
+}
+
+void sha1__process_block(SHA1 *sha1)
+{
+    sha1_compress(sha1->digest, sha1->block, 1);
 }
 
 void sha1_reset(SHA1 *sha1)
@@ -135,16 +256,37 @@ void sha1_process_block(SHA1 *sha1, const void* const start, const void* const e
 {
     const uint8_t* begin = (const uint8_t*)(start);
     const uint8_t* finish = (const uint8_t*)(end);
-    while(begin != finish) {
-        sha1_process_byte(sha1, *begin);
-        begin++;
-    }
+    sha1_process_bytes(sha1, begin, finish - begin);
 }
 
 void sha1_process_bytes(SHA1 *sha1, const void* const data, size_t len)
 {
-    const uint8_t* block = (const uint8_t*)(data);
-    sha1_process_block(sha1, block, block + len);
+    const uint8_t* bytes = (const uint8_t*)(data);
+    sha1->byte_count += len;
+
+    // Topping up the partially filled block first
+    if (sha1->block_byte_index > 0) {
+        size_t n = 64 - sha1->block_byte_index;
+        if (n > len) n = len;
+        memcpy(sha1->block + sha1->block_byte_index, bytes, n);
+        sha1->block_byte_index += n;
+        bytes += n;
+        len -= n;
+        if (sha1->block_byte_index < 64) return;
+        sha1->block_byte_index = 0;
+        sha1__process_block(sha1);
+    }
+
+    // The whole blocks are compressed right from the input without copying them into sha1->block
+    size_t count = len/64;
+    if (count > 0) {
+        sha1_compress(sha1->digest, bytes, count);
+        bytes += count*64;
+        len -= count*64;
+    }
+
+    memcpy(sha1->block, bytes, len);
+    sha1->block_byte_index = len;
 }
 
 const uint32_t* sha1_get_digest(SHA1 *sha1, digest32_t digest)
@@ -0,0 +1,126 @@
+#ifndef WSMASK_H_
+#define WSMASK_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+// XORs buffer in place with the WebSocket masking key (RFC 6455, Section 5.3). Masking and
+// unmasking is the same operation. `offset` is the position of buffer[0] within the frame payload,
+// so the payload may be processed in several pieces.
+//
+// wsmask_apply() picks the fastest implementation supported by the CPU. The rest of the functions
+// are exposed for benchmarking and testing.
+void wsmask_apply(unsigned char *buffer, size_t len, const unsigned char mask[4], size_t offset);
+void wsmask_apply_scalar(unsigned char *buffer, size_t len, const unsigned char mask[4], size_t offset);
+void wsmask_apply_word(unsigned char *buffer, size_t len, const unsigned char mask[4], size_t offset);
+#if defined(__x86_64__) && defined(__GNUC__)
+#define WSMASK_X86
+void wsmask_apply_sse2(unsigned char *buffer, size_t len, const unsigned char mask[4], size_t offset);
+void wsmask_apply_avx2(unsigned char *buffer, size_t len, const unsigned char mask[4], size_t offset);
+#endif // __x86_64__ && __GNUC__
+
+#endif // WSMASK_H_
+
+#ifdef WSMASK_IMPLEMENTATION
+
+#ifdef WSMASK_X86
+#include <immintrin.h>
+#endif // WSMASK_X86
+
+// The mask rotated so that its first byte applies to buffer[0], repeated to fill 32 bits
+static uint32_t wsmask__rotated32(const unsigned char mask[4], size_t offset)
+{
+    unsigned char rotated[4];
+    for (size_t i = 0; i < 4; ++i) rotated[i] = mask[(offset + i)%4];
+    uint32_t result;
+    memcpy(&result, rotated, sizeof(result));
+    return result;
+}
+
+void wsmask_apply_scalar(unsigned char *buffer, size_t len, const unsigned char mask[4], size_t offset)
+{
+    for (size_t i = 0; i < len; ++i) {
+        buffer[i] ^= mask[(offset + i)%4];
+    }
+}
+
+void wsmask_apply_word(unsigned char *buffer, size_t len, const unsigned char mask[4], size_t offset)
+{
+    // NOTE: 8 is a multiple of 4, so the rotation of the mask stays the same for every word
+    uint32_t mask32 = wsmask__rotated32(mask, offset);
+    uint64_t mask64 = ((uint64_t)mask32 << 32) | mask32;
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t word;
+        memcpy(&word, buffer + i, sizeof(word));
+        word ^= mask64;
+        memcpy(buffer + i, &word, sizeof(word));
+    }
+    wsmask_apply_scalar(buffer + i, len - i, mask, offset + i);
+}
+
+#ifdef WSMASK_X86
+void wsmask_apply_sse2(unsigned char *buffer, size_t len, const unsigned char mask[4], size_t offset)
+{
+    __m128i mask128 = _mm_set1_epi32((int)wsmask__rotated32(mask, offset));
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        __m128i block = _mm_loadu_si128((const __m128i*)(buffer + i));
+        _mm_storeu_si128((__m128i*)(buffer + i), _mm_xor_si128(block, mask128));
+    }
+    wsmask_apply_word(buffer + i, len - i, mask, offset + i);
+}
+
+__attribute__((target("avx2")))
+void wsmask_apply_avx2(unsigned char *buffer, size_t len, const unsigned char mask[4], size_t offset)
+{
+    uint32_t mask32 = wsmask__rotated32(mask, offset);
+    __m256i mask256 = _mm256_set1_epi32((int)mask32);
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        __m256i block = _mm256_loadu_si256((const __m256i*)(buffer + i));
+        _mm256_storeu_si256((__m256i*)(buffer + i), _mm256_xor_si256(block, mask256));
+    }
+    // NOTE: the tail is handled right here instead of calling wsmask_apply_sse2(), because mixing
+    // the legacy SSE encoding with dirty upper halves of the AVX registers is very slow on some CPUs
+    if (i + 16 <= len) {
+        __m128i block = _mm_loadu_si128((const __m128i*)(buffer + i));
+        _mm_storeu_si128((__m128i*)(buffer + i), _mm_xor_si128(block, _mm256_castsi256_si128(mask256)));
+        i += 16;
+    }
+    uint64_t mask64 = ((uint64_t)mask32 << 32) | mask32;
+    if (i + 8 <= len) {
+        uint64_t word;
+        memcpy(&word, buffer + i, sizeof(word));
+        word ^= mask64;
+        memcpy(buffer + i, &word, sizeof(word));
+        i += 8;
+    }
+    for (; i < len; ++i) {
+        buffer[i] ^= (unsigned char)(mask64 >> (8*(i%4)));
+    }
+}
+#endif // WSMASK_X86
+
+void wsmask_apply(unsigned char *buffer, size_t len, const unsigned char mask[4], size_t offset)
+{
+    // Control frames and the tiny game messages are not worth any setup
+    if (len < 16) {
+        wsmask_apply_scalar(buffer, len, mask, offset);
+        return;
+    }
+#ifdef WSMASK_X86
+    // NOTE: SSE2 is always available on x86_64. __builtin_cpu_supports() just reads what the runtime has
+    // detected at startup, so it is cheap enough to not cache it, which would race between the schedulers.
+    if (__builtin_cpu_supports("avx2")) {
+        wsmask_apply_avx2(buffer, len, mask, offset);
+    } else {
+        wsmask_apply_sse2(buffer, len, mask, offset);
+    }
+#else
+    wsmask_apply_word(buffer, len, mask, offset);
+#endif // WSMASK_X86
+}
+
+#endif // WSMASK_IMPLEMENTATION
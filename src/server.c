@@ -1,10 +1,16 @@
+#define _GNU_SOURCE // accept4()
 #include <assert.h>
 #include <stdlib.h>
 #include <errno.h>
 #include <time.h>
+#include <limits.h>
 
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/resource.h>
+#include <sys/random.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <fcntl.h>
@@ -17,6 +23,9 @@
 #include "cws.h"
 #include "coroutine.h"
 #include "stats.h"
+#ifdef SERVER_IO_URING
+#include "uring.h"
+#endif // SERVER_IO_URING
 
 // TODO: stb_ds does not provide maximum performance. we should eventually implement our own hash table.
 #define STB_DS_IMPLEMENTATION
@@ -24,15 +33,74 @@
 
 // WARNING! Must be in sync with the value in server.c3
 #define SERVER_TOTAL_LIMIT 2000
+// How many connections a single IP may have open at once, counting the ones that are still doing the
+// handshake
 #define SERVER_SINGLE_IP_LIMIT 10
 #define SERVER_FPS 60
 
+// How many bytes may pile up for a player that does not keep up with reading, and what to do when
+// there is more (see Cws_Overflow_Policy)
+// NOTE: Nothing the server sends may be dropped or coalesced. Even the PlayersMoving batches are deltas:
+// a player is only in there on the tick their movement changes, so losing one leaves the client
+// extrapolating the player the wrong way forever. A player that cannot keep up gets disconnected.
+#define SERVER_SEND_QUEUE_LIMIT (256*1024)
+#define SERVER_SEND_QUEUE_POLICY CWS_OVERFLOW_DISCONNECT
+// Browsers reassemble fragmented messages just fine, but there is no point in making them do that
+#define SERVER_MAX_FRAME_SIZE SIZE_MAX
+// The clients only ever send tiny messages (see verify_amma_moving_message() and friends)
+#define SERVER_MAX_MESSAGE_SIZE 1024
+// How long a freshly accepted connection may take to complete the WebSocket handshake
+#define SERVER_HANDSHAKE_TIMEOUT_MSECS 5000
+// How many connections may wait to be accepted. After a restart all the clients reconnect at once.
+// NOTE: Linux silently caps it at net.core.somaxconn
+#define SERVER_LISTEN_BACKLOG 4096
+// How many connections are accepted per iteration of the main loop at most, so a reconnect storm
+// does not starve the tick
+#define SERVER_ACCEPT_BUDGET 256
+// Stack size of the coroutines of the server. Check the usage with `node build.js server --stack-debug`
+// after changing what they do.
+#define SERVER_COROUTINE_STACK_SIZE (64*1024)
+// A connection that keeps the CPU busy for more than that share of the time gets reported. Only measured
+// with `node build.js server --coroutine-stats`.
+#define SERVER_HOG_CPU_SHARE 0.05
+// Token buckets of every IP (see admission_connect()). A source that connects faster than that is
+// shed right after accept(), before it costs a handshake, a coroutine and a player. A source that
+// sends messages faster than that gets all its players disconnected one by one.
+#define SERVER_IP_CONNECT_RATE 2.0f      // Connections per second
+#define SERVER_IP_CONNECT_BURST 20.0f
+#define SERVER_IP_MESSAGE_RATE 200.0f    // Messages per second, shared by all the players of the IP
+#define SERVER_IP_MESSAGE_BURST 400.0f
+// How many cells of the spatial grids around the cell of a player the player is told about in every
+// direction (see interest_broadcast()). The client does not draw anything beyond FAR_CLIPPING_PLANE
+// (see client.c), plus a cell of slack, so nothing pops in right at the edge of the view.
+#define SERVER_INTEREST_RADIUS 11
+
+// What the players get told about within their area of interest (see Interest_Event)
+typedef enum {
+    INTEREST_PLAYER_JOINED = 0,    // The subject is the slot of the player
+    INTEREST_PLAYER_LEFT,          // The subject is the id of the player
+    INTEREST_PLAYER_MOVING,        // The subject is the slot of the player
+    INTEREST_BOMB_SPAWNED,         // The subject is the index of the bomb
+    INTEREST_BOMB_EXPLODED,        // The subject is the index of the bomb
+    INTEREST_ITEM_COLLECTED,       // The subject is the index of the item
+} Interest_Kind;
+
 Arena temp = {0};
 
 // Forward declarations //////////////////////////////
 
 void send_message_and_update_stats(uint32_t player_id, void* message);
+Cws_Shared_Message *shared_message_new(void *message_raw);
+uint32_t send_shared_message(uint32_t player_id, Cws_Shared_Message *shared_message);
+void send_shared_message_and_update_stats(uint32_t player_id, Cws_Shared_Message *shared_message);
 bool process_message_on_server(uint32_t id, Message* message);
+uint32_t now_msecs();
+void socket_sleep_write(Cws_Socket socket);
+void interest_broadcast(IVector2 cell, Interest_Kind kind, uint32_t subject);
+void interest_player_joined(size_t slot);
+void interest_player_left(uint32_t id, IVector2 cell);
+void interest_player_moved(size_t slot, IVector2 from, IVector2 to);
+void interest_bomb_moved(size_t index, IVector2 from, IVector2 to);
 
 // Items //////////////////////////////
 
@@ -42,75 +110,424 @@ typedef struct {
     size_t capacity;
 } Indices;
 
-Indices collected_items = {0};
+// The alive items. Nothing moves them, so they only ever leave it.
+Spatial_Grid items_grid = {0};
+// The collected items. The players that come close to them are told they are gone (see
+// interest_player_moved()), since nobody told them when it happened.
+Spatial_Grid dead_items_grid = {0};
 
-void collect_items_by_player(Player player, Item *items, size_t items_count) {
+// The items every player knows to be collected, so nobody is told about the same item twice (see
+// interest__push()). A bitset of items_known_words words per slot of the players. The one after the
+// last slot has all the collected items, which is what the players know once they get the snapshot.
+static uint64_t *items_known = NULL;
+static size_t items_known_words = 0;
+
+static uint64_t *items_known_by_slot(size_t slot)
+{
+    assert(slot <= SERVER_TOTAL_LIMIT);
+    return items_known + slot*items_known_words;
+}
+
+static void items__mark_collected(uint64_t *known, size_t index)
+{
+    known[index/64] |= 1ull<<(index%64);
+}
+
+static bool items__is_collected(const uint64_t *known, size_t index)
+{
+    return (known[index/64]>>(index%64))&1;
+}
+
+static void items__grid_init(Spatial_Grid *grid, size_t items_count)
+{
+    grid->buckets_count = 64;
+    while (grid->buckets_count < 2*items_count) grid->buckets_count *= 2;
+    grid->buckets = calloc(grid->buckets_count, sizeof(*grid->buckets));
+    grid->nodes_count = items_count;
+    grid->nodes = calloc(items_count, sizeof(*grid->nodes));
+    assert(grid->buckets != NULL && (items_count == 0 || grid->nodes != NULL) && "Buy more RAM lol");
+}
+
+void items_grids_init(Item *items, size_t items_count)
+{
+    items__grid_init(&items_grid, items_count);
+    items__grid_init(&dead_items_grid, items_count);
+    items_known_words = (items_count + 63)/64;
+    items_known = calloc((SERVER_TOTAL_LIMIT + 1)*items_known_words, sizeof(*items_known));
+    assert((items_count == 0 || items_known != NULL) && "Buy more RAM lol");
     for (size_t index = 0; index < items_count; ++index) {
-        Item *item = &items[index];
-        if (collect_item(player, item)) {
-            da_append(&collected_items, index);
-        }
+        spatial_grid_insert(items[index].alive ? &items_grid : &dead_items_grid, index, items[index].position);
+        if (!items[index].alive) items__mark_collected(items_known_by_slot(SERVER_TOTAL_LIMIT), index);
     }
 }
 
-ItemsCollectedBatchMessage *collected_items_as_batch_message() {
-    if (collected_items.count == 0) return NULL;
-    ItemsCollectedBatchMessage *message = alloc_items_collected_batch_message(collected_items.count);
-    for (size_t i = 0; i < collected_items.count; ++i) {
-        message->payload[i] = collected_items.items[i];
+void collect_items_by_player(Player player, Item *items, size_t items_count) {
+    Spatial_Grid_Query query = spatial_grid_query_radius(&items_grid, player.position, PLAYER_RADIUS);
+    size_t index;
+    while (spatial_grid_query_next(&query, &index)) {
+        assert(index < items_count);
+        if (collect_item(player, &items[index])) {
+            spatial_grid_remove(&items_grid, index);
+            spatial_grid_insert(&dead_items_grid, index, items[index].position);
+            items__mark_collected(items_known_by_slot(SERVER_TOTAL_LIMIT), index);
+            interest_broadcast(dead_items_grid.nodes[index].cell, INTEREST_ITEM_COLLECTED, index);
+        }
     }
-    collected_items.count = 0;
-    return message;
 }
 
-// Connection Limits //////////////////////////////
+// Admission //////////////////////////////
+
+typedef struct {
+    uint8_t bytes[16];  // IPv6 or IPv4-mapped IPv6 (::ffff:a.b.c.d)
+} Ip_Address;
 
 typedef struct {
-    ShortString key;           // remote address
-    uint32_t value;             // count
-} Connection_Limit;
+    Ip_Address address;
+    uint32_t connections;       // Currently open, including the ones doing the handshake
+    uint32_t refilled_at;       // now_msecs() of the last refill of the buckets
+    float connect_tokens;
+    float message_tokens;
+} Admission;
+
+// NOTE: Open addressing with linear probing. Every slot has a tag byte: 0 if the slot is empty,
+// otherwise 0x80 | 7 more bits of the hash. The probes scan the tags, which are packed together, and
+// only look at the entry when the tag matches, so a miss rarely touches more than a cache line.
+typedef struct {
+    uint8_t *tags;
+    Admission *entries;
+    size_t capacity;            // Power of two
+    size_t count;
+    uint64_t seed;              // So the sources cannot pick the addresses that collide
+} Admissions;
 
-Connection_Limit *connection_limits = NULL;
+Admissions admissions = {0};
 
-uint32_t *connection_limits_get(ShortString remote_address)
+Ip_Address ip_address_from_sockaddr(const struct sockaddr_storage *addr)
 {
-    ptrdiff_t i = hmgeti(connection_limits, remote_address);
-    if (i < 0) return NULL;
-    return &connection_limits[i].value;
+    Ip_Address result = {0};
+    if (addr->ss_family == AF_INET6) {
+        memcpy(result.bytes, &((const struct sockaddr_in6*)addr)->sin6_addr, 16);
+    } else if (addr->ss_family == AF_INET) {
+        result.bytes[10] = 0xff;
+        result.bytes[11] = 0xff;
+        memcpy(result.bytes + 12, &((const struct sockaddr_in*)addr)->sin_addr, 4);
+    }
+    return result;
 }
 
-void connection_limits_set(ShortString remote_address, uint count)
+// NOTE: The local clients (the benchmarks, the tests, a reverse proxy) are not limited
+bool ip_address_is_loopback(Ip_Address address)
 {
-    hmput(connection_limits, remote_address, count);
+    static const uint8_t v4_prefix[12] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff};
+    static const uint8_t v6_loopback[16] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1};
+    if (memcmp(address.bytes, v4_prefix, 12) == 0) return address.bytes[12] == 127;
+    return memcmp(address.bytes, v6_loopback, 16) == 0;
 }
 
-void connection_limits_remove(ShortString remote_address)
+static uint64_t admissions__hash(Ip_Address address)
 {
-    int deleted = hmdel(connection_limits, remote_address);
-    UNUSED(deleted);
+    uint64_t lo, hi;
+    memcpy(&lo, address.bytes, 8);
+    memcpy(&hi, address.bytes + 8, 8);
+    uint64_t h = (lo ^ admissions.seed)*0x9E3779B97F4A7C15ull;
+    h = (h ^ (h >> 32) ^ hi)*0x9E3779B97F4A7C15ull;
+    return h ^ (h >> 29);
+}
+
+static uint8_t admissions__tag(uint64_t hash)
+{
+    return 0x80 | (uint8_t)(hash >> 57);
+}
+
+static void admissions__put(Admission entry)
+{
+    size_t mask = admissions.capacity - 1;
+    uint64_t hash = admissions__hash(entry.address);
+    size_t i = hash & mask;
+    while (admissions.tags[i] != 0) i = (i + 1)&mask;
+    admissions.tags[i] = admissions__tag(hash);
+    admissions.entries[i] = entry;
+    admissions.count += 1;
+}
+
+static void admissions__grow(void)
+{
+    Admissions old = admissions;
+    admissions.capacity = old.capacity == 0 ? 256 : old.capacity*2;
+    admissions.count = 0;
+    admissions.tags = calloc(admissions.capacity, sizeof(*admissions.tags));
+    admissions.entries = malloc(admissions.capacity*sizeof(*admissions.entries));
+    assert(admissions.tags != NULL && admissions.entries != NULL && "Buy more RAM lol");
+    for (size_t i = 0; i < old.capacity; ++i) {
+        if (old.tags[i] != 0) admissions__put(old.entries[i]);
+    }
+    free(old.tags);
+    free(old.entries);
+}
+
+// Returns the index of the entry of the address or -1 if there is none
+static ptrdiff_t admissions__find(Ip_Address address)
+{
+    if (admissions.capacity == 0) return -1;
+    size_t mask = admissions.capacity - 1;
+    uint64_t hash = admissions__hash(address);
+    uint8_t tag = admissions__tag(hash);
+    for (size_t i = hash & mask; admissions.tags[i] != 0; i = (i + 1)&mask) {
+        if (admissions.tags[i] == tag && memcmp(&admissions.entries[i].address, &address, sizeof(address)) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void admissions__remove(size_t hole)
+{
+    // NOTE: No tombstones. Every entry after the hole that would not be found anymore with the hole in
+    // the way is moved into it (backward shift deletion).
+    size_t mask = admissions.capacity - 1;
+    for (size_t i = (hole + 1)&mask; admissions.tags[i] != 0; i = (i + 1)&mask) {
+        size_t home = admissions__hash(admissions.entries[i].address)&mask;
+        if (((i - home)&mask) >= ((i - hole)&mask)) {
+            admissions.tags[hole] = admissions.tags[i];
+            admissions.entries[hole] = admissions.entries[i];
+            hole = i;
+        }
+    }
+    admissions.tags[hole] = 0;
+    admissions.count -= 1;
+}
+
+static void admission__refill(Admission *admission, uint32_t now)
+{
+    float elapsed = (float)(now - admission->refilled_at)/1000.0f;
+    admission->refilled_at = now;
+    admission->connect_tokens += elapsed*SERVER_IP_CONNECT_RATE;
+    if (admission->connect_tokens > SERVER_IP_CONNECT_BURST) admission->connect_tokens = SERVER_IP_CONNECT_BURST;
+    admission->message_tokens += elapsed*SERVER_IP_MESSAGE_RATE;
+    if (admission->message_tokens > SERVER_IP_MESSAGE_BURST) admission->message_tokens = SERVER_IP_MESSAGE_BURST;
+}
+
+// Decides whether a freshly accepted connection from the address may stay. Must be paired with
+// admission_disconnect() if it may.
+bool admission_connect(Ip_Address address, uint32_t now)
+{
+    if (ip_address_is_loopback(address)) return true;
+
+    ptrdiff_t i = admissions__find(address);
+    if (i < 0) {
+        if (2*(admissions.count + 1) > admissions.capacity) admissions__grow();
+        admissions__put((Admission) {
+            .address = address,
+            .refilled_at = now,
+            .connect_tokens = SERVER_IP_CONNECT_BURST,
+            .message_tokens = SERVER_IP_MESSAGE_BURST,
+        });
+        i = admissions__find(address);
+        assert(i >= 0);
+    }
+
+    Admission *admission = &admissions.entries[i];
+    admission__refill(admission, now);
+    // NOTE: Every attempt takes a token, so hammering at SERVER_SINGLE_IP_LIMIT runs out of them too
+    if (admission->connect_tokens < 1.0f) return false;
+    admission->connect_tokens -= 1.0f;
+    if (admission->connections >= SERVER_SINGLE_IP_LIMIT) return false;
+    admission->connections += 1;
+    return true;
+}
+
+void admission_disconnect(Ip_Address address)
+{
+    ptrdiff_t i = admissions__find(address);
+    if (i < 0) return;
+    assert(admissions.entries[i].connections > 0);
+    admissions.entries[i].connections -= 1;
+}
+
+// Takes a token for a message received from the address. Returns false if the address has run out of them.
+bool admission_message(Ip_Address address, uint32_t now)
+{
+    ptrdiff_t i = admissions__find(address);
+    if (i < 0) return true;
+    Admission *admission = &admissions.entries[i];
+    admission__refill(admission, now);
+    if (admission->message_tokens < 1.0f) return false;
+    admission->message_tokens -= 1.0f;
+    return true;
+}
+
+// Forgets the addresses that have no connections and would have full buckets anyway. Does the actual
+// work once a second.
+void admissions_sweep(uint32_t now)
+{
+    static uint32_t swept_at = 0;
+    if (now - swept_at < 1000) return;
+    swept_at = now;
+
+    for (size_t i = 0; i < admissions.capacity;) {
+        Admission *admission = &admissions.entries[i];
+        if (admissions.tags[i] != 0 && admission->connections == 0) {
+            admission__refill(admission, now);
+            if (admission->connect_tokens >= SERVER_IP_CONNECT_BURST && admission->message_tokens >= SERVER_IP_MESSAGE_BURST) {
+                admissions__remove(i);
+                // NOTE: not moving on, the removal may have shifted another entry into this slot
+                continue;
+            }
+        }
+        i += 1;
+    }
 }
 
 // Player //////////////////////////////
 
-typedef struct {         // WARNING! Must be in sync with the one in server.c3
-    Player player;
-    char new_moving;
-    ShortString remote_address;
-} PlayerOnServer;
+// How many entries the id -> slot index of the players has. Must be a power of two and at least twice
+// as big as SERVER_TOTAL_LIMIT, so the probe sequences stay short.
+#define PLAYERS_INDEX_BITS 12
+#define PLAYERS_INDEX_CAPACITY (1u<<PLAYERS_INDEX_BITS)
+static_assert(PLAYERS_INDEX_CAPACITY >= 2*SERVER_TOTAL_LIMIT, "The index of the players is too small");
 
-typedef struct {         // WARNING! Must be in sync with the one in server.c3
-    uint key;
-    PlayerOnServer value;
-} PlayerOnServerEntry;
+typedef struct {
+    uint32_t id;
+    uint32_t slot;      // Slot + 1. 0 means the entry is empty
+} Players_Index_Entry;
 
-PlayerOnServerEntry *players = NULL;
+// NOTE: The players are stored as a structure of arrays, so every loop of the tick streams through just
+// the fields it needs. The slots are dense: removing a player moves the last one in its place, so the
+// slot of a player may change whenever somebody leaves. Hold onto the ids, not the slots.
+typedef struct {
+    size_t count;
 
-typedef struct {         // WARNING! Must be in sync with the on in server.c3
-    uint32_t key;
-    bool value;
-} PlayerIdsEntry;
-PlayerIdsEntry* joined_ids = NULL;
-PlayerIdsEntry* left_ids = NULL;
+    // Hot. Touched by the tick
+    uint32_t ids[SERVER_TOTAL_LIMIT];
+    Vector2 positions[SERVER_TOTAL_LIMIT];
+    float directions[SERVER_TOTAL_LIMIT];
+    uint8_t moving[SERVER_TOTAL_LIMIT];
+    uint8_t new_moving[SERVER_TOTAL_LIMIT];
+    bool joined[SERVER_TOTAL_LIMIT];        // Joined since the last tick
+    size_t joined_count;
+
+    // Cold. Only needed when somebody joins
+    uint8_t hues[SERVER_TOTAL_LIMIT];
+
+    // id -> slot. Open addressing with linear probing
+    Players_Index_Entry index[PLAYERS_INDEX_CAPACITY];
+} Players;
+
+static Players players = {0};
+
+// Where the players are. Indexed by the slots.
+#define PLAYERS_GRID_BUCKETS 4096
+static uint32_t players_grid_buckets[PLAYERS_GRID_BUCKETS] = {0};
+static Spatial_Grid_Node players_grid_nodes[SERVER_TOTAL_LIMIT] = {0};
+static Spatial_Grid players_grid = {
+    .buckets = players_grid_buckets,
+    .buckets_count = PLAYERS_GRID_BUCKETS,
+    .nodes = players_grid_nodes,
+    .nodes_count = SERVER_TOTAL_LIMIT,
+};
+
+static uint32_t players__hash(uint32_t id)
+{
+    // Fibonacci hashing. The ids are sequential, which it spreads evenly.
+    return (id*2654435769u)>>(32 - PLAYERS_INDEX_BITS);
+}
+
+// Returns the slot of the player or -1 if there is no such player
+ptrdiff_t players_slot(uint32_t id)
+{
+    for (uint32_t i = players__hash(id);; i = (i + 1)&(PLAYERS_INDEX_CAPACITY - 1)) {
+        Players_Index_Entry *entry = &players.index[i];
+        if (entry->slot == 0) return -1;
+        if (entry->id == id) return entry->slot - 1;
+    }
+}
+
+static void players__index_set(uint32_t id, size_t slot)
+{
+    for (uint32_t i = players__hash(id);; i = (i + 1)&(PLAYERS_INDEX_CAPACITY - 1)) {
+        Players_Index_Entry *entry = &players.index[i];
+        if (entry->slot == 0 || entry->id == id) {
+            entry->id = id;
+            entry->slot = slot + 1;
+            return;
+        }
+    }
+}
+
+static void players__index_remove(uint32_t id)
+{
+    uint32_t mask = PLAYERS_INDEX_CAPACITY - 1;
+    uint32_t hole = players__hash(id);
+    while (players.index[hole].id != id) {
+        assert(players.index[hole].slot != 0);
+        hole = (hole + 1)&mask;
+    }
+
+    // NOTE: No tombstones. Every entry after the hole that would not be found anymore with the hole in
+    // the way is moved into it (backward shift deletion).
+    for (uint32_t i = (hole + 1)&mask; players.index[i].slot != 0; i = (i + 1)&mask) {
+        uint32_t home = players__hash(players.index[i].id);
+        if (((i - home)&mask) >= ((i - hole)&mask)) {
+            players.index[hole] = players.index[i];
+            hole = i;
+        }
+    }
+    players.index[hole].slot = 0;
+}
+
+static size_t players__add(uint32_t id)
+{
+    assert(players.count < SERVER_TOTAL_LIMIT);
+    size_t slot = players.count++;
+    players.ids[slot]        = id;
+    players.positions[slot]  = (Vector2) {0};
+    players.directions[slot] = 0;
+    players.moving[slot]     = 0;
+    players.new_moving[slot] = 0;
+    players.joined[slot]     = true;
+    players.hues[slot]       = 0;
+    players.joined_count += 1;
+    players__index_set(id, slot);
+    spatial_grid_insert(&players_grid, slot, players.positions[slot]);
+    return slot;
+}
+
+static void players__remove(size_t slot)
+{
+    assert(slot < players.count);
+    if (players.joined[slot]) players.joined_count -= 1;
+    players__index_remove(players.ids[slot]);
+    spatial_grid_remove(&players_grid, slot);
+
+    size_t last = --players.count;
+    if (slot != last) {
+        spatial_grid_remove(&players_grid, last);
+        spatial_grid_insert(&players_grid, slot, players.positions[last]);
+        players.ids[slot]              = players.ids[last];
+        players.positions[slot]        = players.positions[last];
+        players.directions[slot]       = players.directions[last];
+        players.moving[slot]           = players.moving[last];
+        players.new_moving[slot]       = players.new_moving[last];
+        players.joined[slot]           = players.joined[last];
+        players.hues[slot]             = players.hues[last];
+        memcpy(items_known_by_slot(slot), items_known_by_slot(last), items_known_words*sizeof(*items_known));
+        players__index_set(players.ids[slot], slot);
+    }
+}
+
+// The players that left since the last tick and the cells they were in
+typedef struct {
+    uint32_t id;
+    IVector2 cell;
+} Left_Player;
+
+typedef struct {
+    Left_Player *items;
+    size_t count;
+    size_t capacity;
+} Left_Players;
+
+Left_Players left_players = {0};
 
 typedef struct {         // WARNING! Must be in sync with the on in server.c
     uint32_t key;
@@ -118,49 +535,15 @@ typedef struct {         // WARNING! Must be in sync with the on in server.c
 } PingEntry;
 PingEntry *ping_ids = NULL;
 
-bool register_new_player(uint32_t id, ShortString* remote_address) {
-    if (hmlen(players) >= SERVER_TOTAL_LIMIT) {
+// NOTE: The limits of the IP of the player are enforced way earlier by admission_connect()
+bool register_new_player(uint32_t id) {
+    if (players.count >= SERVER_TOTAL_LIMIT) {
         stat_inc_counter(SE_PLAYERS_REJECTED, 1);
         return false;
     }
 
-    if (remote_address != NULL) {
-        size_t remote_address_len = strlen((char*)remote_address); // WutFace
-        if (remote_address_len == 0) {
-            stat_inc_counter(SE_PLAYERS_REJECTED, 1);
-            return false;
-        }
-
-        uint32_t *count = connection_limits_get(*remote_address);
-        if (count) {
-            // TODO: we need to let the player know somehow that they were rejected due to the limit
-            if (*count >= SERVER_SINGLE_IP_LIMIT) {
-                stat_inc_counter(SE_PLAYERS_REJECTED, 1);
-                return false;
-            }
-            connection_limits_set(*remote_address, *count + 1);
-        } else {
-            connection_limits_set(*remote_address, 1);
-        }
-    }
-
-    assert(hmgeti(players, id) < 0);
-    hmput(joined_ids, id, true);
-
-    if (remote_address != NULL) {
-        hmput(players, id, ((PlayerOnServer) {
-            .player = {
-                .id = id,
-            },
-            .remote_address = *remote_address,
-        }));
-    } else {
-        hmput(players, id, ((PlayerOnServer) {
-            .player = {
-                .id = id,
-            },
-        }));
-    }
+    assert(players_slot(id) < 0);
+    players__add(id);
 
     stat_inc_counter(SE_PLAYERS_JOINED, 1);
     stat_inc_counter(SE_PLAYERS_CURRENTLY, 1);
@@ -170,187 +553,98 @@ bool register_new_player(uint32_t id, ShortString* remote_address) {
 
 void unregister_player(uint32_t id) {
     // console.log(`Player ${id} disconnected`);
-    ptrdiff_t place = hmgeti(players, id);
-    if (place >= 0) {
-        PlayerOnServer *player = &players[place].value;
-        uint32_t *count = connection_limits_get(player->remote_address);
-        if (count) {
-            if (*count <= 1) {
-                connection_limits_remove(player->remote_address);
-            } else {
-                connection_limits_set(player->remote_address, *count - 1);
-            }
-        }
-
-        if (!hmdel(joined_ids, id)) {
-            hmput(left_ids, id, false);
+    ptrdiff_t slot = players_slot(id);
+    if (slot >= 0) {
+        // Nobody has been told about the player yet if they joined during this tick
+        if (!players.joined[slot]) {
+            Left_Player left_player = {
+                .id   = id,
+                .cell = players_grid.nodes[slot].cell,
+            };
+            da_append(&left_players, left_player);
         }
 
         stat_inc_counter(SE_PLAYERS_LEFT, 1);
         stat_inc_counter(SE_PLAYERS_CURRENTLY, -1);
-        hmdel(players, id);
+        players__remove(slot);
     }
 }
 
-PlayersJoinedBatchMessage *all_players_as_joined_batch_message() {
-    if (hmlen(players) == 0) return NULL;
-    PlayersJoinedBatchMessage *message = alloc_players_joined_batch_message(hmlen(players));
-    for (ptrdiff_t i = 0; i < hmlen(players); ++i) {
-        PlayerOnServerEntry* entry = &players[i];
-        message->payload[i].id        = entry->value.player.id;
-        message->payload[i].x         = entry->value.player.position.x;
-        message->payload[i].y         = entry->value.player.position.y;
-        message->payload[i].direction = entry->value.player.direction;
-        message->payload[i].hue       = entry->value.player.hue;
-        message->payload[i].moving    = entry->value.player.moving;
-    };
-    return message;
-}
-
-PlayersJoinedBatchMessage *joined_players_as_batch_message() {
-    if (hmlen(joined_ids) == 0) return NULL;
-    PlayersJoinedBatchMessage *message = alloc_players_joined_batch_message(hmlen(joined_ids));
-    int index = 0;
-    for (ptrdiff_t i = 0; i < hmlen(joined_ids); ++i) {
-        PlayerIdsEntry *entry = &joined_ids[i];
-        uint32_t joined_id = entry->key;
-        ptrdiff_t place = hmgeti(players, joined_id);
-        if (place >= 0) { // This should never happen, but we're handling none existing ids for more robustness
-            PlayerOnServer *joined_player = &players[place].value;
-            message->payload[index].id        = joined_player->player.id;
-            message->payload[index].x         = joined_player->player.position.x;
-            message->payload[index].y         = joined_player->player.position.y;
-            message->payload[index].direction = joined_player->player.direction;
-            message->payload[index].hue       = joined_player->player.hue;
-            message->payload[index].moving    = joined_player->player.moving;
-            index += 1;
-        }
-    }
-
-    return message;
-}
-
-PlayersLeftBatchMessage *left_players_as_batch_message() {
-    if (hmlen(left_ids) == 0) return NULL;
-    PlayersLeftBatchMessage *message = alloc_players_left_batch_message(hmlen(left_ids));
-    int index = 0;
-    for (ptrdiff_t i = 0; i < hmlen(left_ids); ++i) {
-        PlayerIdsEntry *entry = &left_ids[i];
-        uint32_t left_id = entry->key;
-        message->payload[index] = left_id;
-        index += 1;
-    }
-    return message;
+static PlayerStruct player_as_joined(size_t slot) {
+    PlayerStruct joined = {0};
+    joined.id        = players.ids[slot];
+    joined.x         = players.positions[slot].x;
+    joined.y         = players.positions[slot].y;
+    joined.direction = players.directions[slot];
+    joined.hue       = players.hues[slot];
+    joined.moving    = players.moving[slot];
+    return joined;
 }
 
 void process_joined_players(Item* items, size_t items_count) {
-    if (hmlen(joined_ids) == 0) return;
-
-    // Initialize joined players
-    {
-        // Reconstructing the state of the other players batch
-        PlayersJoinedBatchMessage *players_joined_batch_message = all_players_as_joined_batch_message();
-
-        // Reconstructing the state of items batch
-        ItemsSpawnedBatchMessage *items_spanwed_batch_message = reconstruct_state_of_items(items, items_count);
-
-        // Greeting all the joined players and notifying them about other players
-        for (ptrdiff_t i = 0; i < hmlen(joined_ids); ++i) {
-            PlayerIdsEntry *entry = &joined_ids[i];
-            uint joined_id = entry->key;
-            ptrdiff_t place = hmgeti(players, joined_id);
-            if (place >= 0) { // This should never happen, but we're handling none existing ids for more robustness
-                PlayerOnServer *joined_player = &players[place].value;
-                // The greetings
-                HelloMessage hello_message = {
-                    .byte_length = sizeof(HelloMessage),
-                    .kind        = MK_HELLO,
-                    .payload     = {
-                        .id         = joined_player->player.id,
-                        .x          = joined_player->player.position.x,
-                        .y          = joined_player->player.position.y,
-                        .direction  = joined_player->player.direction,
-                        .hue        = joined_player->player.hue,
-                    }
-                };
-                send_message_and_update_stats(joined_id, &hello_message);
-
-                // Reconstructing the state of the other players
-                if (players_joined_batch_message != NULL) {
-                    send_message_and_update_stats(joined_id, players_joined_batch_message);
-                }
-
-                // Reconstructing the state of items
-                if (items_spanwed_batch_message != NULL) {
-                    send_message_and_update_stats(joined_id, items_spanwed_batch_message);
-                }
-
-                // TODO: Reconstructing the state of bombs
+    if (players.joined_count == 0) return;
+
+    // Reconstructing the state of items batch
+    // NOTE: The items are cheap and few, so every joined player gets all of them instead of just the ones
+    // around. The client needs them to be complete anyway, it does not forget them when they are far.
+    ItemsSpawnedBatchMessage *items_spanwed_batch_message = reconstruct_state_of_items(items, items_count);
+    Cws_Shared_Message *items_spawned_shared_message = shared_message_new(items_spanwed_batch_message);
+
+    // Greeting all the joined players and introducing them to the players around
+    for (size_t slot = 0; slot < players.count; ++slot) {
+        if (!players.joined[slot]) continue;
+        uint32_t joined_id = players.ids[slot];
+        // The greetings
+        HelloMessage hello_message = {
+            .byte_length = sizeof(HelloMessage),
+            .kind        = MK_HELLO,
+            .payload     = {
+                .id         = joined_id,
+                .x          = players.positions[slot].x,
+                .y          = players.positions[slot].y,
+                .direction  = players.directions[slot],
+                .hue        = players.hues[slot],
             }
-        }
-    }
+        };
+        send_message_and_update_stats(joined_id, &hello_message);
 
-    // Notifying old player about who joined
-    PlayersJoinedBatchMessage *players_joined_batch_message = joined_players_as_batch_message();
-    if (players_joined_batch_message != NULL) {
-        for (ptrdiff_t i = 0; i < hmlen(players); ++i) {
-            PlayerOnServerEntry* entry = &players[i];
-            if (hmgeti(joined_ids, entry->value.player.id) < 0) { // Joined player should already know about themselves
-                send_message_and_update_stats(entry->value.player.id, players_joined_batch_message);
-            }
+        // Reconstructing the state of items
+        if (items_spawned_shared_message != NULL) {
+            send_shared_message_and_update_stats(joined_id, items_spawned_shared_message);
         }
+        // NOTE: The client forgets all the items on hello, so whatever is not in the snapshot is collected as far as it knows
+        memcpy(items_known_by_slot(slot), items_known_by_slot(SERVER_TOTAL_LIMIT), items_known_words*sizeof(*items_known));
+
+        // Reconstructing the state of the other players and the bombs around
+        interest_player_joined(slot);
     }
+
+    if (items_spawned_shared_message != NULL) cws_shared_message_release(items_spawned_shared_message);
 }
 
 void process_left_players() {
     // Notifying about whom left
-    if (hmlen(left_ids) == 0) return;
-    PlayersLeftBatchMessage *players_left_batch_message = left_players_as_batch_message();
-    for (ptrdiff_t i = 0; i < hmlen(players); ++i) {
-        PlayerOnServerEntry* entry = &players[i];
-        send_message_and_update_stats(entry->value.player.id, players_left_batch_message);
+    for (size_t i = 0; i < left_players.count; ++i) {
+        interest_player_left(left_players.items[i].id, left_players.items[i].cell);
     }
 }
 
 void process_moving_players() {
-    int count = 0;
-    for (ptrdiff_t i = 0; i < hmlen(players); ++i) {
-        PlayerOnServerEntry* entry = &players[i];
-        if (entry->value.new_moving != entry->value.player.moving) {
-            count += 1;
-        }
-    }
-    if (count <= 0) return;
-
-    PlayersMovingBatchMessage *message = alloc_players_moving_batch_message(count);
-    int index = 0;
-    for (ptrdiff_t i = 0; i < hmlen(players); ++i) {
-        PlayerOnServerEntry* entry = &players[i];
-        if (entry->value.new_moving != entry->value.player.moving) {
-            entry->value.player.moving = entry->value.new_moving;
-            message->payload[index].id        = entry->value.player.id;
-            message->payload[index].x         = entry->value.player.position.x;
-            message->payload[index].y         = entry->value.player.position.y;
-            message->payload[index].direction = entry->value.player.direction;
-            message->payload[index].moving    = entry->value.player.moving;
-            index += 1;
+    for (size_t slot = 0; slot < players.count; ++slot) {
+        if (players.new_moving[slot] != players.moving[slot]) {
+            players.moving[slot] = players.new_moving[slot];
+            interest_broadcast(players_grid.nodes[slot].cell, INTEREST_PLAYER_MOVING, slot);
         }
     }
-
-    for (ptrdiff_t i = 0; i < hmlen(players); ++i) {
-        PlayerOnServerEntry* entry = &players[i];
-        send_message_and_update_stats(entry->value.player.id, message);
-    }
 }
 
 void player_update_moving(uint32_t id, AmmaMovingMessage *message) {
-    ptrdiff_t place = hmgeti(players, id);
-    if (place >= 0) {
-        PlayerOnServer *value = &players[place].value;
+    ptrdiff_t slot = players_slot(id);
+    if (slot >= 0) {
         if (message->payload.start) {
-            value->new_moving |= (1<<(uint32_t)message->payload.direction);
+            players.new_moving[slot] |= (1<<(uint32_t)message->payload.direction);
         } else {
-            value->new_moving &= ~(1<<(uint32_t)message->payload.direction);
+            players.new_moving[slot] &= ~(1<<(uint32_t)message->payload.direction);
         }
     }
 }
@@ -359,36 +653,53 @@ void player_update_moving(uint32_t id, AmmaMovingMessage *message) {
 
 Indices thrown_bombs = {0};
 
+// The bombs that are flying. Indexed the same way as Bombs.items.
+#define BOMBS_GRID_BUCKETS 64
+static uint32_t bombs_grid_buckets[BOMBS_GRID_BUCKETS] = {0};
+static Spatial_Grid_Node bombs_grid_nodes[BOMBS_CAPACITY] = {0};
+static Spatial_Grid bombs_grid = {
+    .buckets = bombs_grid_buckets,
+    .buckets_count = BOMBS_GRID_BUCKETS,
+    .nodes = bombs_grid_nodes,
+    .nodes_count = BOMBS_CAPACITY,
+};
+
 void throw_bomb_on_server_side(uint32_t player_id, Bombs *bombs) {
-    ptrdiff_t place = hmgeti(players, player_id);
-    if (place >= 0) {
-        PlayerOnServer *player = &players[place].value;
-        int index = throw_bomb(player->player.position, player->player.direction, bombs);
-        if (index >= 0) da_append(&thrown_bombs, (size_t)index);
+    ptrdiff_t slot = players_slot(player_id);
+    if (slot >= 0) {
+        int index = throw_bomb(players.positions[slot], players.directions[slot], bombs);
+        if (index >= 0) {
+            spatial_grid_insert(&bombs_grid, index, bombs->items[index].position);
+            da_append(&thrown_bombs, (size_t)index);
+        }
     }
 }
 
-BombsSpawnedBatchMessage *thrown_bombs_as_batch_message(Bombs *bombs) {
-    if (thrown_bombs.count == 0) return NULL;
-    BombsSpawnedBatchMessage *message = alloc_bombs_spawned_batch_message(thrown_bombs.count);
-    for (size_t index = 0; index < thrown_bombs.count; ++index) {
-        size_t bombIndex = thrown_bombs.items[index];
-        assert(bombIndex < BOMBS_CAPACITY);
-        Bomb *bomb = &bombs->items[bombIndex];
-        message->payload[index].bombIndex = (uint32_t)bombIndex;
-        message->payload[index].x = bomb->position.x;
-        message->payload[index].y = bomb->position.y;
-        message->payload[index].z = bomb->position_z;
-        message->payload[index].dx = bomb->velocity.x;
-        message->payload[index].dy = bomb->velocity.y;
-        message->payload[index].dz = bomb->velocity_z;
-        message->payload[index].lifetime = bomb->lifetime;
-    }
-    thrown_bombs.count = 0;
-    return message;
+static BombSpawned bomb_as_spawned(Bombs *bombs, size_t index) {
+    assert(index < BOMBS_CAPACITY);
+    Bomb *bomb = &bombs->items[index];
+    BombSpawned spawned = {0};
+    spawned.bombIndex = (uint32_t)index;
+    spawned.x         = bomb->position.x;
+    spawned.y         = bomb->position.y;
+    spawned.z         = bomb->position_z;
+    spawned.dx        = bomb->velocity.x;
+    spawned.dy        = bomb->velocity.y;
+    spawned.dz        = bomb->velocity_z;
+    spawned.lifetime  = bomb->lifetime;
+    return spawned;
 }
 
-Indices exploded_bombs = {0};
+static BombExploded bomb_as_exploded(Bombs *bombs, size_t index) {
+    assert(index < BOMBS_CAPACITY);
+    Bomb *bomb = &bombs->items[index];
+    BombExploded exploded = {0};
+    exploded.bombIndex = (uint32_t)index;
+    exploded.x         = bomb->position.x;
+    exploded.y         = bomb->position.y;
+    exploded.z         = bomb->position_z;
+    return exploded;
+}
 
 void update_bombs_on_server_side(float delta_time, Bombs *bombs) {
     for (size_t bombIndex = 0; bombIndex < BOMBS_CAPACITY; ++bombIndex) {
@@ -396,67 +707,293 @@ void update_bombs_on_server_side(float delta_time, Bombs *bombs) {
         if (bomb->lifetime > 0) {
             update_bomb(bomb, delta_time);
             if (bomb->lifetime <= 0) {
-                da_append(&exploded_bombs, bombIndex);
+                spatial_grid_remove(&bombs_grid, bombIndex);
+                interest_broadcast(spatial_grid_cell(bomb->position), INTEREST_BOMB_EXPLODED, bombIndex);
+            } else {
+                IVector2 from = bombs_grid.nodes[bombIndex].cell;
+                spatial_grid_update(&bombs_grid, bombIndex, bomb->position);
+                IVector2 to = bombs_grid.nodes[bombIndex].cell;
+                if (from.x != to.x || from.y != to.y) interest_bomb_moved(bombIndex, from, to);
             }
         }
     }
 }
 
-BombsExplodedBatchMessage* exploded_bombs_as_batch_message(Bombs* bombs) {
-    if (exploded_bombs.count == 0) return NULL;
-    BombsExplodedBatchMessage *message = alloc_bombs_exploded_batch_message(exploded_bombs.count);
-    for (size_t index = 0; index < exploded_bombs.count; ++index) {
-        size_t bombIndex = exploded_bombs.items[index];
-        assert(bombIndex < BOMBS_CAPACITY);
-        Bomb bomb = bombs->items[bombIndex];
-        message->payload[index].bombIndex = bombIndex;
-        message->payload[index].x         = bomb.position.x;
-        message->payload[index].y         = bomb.position.y;
-        message->payload[index].z         = bomb.position_z;
+void process_thrown_bombs() {
+    // Notifying about thrown bombs
+    for (size_t i = 0; i < thrown_bombs.count; ++i) {
+        size_t index = thrown_bombs.items[i];
+        interest_broadcast(bombs_grid.nodes[index].cell, INTEREST_BOMB_SPAWNED, index);
     }
-    exploded_bombs.count = 0;
-    return message;
+    thrown_bombs.count = 0;
 }
 
-void process_thrown_bombs(Bombs *bombs) {
-    // Notifying about thrown bombs
-    BombsSpawnedBatchMessage *bombs_spawned_batch_message = thrown_bombs_as_batch_message(bombs);
-    if (bombs_spawned_batch_message != NULL) {
-        for (ptrdiff_t i = 0; i < hmlen(players); ++i) {
-            PlayerOnServerEntry* entry = &players[i];
-            send_message_and_update_stats(entry->value.player.id, bombs_spawned_batch_message);
-        }
+// Interest //////////////////////////////
+
+// NOTE: A player is told only about what happens within SERVER_INTEREST_RADIUS cells of the spatial
+// grids around the cell they are in: their area of interest. The relation is symmetric, so whoever is
+// interested in something at a cell is within the same area around that cell, which is what
+// interest_broadcast() looks up. Every time a player or a bomb changes cells, the ones that have just
+// come into each other's areas get introduced and the players that have just gone out of each other's
+// areas forget each other. So a player always knows exactly the players around, and the updates about
+// them never reach somebody who does not know them. The collected items are told about only once
+// though, the first time the player comes close to them or sees them go (see items_known), since
+// they never come back.
+//
+// The events are collected during the tick and assembled into batches for every player at the end of
+// it (see process_interest_events()). The subjects of the events are slots, which stay put within the
+// tick, because the players only leave in between.
+typedef struct {
+    uint32_t recipient;     // The slot of the player to tell
+    uint32_t subject;       // See Interest_Kind
+    Interest_Kind kind;
+} Interest_Event;
+
+typedef struct {
+    Interest_Event *items;
+    size_t count;
+    size_t capacity;
+} Interest_Events;
+
+Interest_Events interest_events = {0};
+
+static void interest__push(size_t recipient, Interest_Kind kind, uint32_t subject)
+{
+    if (kind == INTEREST_ITEM_COLLECTED) {
+        // The items never come back, so once is enough
+        uint64_t *known = items_known_by_slot(recipient);
+        if (items__is_collected(known, subject)) return;
+        items__mark_collected(known, subject);
     }
+    Interest_Event event = {
+        .recipient = recipient,
+        .subject   = subject,
+        .kind      = kind,
+    };
+    da_append(&interest_events, event);
 }
 
-// World //////////////////////////////
+typedef struct {
+    IVector2 min, max;
+} Cell_Rect;
 
-void process_world_simulation(Item *items, size_t items_len, Bombs *bombs, float delta_time) {
-    // Simulating the world for one server tick.
-    for (ptrdiff_t i = 0; i < hmlen(players); ++i) {
-        PlayerOnServerEntry* entry = &players[i];
-        update_player(&entry->value.player, delta_time);
-        collect_items_by_player(entry->value.player, items, items_len);
+static Cell_Rect interest__area(IVector2 cell)
+{
+    return (Cell_Rect) {
+        .min = {cell.x - SERVER_INTEREST_RADIUS, cell.y - SERVER_INTEREST_RADIUS},
+        .max = {cell.x + SERVER_INTEREST_RADIUS, cell.y + SERVER_INTEREST_RADIUS},
+    };
+}
+
+// The cells of `a` that are not in `b` as up to 4 rectangles that do not overlap. Returns how many of
+// them there are.
+static size_t cell_rect_difference(Cell_Rect a, Cell_Rect b, Cell_Rect rects[4])
+{
+    if (b.max.x < a.min.x || a.max.x < b.min.x || b.max.y < a.min.y || a.max.y < b.min.y) {
+        rects[0] = a;
+        return 1;
+    }
+    size_t count = 0;
+    // The columns on the left and on the right of `b`
+    if (a.min.x < b.min.x) rects[count++] = (Cell_Rect) {a.min, {b.min.x - 1, a.max.y}};
+    if (b.max.x < a.max.x) rects[count++] = (Cell_Rect) {{b.max.x + 1, a.min.y}, a.max};
+    // The rows below and above `b` in between them
+    int min_x = a.min.x > b.min.x ? a.min.x : b.min.x;
+    int max_x = a.max.x < b.max.x ? a.max.x : b.max.x;
+    if (a.min.y < b.min.y) rects[count++] = (Cell_Rect) {{min_x, a.min.y}, {max_x, b.min.y - 1}};
+    if (b.max.y < a.max.y) rects[count++] = (Cell_Rect) {{min_x, b.max.y + 1}, {max_x, a.max.y}};
+    return count;
+}
+
+// Tells everybody who is interested in what happens at the cell
+void interest_broadcast(IVector2 cell, Interest_Kind kind, uint32_t subject)
+{
+    Cell_Rect area = interest__area(cell);
+    Spatial_Grid_Query query = spatial_grid_query_cells(&players_grid, area.min, area.max);
+    size_t slot;
+    while (spatial_grid_query_next(&query, &slot)) {
+        interest__push(slot, kind, subject);
     }
+}
+
+// Introduces the player that has just joined to the players and the bombs around and the other way around
+void interest_player_joined(size_t slot)
+{
+    Cell_Rect area = interest__area(players_grid.nodes[slot].cell);
+    Spatial_Grid_Query query = spatial_grid_query_cells(&players_grid, area.min, area.max);
+    size_t other;
+    while (spatial_grid_query_next(&query, &other)) {
+        if (other == slot) continue;
+        interest__push(slot, INTEREST_PLAYER_JOINED, other);
+        // The ones that joined as well introduce themselves
+        if (!players.joined[other]) interest__push(other, INTEREST_PLAYER_JOINED, slot);
+    }
+
+    query = spatial_grid_query_cells(&bombs_grid, area.min, area.max);
+    size_t index;
+    while (spatial_grid_query_next(&query, &index)) {
+        interest__push(slot, INTEREST_BOMB_SPAWNED, index);
+    }
+}
+
+// Makes the players that know the player who has left at the cell forget them. Those are exactly the
+// players around the cell that did not just join: nobody moves in between the ticks, and the ones that
+// joined since the last tick have never been introduced to the player.
+void interest_player_left(uint32_t id, IVector2 cell)
+{
+    Cell_Rect area = interest__area(cell);
+    Spatial_Grid_Query query = spatial_grid_query_cells(&players_grid, area.min, area.max);
+    size_t slot;
+    while (spatial_grid_query_next(&query, &slot)) {
+        if (players.joined[slot]) continue;
+        interest__push(slot, INTEREST_PLAYER_LEFT, id);
+    }
+}
 
-    ItemsCollectedBatchMessage *items_collected_batch_message = collected_items_as_batch_message();
-    if (items_collected_batch_message) {
-        for (ptrdiff_t i = 0; i < hmlen(players); ++i) {
-            PlayerOnServerEntry* entry = &players[i];
-            send_message_and_update_stats(entry->value.player.id, items_collected_batch_message);
+void interest_player_moved(size_t slot, IVector2 from, IVector2 to)
+{
+    Cell_Rect rects[4];
+    size_t rects_count = cell_rect_difference(interest__area(to), interest__area(from), rects);
+    for (size_t i = 0; i < rects_count; ++i) {
+        Spatial_Grid_Query query = spatial_grid_query_cells(&players_grid, rects[i].min, rects[i].max);
+        size_t other;
+        while (spatial_grid_query_next(&query, &other)) {
+            if (other == slot) continue;
+            interest__push(slot, INTEREST_PLAYER_JOINED, other);
+            interest__push(other, INTEREST_PLAYER_JOINED, slot);
+        }
+
+        query = spatial_grid_query_cells(&bombs_grid, rects[i].min, rects[i].max);
+        size_t index;
+        while (spatial_grid_query_next(&query, &index)) {
+            interest__push(slot, INTEREST_BOMB_SPAWNED, index);
+        }
+
+        query = spatial_grid_query_cells(&dead_items_grid, rects[i].min, rects[i].max);
+        while (spatial_grid_query_next(&query, &index)) {
+            interest__push(slot, INTEREST_ITEM_COLLECTED, index);
         }
     }
 
-    update_bombs_on_server_side(delta_time, bombs);
-    BombsExplodedBatchMessage *bombs_exploded_batch_message = exploded_bombs_as_batch_message(bombs);
-    if (bombs_exploded_batch_message) {
-        for (ptrdiff_t i = 0; i < hmlen(players); ++i) {
-            PlayerOnServerEntry* entry = &players[i];
-            send_message_and_update_stats(entry->value.player.id, bombs_exploded_batch_message);
+    rects_count = cell_rect_difference(interest__area(from), interest__area(to), rects);
+    for (size_t i = 0; i < rects_count; ++i) {
+        Spatial_Grid_Query query = spatial_grid_query_cells(&players_grid, rects[i].min, rects[i].max);
+        size_t other;
+        while (spatial_grid_query_next(&query, &other)) {
+            if (other == slot) continue;
+            interest__push(slot, INTEREST_PLAYER_LEFT, players.ids[other]);
+            interest__push(other, INTEREST_PLAYER_LEFT, players.ids[slot]);
         }
     }
 }
 
+// NOTE: The players the bomb has gone away from are not told anything. The bomb just keeps flying on
+// their side until its lifetime runs out, far enough from them to not matter.
+void interest_bomb_moved(size_t index, IVector2 from, IVector2 to)
+{
+    Cell_Rect rects[4];
+    size_t rects_count = cell_rect_difference(interest__area(to), interest__area(from), rects);
+    for (size_t i = 0; i < rects_count; ++i) {
+        Spatial_Grid_Query query = spatial_grid_query_cells(&players_grid, rects[i].min, rects[i].max);
+        size_t slot;
+        while (spatial_grid_query_next(&query, &slot)) {
+            interest__push(slot, INTEREST_BOMB_SPAWNED, index);
+        }
+    }
+}
+
+// Sends the events from `begin` to `end`, which are all of the same kind, to the player as a single batch
+static void interest__send_batch(uint32_t player_id, const Interest_Event *begin, const Interest_Event *end, Bombs *bombs)
+{
+    size_t count = end - begin;
+    switch (begin->kind) {
+    case INTEREST_PLAYER_JOINED: {
+        PlayersJoinedBatchMessage *message = alloc_players_joined_batch_message(count);
+        for (size_t i = 0; i < count; ++i) message->payload[i] = player_as_joined(begin[i].subject);
+        send_message_and_update_stats(player_id, message);
+    } break;
+    case INTEREST_PLAYER_LEFT: {
+        PlayersLeftBatchMessage *message = alloc_players_left_batch_message(count);
+        for (size_t i = 0; i < count; ++i) message->payload[i] = begin[i].subject;
+        send_message_and_update_stats(player_id, message);
+    } break;
+    case INTEREST_PLAYER_MOVING: {
+        PlayersMovingBatchMessage *message = alloc_players_moving_batch_message(count);
+        for (size_t i = 0; i < count; ++i) message->payload[i] = player_as_joined(begin[i].subject);
+        send_message_and_update_stats(player_id, message);
+    } break;
+    case INTEREST_BOMB_SPAWNED: {
+        BombsSpawnedBatchMessage *message = alloc_bombs_spawned_batch_message(count);
+        for (size_t i = 0; i < count; ++i) message->payload[i] = bomb_as_spawned(bombs, begin[i].subject);
+        send_message_and_update_stats(player_id, message);
+    } break;
+    case INTEREST_BOMB_EXPLODED: {
+        BombsExplodedBatchMessage *message = alloc_bombs_exploded_batch_message(count);
+        for (size_t i = 0; i < count; ++i) message->payload[i] = bomb_as_exploded(bombs, begin[i].subject);
+        send_message_and_update_stats(player_id, message);
+    } break;
+    case INTEREST_ITEM_COLLECTED: {
+        ItemsCollectedBatchMessage *message = alloc_items_collected_batch_message(count);
+        for (size_t i = 0; i < count; ++i) message->payload[i] = begin[i].subject;
+        send_message_and_update_stats(player_id, message);
+    } break;
+    default: UNREACHABLE("Interest_Kind");
+    }
+}
+
+// Assembles the events of the tick into the batches of every player and sends them. The batches go out
+// in the order the events happened in, so a player never hears about somebody before being introduced.
+void process_interest_events(Bombs *bombs)
+{
+    if (interest_events.count == 0) return;
+
+    // NOTE: Counting sort by the recipient. It is stable, so the events of every player keep their order.
+    size_t *offsets = arena_alloc(&temp, (players.count + 1)*sizeof(*offsets));
+    Interest_Event *sorted = arena_alloc(&temp, interest_events.count*sizeof(*sorted));
+    memset(offsets, 0, (players.count + 1)*sizeof(*offsets));
+    for (size_t i = 0; i < interest_events.count; ++i) {
+        assert(interest_events.items[i].recipient < players.count);
+        offsets[interest_events.items[i].recipient + 1] += 1;
+    }
+    for (size_t slot = 0; slot < players.count; ++slot) offsets[slot + 1] += offsets[slot];
+    for (size_t i = 0; i < interest_events.count; ++i) {
+        sorted[offsets[interest_events.items[i].recipient]++] = interest_events.items[i];
+    }
+
+    const Interest_Event *end = sorted + interest_events.count;
+    for (const Interest_Event *begin = sorted; begin < end;) {
+        const Interest_Event *batch_end = begin + 1;
+        while (batch_end < end && batch_end->recipient == begin->recipient && batch_end->kind == begin->kind) batch_end += 1;
+        interest__send_batch(players.ids[begin->recipient], begin, batch_end, bombs);
+        begin = batch_end;
+    }
+
+    interest_events.count = 0;
+}
+
+// World //////////////////////////////
+
+void process_world_simulation(Item *items, size_t items_len, Bombs *bombs, float delta_time) {
+    // Simulating the world for one server tick.
+    for (size_t slot = 0; slot < players.count; ++slot) {
+        Player player = {
+            .position  = players.positions[slot],
+            .direction = players.directions[slot],
+            .moving    = players.moving[slot],
+        };
+        update_player(&player, delta_time);
+        players.positions[slot]  = player.position;
+        players.directions[slot] = player.direction;
+        IVector2 from = players_grid.nodes[slot].cell;
+        spatial_grid_update(&players_grid, slot, player.position);
+        IVector2 to = players_grid.nodes[slot].cell;
+        if (from.x != to.x || from.y != to.y) interest_player_moved(slot, from, to);
+        collect_items_by_player(player, items, items_len);
+    }
+
+    update_bombs_on_server_side(delta_time, bombs);
+}
+
 // Pings //////////////////////////////
 
 void process_pings(void) {
@@ -465,8 +1002,7 @@ void process_pings(void) {
         PingEntry *entry = &ping_ids[i];
         uint32_t id = entry->key;
         uint32_t timestamp = entry->value;
-        ptrdiff_t place = hmgeti(players, id);
-        if (place >= 0) { // This MAY happen. A player may send a ping and leave.
+        if (players_slot(id) >= 0) { // This MAY happen. A player may send a ping and leave.
             PongMessage pong_message = {
                 .byte_length = sizeof(PongMessage),
                 .kind = MK_PONG,
@@ -482,37 +1018,228 @@ void schedule_ping_for_player(uint32_t id, PingMessage *message) {
 }
 
 void clear_intermediate_ids(void) {
-    hmfree(joined_ids);
-    hmfree(left_ids);
+    memset(players.joined, 0, players.count*sizeof(*players.joined));
+    players.joined_count = 0;
+    left_players.count = 0;
     hmfree(ping_ids);
 }
 
 // Connections //////////////////////////////
 
+// The id of a connection (which is also the id of its player) is a generational handle: the lower
+// CONNECTION_SLOT_BITS are the slot of the connection in the slab, the rest is the generation of the
+// slot, which changes every time the slot is freed. So an id of a connection that is gone never
+// resolves to the connection that took its slot afterwards.
+#define CONNECTION_SLOT_BITS 20
+#define CONNECTION_SLOT_MASK ((1u<<CONNECTION_SLOT_BITS) - 1)
+#define CONNECTIONS_CAPACITY (1u<<CONNECTION_SLOT_BITS)
+// The slab grows by chunks of that many connections and never moves or frees them
+#define CONNECTIONS_CHUNK_SIZE 256
+
 typedef struct {
-    uint32_t key;
-    Cws value;
+    Cws cws;
+    uint32_t id;
+    Ip_Address address;
+    bool alive;     // The slot is taken
+    bool flushing;  // connection_flusher() is waiting for the socket to accept the rest of cws.queue
+    bool dropped;   // The connection failed to keep up and is being shut down
+    bool dirty;     // In dirty_ids
+    size_t coroutine_id;        // The coroutine of client_connection(), 0 until it starts
+    uint64_t cpu_time_checked;  // Coroutine_Stats.cpu_time as of the last check_busiest_connection()
+    uint32_t next_free;         // The next free slot when the slot is not alive
 } Connection;
 
-Connection *connections = NULL;
-uint32_t idCounter = 0;
+// NOTE: The coroutines of the connections hold onto their Connection across the yields, so it must
+// never move. Which is why the slab is made of chunks instead of a single dynamic array.
+typedef struct {
+    Connection *chunks[CONNECTIONS_CAPACITY/CONNECTIONS_CHUNK_SIZE];
+    uint32_t count;         // Slots that were ever taken
+    uint32_t free;          // Slot + 1 of the first free slot. 0 if there are none
+} Connections;
 
-void connections_remove(uint32_t player_id)
+Connections connections = {0};
+
+typedef struct {
+    uint32_t key;     // Connection id
+    uint32_t value;   // now_msecs() by which the handshake must be completed
+} HandshakeEntry;
+
+// Connections that are still doing the handshake
+HandshakeEntry *handshakes = NULL;
+
+// Ids of the connections that got new messages queued within the current tick. They are flushed once
+// at the end of the tick, so all the messages of a tick go out with a single writev.
+Indices dirty_ids = {0};
+
+static Connection *connections__slot(uint32_t slot)
 {
-    int deleted = hmdel(connections, player_id);
-    UNUSED(deleted);
+    return &connections.chunks[slot/CONNECTIONS_CHUNK_SIZE][slot%CONNECTIONS_CHUNK_SIZE];
 }
 
-Cws *connections_get_ref(uint32_t player_id)
+// Takes a slot for the connection. Returns false if all CONNECTIONS_CAPACITY of them are taken.
+bool connections_add(Cws cws, Ip_Address address, uint32_t *id)
 {
-    ptrdiff_t i = hmgeti(connections, player_id);
-    if (i < 0) return NULL;
-    return &connections[i].value;
+    uint32_t slot;
+    if (connections.free > 0) {
+        slot = connections.free - 1;
+        connections.free = connections__slot(slot)->next_free;
+    } else {
+        if (connections.count >= CONNECTIONS_CAPACITY) return false;
+        slot = connections.count++;
+        Connection **chunk = &connections.chunks[slot/CONNECTIONS_CHUNK_SIZE];
+        if (*chunk == NULL) {
+            *chunk = calloc(CONNECTIONS_CHUNK_SIZE, sizeof(Connection));
+            assert(*chunk != NULL && "Buy more RAM lol");
+        }
+    }
+
+    Connection *connection = connections__slot(slot);
+    uint32_t generation = connection->id >> CONNECTION_SLOT_BITS;
+    *connection = (Connection) {
+        .cws = cws,
+        .id = (generation << CONNECTION_SLOT_BITS) | slot,
+        .address = address,
+        .alive = true,
+    };
+    *id = connection->id;
+    return true;
+}
+
+Connection *connections_get(uint32_t id)
+{
+    uint32_t slot = id & CONNECTION_SLOT_MASK;
+    if (slot >= connections.count) return NULL;
+    Connection *connection = connections__slot(slot);
+    if (!connection->alive || connection->id != id) return NULL;
+    return connection;
+}
+
+void connections_remove(uint32_t id)
+{
+    Connection *connection = connections_get(id);
+    if (connection == NULL) return;
+    admission_disconnect(connection->address);
+    uint32_t slot = id & CONNECTION_SLOT_MASK;
+    uint32_t generation = (id >> CONNECTION_SLOT_BITS) + 1;
+    connection->id = (generation << CONNECTION_SLOT_BITS) | slot;
+    connection->alive = false;
+    connection->next_free = connections.free;
+    connections.free = slot + 1;
+}
+
+// Shuts the socket down, so client_connection() fails on reading and cleans everything up
+void connection_drop(Connection *connection)
+{
+    if (connection->dropped) return;
+    connection->dropped = true;
+    stat_inc_counter(SE_PLAYERS_DROPPED, 1);
+    connection->cws.socket.shutdown(connection->cws.socket.data, CWS_SHUTDOWN_BOTH);
 }
 
-void connections_set(uint32_t player_id, Cws cws)
+// Shuts down the connections that did not complete the handshake in time, so their
+// client_connection() fails and cleans everything up
+void check_handshake_deadlines(uint32_t now)
 {
-    hmput(connections, player_id, cws);
+    // NOTE: iterating backwards, because hmdel() moves the last entry in place of the deleted one
+    for (ptrdiff_t i = hmlen(handshakes) - 1; i >= 0; --i) {
+        if ((int32_t)(now - handshakes[i].value) < 0) continue;
+        uint32_t id = handshakes[i].key;
+        int deleted = hmdel(handshakes, id);
+        UNUSED(deleted);
+        Connection *connection = connections_get(id);
+        if (connection == NULL) continue;
+        connection->cws.socket.shutdown(connection->cws.socket.data, CWS_SHUTDOWN_BOTH);
+    }
+}
+
+// Sends whatever is left in the queue of the connection whenever its socket becomes writable
+void connection_flusher(void *data)
+{
+    uint32_t id = (uint32_t)(uintptr_t)data;
+    while (true) {
+        Connection *connection = connections_get(id);
+        if (connection == NULL) return;
+        socket_sleep_write(connection->cws.socket);
+
+        // The connection may have been closed while we were sleeping
+        connection = connections_get(id);
+        if (connection == NULL) return;
+        int n = cws_flush(&connection->cws);
+        if (n < 0) connection_drop(connection);
+        if (n <= 0) {
+            connection->flushing = false;
+            return;
+        }
+    }
+}
+
+// Sends as much of the queue of the connection as possible without blocking. The rest is
+// left to connection_flusher(), so a slow player never stalls the tick.
+int connection_flush(uint32_t player_id, Connection *connection)
+{
+    int n = cws_flush(&connection->cws);
+    if (n > 0 && !connection->flushing) {
+        connection->flushing = true;
+        coroutine_go_with_stack(&connection_flusher, (void*)(uintptr_t)player_id, SERVER_COROUTINE_STACK_SIZE);
+    }
+    return n;
+}
+
+uint64_t busiest_checked_at = 0;
+
+// Reports the connection that spent the most time on the CPU since the previous check once a second,
+// or right away if `force`. Does nothing unless the coroutine runtime is built with COROUTINE_STATS.
+void check_busiest_connection(uint64_t now, bool force)
+{
+    if (!force && now - busiest_checked_at < 1000*1000*1000) return;
+    uint64_t elapsed = now - busiest_checked_at;
+    busiest_checked_at = now;
+    if (elapsed == 0) return;
+
+    uint32_t busiest_id = 0;
+    Connection *busiest = NULL;
+    uint64_t busiest_cpu_time = 0;
+    for (uint32_t slot = 0; slot < connections.count; ++slot) {
+        Connection *connection = connections__slot(slot);
+        if (!connection->alive || connection->coroutine_id == 0) continue;
+        uint64_t cpu_time = coroutine_stats(connection->coroutine_id).cpu_time;
+        uint64_t delta = cpu_time - connection->cpu_time_checked;
+        connection->cpu_time_checked = cpu_time;
+        if (delta > busiest_cpu_time) {
+            busiest_id = connection->id;
+            busiest = connection;
+            busiest_cpu_time = delta;
+        }
+    }
+    if (busiest == NULL) return;
+
+    float share = (float)busiest_cpu_time/(float)elapsed;
+    stat_push_sample(SE_BUSIEST_CONNECTION_CPU_SHARE, share);
+    if (share > SERVER_HOG_CPU_SHARE) {
+        Coroutine_Stats stats = coroutine_stats(busiest->coroutine_id);
+        fprintf(stderr, "WARNING: player %u took %.1f ms of CPU in the last %.1f s (%llu switches, %llu sleeps)\n",
+                busiest_id, busiest_cpu_time/1000.0/1000.0, elapsed/1000.0/1000.0/1000.0,
+                (unsigned long long)stats.switches, (unsigned long long)stats.sleeps);
+    }
+}
+
+// Publishes what the coroutine scheduler did since the previous call
+void push_scheduler_stats(void)
+{
+    static Coroutine_Scheduler_Stats previous = {0};
+    Coroutine_Scheduler_Stats current = coroutine_scheduler_stats();
+    uint64_t polls = current.polls - previous.polls;
+    uint64_t ready_fds = current.ready_fds - previous.ready_fds;
+    uint64_t switches = current.switches - previous.switches;
+    uint64_t wakes = current.wakes - previous.wakes;
+    uint64_t wake_latency = current.wake_latency - previous.wake_latency;
+    previous = current;
+
+    stat_push_sample(SE_SCHEDULER_POLLS, polls);
+    if (polls > 0) stat_push_sample(SE_SCHEDULER_READY_FDS, (float)ready_fds/(float)polls);
+    // The rest is only measured if the coroutine runtime is built with COROUTINE_STATS
+    if (switches > 0) stat_push_sample(SE_SCHEDULER_SWITCHES, switches);
+    if (wakes > 0) stat_push_sample(SE_WAKE_LATENCY, (float)wake_latency/(float)wakes/1000.0f/1000.0f/1000.0f);
 }
 
 // Connection //////////////////////////////
@@ -520,61 +1247,159 @@ void connections_set(uint32_t player_id, Cws cws)
 void client_connection(void *data)
 {
     uint32_t id = (uint32_t)(uintptr_t)data;
-    Cws* cws = connections_get_ref(id);
+    Connection *connection = connections_get(id);
 
-    if (cws == NULL) {
+    if (connection == NULL) {
         fprintf(stderr, "ERROR: unknown player id %u\n", id);
         exit(69);
     }
+    connection->coroutine_id = coroutine_id();
+    Cws *cws = &connection->cws;
+
+    uint32_t handshake_started_at = now_msecs();
+    int err = cws_server_handshake(cws);
+    // check_handshake_deadlines() removes the connection from handshakes when it times out
+    bool timed_out = hmgeti(handshakes, id) < 0;
+    int deleted = hmdel(handshakes, id);
+    UNUSED(deleted);
+    if (timed_out || err < 0) {
+        if (timed_out) {
+            stat_inc_counter(SE_HANDSHAKES_TIMED_OUT, 1);
+        } else {
+            stat_inc_counter(SE_HANDSHAKES_FAILED, 1);
+            fprintf(stderr, "ERROR: server_handshake: %s\n", cws_error_message(cws, (Cws_Error)err));
+        }
+        // NOTE: the client is not a WebSocket peer (yet), so there is no point in waiting for it
+        // to acknowledge the close
+        cws->socket.shutdown(cws->socket.data, CWS_SHUTDOWN_BOTH);
+        cws_close(cws);
+        connections_remove(id);
+        return;
+    }
+    stat_push_sample(SE_HANDSHAKE_TIMES, (now_msecs() - handshake_started_at)/1000.0f);
+
+    if (!register_new_player(id)) {
+        cws_close(cws);
+        connections_remove(id);
+        return;
+    }
 
     while (true) {
         Cws_Message cws_message;
-        int err = cws_read_message(cws, &cws_message);
+        // Reserving the headroom for Message.byte_length, so the Message is constructed in place
+        err = cws_read_message_view(cws, &cws_message, sizeof(Message));
         if (err < 0) {
             if ((Cws_Error)err != CWS_ERROR_FRAME_CLOSE_SENT) {
                 fprintf(stderr, "ERROR: could not read message from player %u\n", id);
             }
             goto defer;
         }
-        size_t byte_length = sizeof(Message) + cws_message.payload_len;
-        Message *message = allocate_temporary_buffer(byte_length);
-        message->byte_length = byte_length;
-        memcpy(message->bytes, cws_message.payload, cws_message.payload_len);
-        if (!process_message_on_server(id, message)) return;
+        if (!admission_message(connection->address, now_msecs())) {
+            stat_inc_counter(SE_PLAYERS_RATE_LIMITED, 1);
+            fprintf(stderr, "ERROR: player %u exceeded the message rate of their IP\n", id);
+            goto defer;
+        }
+        Message *message = (Message*)(cws_message.payload - sizeof(Message));
+        message->byte_length = sizeof(Message) + cws_message.payload_len;
+        if (!process_message_on_server(id, message)) goto defer;
         arena_reset(&cws->arena);
     }
 
 defer:
     unregister_player(id);
-    connections_remove(id);
-    if (cws) {
-        cws_close(cws);
-        arena_free(&cws->arena);
+
+    // A connection that hogs the CPU is often gone before the next check, so it is reported right away
+    uint64_t now = coroutine_now();
+    uint64_t cpu_time = coroutine_stats(coroutine_id()).cpu_time - connection->cpu_time_checked;
+    if ((double)cpu_time > SERVER_HOG_CPU_SHARE*(double)(now - busiest_checked_at)) {
+        check_busiest_connection(now, true);
     }
+
+    cws_close(cws);
+    connections_remove(id);
+
+    // Only measured if the coroutine runtime is built with COROUTINE_STACK_DEBUG
+    size_t stack_used = coroutine_stack_high_water(coroutine_id());
+    if (stack_used > 0) stat_push_sample(SE_CONNECTION_STACK_USAGE, stack_used);
 }
 
 // Messages //////////////////////////////
 
 uint32_t send_message(uint32_t player_id, void *message_raw)
 {
-    Cws* cws = connections_get_ref(player_id);
-    if (cws == NULL) {
-        fprintf(stderr, "ERROR: unknown player id %d\n", player_id);
-        exit(69);
+    Cws_Shared_Message *shared_message = shared_message_new(message_raw);
+    uint32_t sent = send_shared_message(player_id, shared_message);
+    cws_shared_message_release(shared_message);
+    return sent;
+}
+
+void send_message_and_update_stats(uint32_t player_id, void* message)
+{
+    uint32_t sent = send_message(player_id, message);
+    if (sent > 0) {
+        bytes_sent_within_tick += sent;
+        message_sent_within_tick += 1;
     }
+}
+
+// Frames the message once, so it can be sent to many players without framing it for each of them.
+// Returns NULL if message_raw is NULL.
+Cws_Shared_Message *shared_message_new(void *message_raw)
+{
+    if (message_raw == NULL) return NULL;
     Message* message = message_raw;
-    int err = cws_send_message(cws, CWS_MESSAGE_BIN, message->bytes, message->byte_length - sizeof(message->byte_length));
+    return cws_shared_message_new(CWS_MESSAGE_BIN, message->bytes, message->byte_length - sizeof(message->byte_length), SERVER_MAX_FRAME_SIZE);
+}
+
+// Queues the message for the player. The actual sending happens in flush_dirty_connections() at
+// the end of the tick. Returns 0 if the message was not queued, in which case the player is being
+// disconnected.
+uint32_t send_shared_message(uint32_t player_id, Cws_Shared_Message *shared_message)
+{
+    Connection *connection = connections_get(player_id);
+    if (connection == NULL) {
+        fprintf(stderr, "ERROR: unknown player id %u\n", player_id);
+        return 0;
+    }
+    if (connection->dropped) return 0;
+
+    Cws *cws = &connection->cws;
+    size_t dropped = cws->queue.dropped;
+    // NOTE: Untagged, so it is never dropped to make room (see SERVER_SEND_QUEUE_POLICY)
+    int err = cws_queue_shared_message(cws, shared_message, 0);
+    stat_inc_counter(SE_MESSAGES_DROPPED, cws->queue.dropped - dropped);
     if (err < 0) {
-        // TODO: do not crash on failing to send a message
-        fprintf(stderr, "ERROR: Could not send message to player %d: %s\n", player_id, cws_error_message(cws, (Cws_Error)err));
-        exit(69);
+        fprintf(stderr, "ERROR: Could not send message to player %u: %s\n", player_id, cws_error_message(cws, (Cws_Error)err));
+        connection_drop(connection);
+        return 0;
     }
-    return message->byte_length;
+    if (!connection->dirty) {
+        connection->dirty = true;
+        da_append(&dirty_ids, player_id);
+    }
+    return sizeof(Message) + shared_message->payload_len;
 }
 
-void send_message_and_update_stats(uint32_t player_id, void* message)
+void flush_dirty_connections(void)
 {
-    uint32_t sent = send_message(player_id, message);
+    for (size_t i = 0; i < dirty_ids.count; ++i) {
+        uint32_t id = dirty_ids.items[i];
+        Connection *connection = connections_get(id);
+        if (connection == NULL) continue;
+        connection->dirty = false;
+        if (connection->dropped) continue;
+        int err = connection_flush(id, connection);
+        if (err < 0) {
+            fprintf(stderr, "ERROR: Could not send messages to player %u: %s\n", id, cws_error_message(&connection->cws, (Cws_Error)err));
+            connection_drop(connection);
+        }
+    }
+    dirty_ids.count = 0;
+}
+
+void send_shared_message_and_update_stats(uint32_t player_id, Cws_Shared_Message *shared_message)
+{
+    uint32_t sent = send_shared_message(player_id, shared_message);
     if (sent > 0) {
         bytes_sent_within_tick += sent;
         message_sent_within_tick += 1;
@@ -620,9 +1445,11 @@ uint32_t tick() {
     process_joined_players(items_ptr(), items_len());
     process_left_players();
     process_moving_players();
-    process_thrown_bombs(&bombs);
+    process_thrown_bombs();
     process_world_simulation(items_ptr(), items_len(), &bombs, delta_time);
+    process_interest_events(&bombs);
     process_pings();
+    flush_dirty_connections();
 
     uint32_t tickTime = now_msecs() - timestamp;
     stat_inc_counter(SE_TICKS_COUNT, 1);
@@ -650,6 +1477,10 @@ uint32_t tick() {
 
 // Cws_Socket //////////////////////////////
 
+// NOTE: on EWOULDBLOCK the coroutine goes to sleep until the fd is ready instead of yielding. An idle
+// connection costs nothing that way, while a yielding one would be rescheduled and re-recv'd on every
+// round of the scheduler.
+
 int cws_socket_read(void *data, void *buffer, size_t len)
 {
     while (true) {
@@ -657,7 +1488,7 @@ int cws_socket_read(void *data, void *buffer, size_t len)
         if (n > 0) return (int)n;
         if (n < 0 && errno != EWOULDBLOCK) return (int)CWS_ERROR_ERRNO;
         if (n == 0) return (int)CWS_ERROR_CONNECTION_CLOSED;
-        coroutine_yield();
+        coroutine_sleep_read((int)(uintptr_t)data);
     }
 }
 
@@ -670,7 +1501,7 @@ int cws_socket_peek(void *data, void *buffer, size_t len)
         if (n > 0) return (int)n;
         if (n < 0 && errno != EWOULDBLOCK) return (int)CWS_ERROR_ERRNO;
         if (n == 0) return (int)CWS_ERROR_CONNECTION_CLOSED;
-        coroutine_yield();
+        coroutine_sleep_read((int)(uintptr_t)data);
     }
 }
 
@@ -681,10 +1512,48 @@ int cws_socket_write(void *data, const void *buffer, size_t len)
         if (n > 0) return (int)n;
         if (n < 0 && errno != EWOULDBLOCK) return (int)CWS_ERROR_ERRNO;
         if (n == 0) return (int)CWS_ERROR_CONNECTION_CLOSED;
-        coroutine_yield();
+        coroutine_sleep_write((int)(uintptr_t)data);
+    }
+}
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024 // The Linux value. limits.h exposes it only with _XOPEN_SOURCE
+#endif // IOV_MAX
+
+static_assert(sizeof(Cws_Iovec) == sizeof(struct iovec), "Cws_Iovec must be layout compatible with struct iovec");
+static_assert(offsetof(Cws_Iovec, data) == offsetof(struct iovec, iov_base), "Cws_Iovec must be layout compatible with struct iovec");
+static_assert(offsetof(Cws_Iovec, len) == offsetof(struct iovec, iov_len), "Cws_Iovec must be layout compatible with struct iovec");
+
+int cws_socket_writev(void *data, const Cws_Iovec *iov, size_t iovcnt)
+{
+    if (iovcnt > IOV_MAX) iovcnt = IOV_MAX;
+    struct msghdr msg = {
+        .msg_iov = (struct iovec*)iov,
+        .msg_iovlen = iovcnt,
+    };
+    while (true) {
+        int n = sendmsg((int)(uintptr_t)data, &msg, MSG_NOSIGNAL);
+        if (n > 0) return (int)n;
+        if (n < 0 && errno != EWOULDBLOCK) return (int)CWS_ERROR_ERRNO;
+        if (n == 0) return (int)CWS_ERROR_CONNECTION_CLOSED;
+        coroutine_sleep_write((int)(uintptr_t)data);
     }
 }
 
+int cws_socket_try_writev(void *data, const Cws_Iovec *iov, size_t iovcnt)
+{
+    if (iovcnt > IOV_MAX) iovcnt = IOV_MAX;
+    struct msghdr msg = {
+        .msg_iov = (struct iovec*)iov,
+        .msg_iovlen = iovcnt,
+    };
+    int n = sendmsg((int)(uintptr_t)data, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+    if (n > 0) return (int)n;
+    if (n < 0 && errno == EWOULDBLOCK) return (int)CWS_ERROR_WOULD_BLOCK;
+    if (n < 0) return (int)CWS_ERROR_ERRNO;
+    return (int)CWS_ERROR_CONNECTION_CLOSED;
+}
+
 int cws_socket_shutdown(void *data, Cws_Shutdown_How how)
 {
     if (shutdown((int)(uintptr_t)data, (int)how) < 0) return (int)CWS_ERROR_ERRNO;
@@ -693,6 +1562,7 @@ int cws_socket_shutdown(void *data, Cws_Shutdown_How how)
 
 int cws_socket_close(void *data)
 {
+    coroutine_forget_fd((int)(uintptr_t)data);
     if (close((int)(uintptr_t)data) < 0) return (int)CWS_ERROR_ERRNO;
     return 0;
 }
@@ -704,11 +1574,38 @@ Cws_Socket cws_socket_from_fd(int fd)
         .read     = cws_socket_read,
         .peek     = cws_socket_peek,
         .write    = cws_socket_write,
+        .writev   = cws_socket_writev,
+        .try_writev = cws_socket_try_writev,
         .shutdown = cws_socket_shutdown,
         .close    = cws_socket_close,
     };
 }
 
+#ifdef SERVER_IO_URING
+// The server falls back to the plain sockets if io_uring is not available at runtime
+bool use_io_uring = false;
+#endif // SERVER_IO_URING
+
+Cws_Socket socket_from_fd(int fd)
+{
+#ifdef SERVER_IO_URING
+    if (use_io_uring) return uring_socket_from_fd(fd);
+#endif // SERVER_IO_URING
+    return cws_socket_from_fd(fd);
+}
+
+// Puts the current coroutine to sleep until the socket can accept more data to send
+void socket_sleep_write(Cws_Socket socket)
+{
+#ifdef SERVER_IO_URING
+    if (use_io_uring) {
+        uring_socket_sleep_write(socket);
+        return;
+    }
+#endif // SERVER_IO_URING
+    coroutine_sleep_write((int)(uintptr_t)socket.data);
+}
+
 // main //////////////////////////////
 
 void* allocate_temporary_buffer(size_t size) {
@@ -723,10 +1620,102 @@ int set_non_blocking(int sockfd)
     return 0;
 }
 
+// Lifts the soft limit of open files to the hard one, so a reconnect storm does not run the server
+// out of file descriptors long before SERVER_TOTAL_LIMIT
+void raise_open_files_limit(void)
+{
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) < 0) return;
+    if (limit.rlim_cur == limit.rlim_max) return;
+    limit.rlim_cur = limit.rlim_max;
+    if (setrlimit(RLIMIT_NOFILE, &limit) < 0) {
+        fprintf(stderr, "WARNING: could not raise the limit of open files: %s\n", strerror(errno));
+    }
+}
+
+// Accepts up to SERVER_ACCEPT_BUDGET pending connections. Returns false on unrecoverable errors.
+bool accept_connections(int server_fd)
+{
+    for (int i = 0; i < SERVER_ACCEPT_BUDGET; ++i) {
+        struct sockaddr_storage client_addr;
+        socklen_t client_addr_len = sizeof(client_addr);
+        int client_fd = accept4(server_fd, (void*)&client_addr, &client_addr_len, SOCK_NONBLOCK);
+        if (client_fd < 0) {
+            switch (errno) {
+                case EAGAIN:
+                    return true;
+                case EINTR:
+                case ECONNABORTED:
+                    continue;
+                case EMFILE:
+                case ENFILE:
+                case ENOBUFS:
+                case ENOMEM:
+                    // Not a reason to bring the server down. The connections keep waiting in the
+                    // backlog until some resources are freed.
+                    fprintf(stderr, "ERROR: could not accept connection from client: %s\n", strerror(errno));
+                    return true;
+                default:
+                    fprintf(stderr, "ERROR: could not accept connection from client: %s\n", strerror(errno));
+                    return false;
+            }
+        }
+
+        Ip_Address address = ip_address_from_sockaddr(&client_addr);
+        if (!admission_connect(address, now_msecs())) {
+            stat_inc_counter(SE_CONNECTIONS_SHED, 1);
+            close(client_fd);
+            continue;
+        }
+
+        // The messages are already batched per tick by flush_dirty_connections(), so there is
+        // nothing for Nagle's algorithm to wait for
+        int yes = 1;
+        if (setsockopt(client_fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes)) < 0) {
+            fprintf(stderr, "ERROR: could not disable Nagle's algorithm on client socket: %s\n", strerror(errno));
+        }
+
+        Cws cws = {
+            .socket = socket_from_fd(client_fd),
+            .max_frame_size = SERVER_MAX_FRAME_SIZE,
+            .max_message_size = SERVER_MAX_MESSAGE_SIZE,
+            .queue = {
+                .limit = SERVER_SEND_QUEUE_LIMIT,
+                .policy = SERVER_SEND_QUEUE_POLICY,
+            },
+        };
+
+        // NOTE: the handshake is done by client_connection(), so a slow or malicious client
+        // never stalls the game loop
+        uint32_t id;
+        if (!connections_add(cws, address, &id)) {
+            fprintf(stderr, "ERROR: could not accept connection from client: too many connections\n");
+            admission_disconnect(address);
+            close(client_fd);
+            continue;
+        }
+        hmput(handshakes, id, now_msecs() + SERVER_HANDSHAKE_TIMEOUT_MSECS);
+        coroutine_go_with_stack(&client_connection, (void*)(uintptr_t)id, SERVER_COROUTINE_STACK_SIZE);
+    }
+    return true;
+}
+
 int main() {
     const char *HOST = "0.0.0.0";
 
     coroutine_init();
+    items_grids_init(items_ptr(), items_len());
+    if (getrandom(&admissions.seed, sizeof(admissions.seed), 0) != sizeof(admissions.seed)) {
+        fprintf(stderr, "WARNING: could not seed the hash of the IP addresses: %s\n", strerror(errno));
+    }
+#ifdef SERVER_IO_URING
+    use_io_uring = uring_init();
+    if (use_io_uring) {
+        coroutine_go_with_stack(&uring_poller, NULL, SERVER_COROUTINE_STACK_SIZE);
+    } else {
+        fprintf(stderr, "WARNING: io_uring is not available. Falling back to plain sockets.\n");
+    }
+#endif // SERVER_IO_URING
 
     stat_start_timer_at(SE_UPTIME, now_msecs());
     previous_timestamp = now_msecs();
@@ -752,7 +1741,9 @@ int main() {
         return 1;
     }
 
-    if (listen(server_fd, 69) < 0) {
+    raise_open_files_limit();
+
+    if (listen(server_fd, SERVER_LISTEN_BACKLOG) < 0) {
         fprintf(stderr, "ERROR: could not listen to server socket: %s\n", strerror(errno));
         return 1;
     }
@@ -763,48 +1754,36 @@ int main() {
     }
 
     printf("Listening to ws://%s:%d/\n", HOST, SERVER_PORT);
+    uint64_t frame_started_at = coroutine_now();
+    uint64_t tick_due_at = frame_started_at;
+    uint64_t idle_time = coroutine_idle_time();
     while (true) {
-        struct sockaddr_in client_addr = {0};
-        socklen_t client_addr_len = sizeof(client_addr);
-        int client_fd = accept(server_fd, (void*)&client_addr, &client_addr_len);
-        if (client_fd >= 0) {
-            if (set_non_blocking(client_fd) < 0) {
-                fprintf(stderr, "ERROR: could not set client socket non-blocking: %s\n", strerror(errno));
-                return 1;
-            }
-
-            Cws cws = {
-                .socket = cws_socket_from_fd(client_fd),
-            };
-
-            int err = cws_server_handshake(&cws);
-            if (err < 0) {
-                // TODO: do not die on error in here
-                fprintf(stderr, "ERROR: server_handshake: %s\n", cws_error_message(&cws, (Cws_Error)err));
-                return 1;
-            }
-
-            uint32_t id = idCounter++;
-            // TODO: pass the remote address to server::register_new_player() to enable connection limits
-            if (!register_new_player(id, NULL)) {
-                cws_close(&cws);
-                arena_free(&cws.arena);
-                continue;
-            }
-
-            connections_set(id, cws);
-            coroutine_go(&client_connection, (void*)(uintptr_t)id);
-        } else if (errno != EAGAIN) {
-            fprintf(stderr, "ERROR: could not accept connection from client: %s\n", strerror(errno));
-            return 1;
-        }
-
-        uint32_t tick_time = tick();
-        int delay = (1000 - (int)tick_time*SERVER_FPS)/SERVER_FPS;
-        if (delay < 0) delay = 0;
-        struct timespec ts_req = { .tv_nsec = delay*1000*1000 };
-        nanosleep(&ts_req, NULL);
-
-        coroutine_yield();
+        if (!accept_connections(server_fd)) return 1;
+
+        check_handshake_deadlines(now_msecs());
+        admissions_sweep(now_msecs());
+
+        tick();
+#ifdef SERVER_IO_URING
+        // Sending out everything the tick has produced
+        if (use_io_uring) uring_poll();
+#endif // SERVER_IO_URING
+
+        // NOTE: the connections keep being served while the main coroutine sleeps, so the messages
+        // are read as soon as they arrive instead of piling up in the kernel until the next tick
+        tick_due_at += 1000*1000*1000/SERVER_FPS;
+        uint64_t scheduler_started_at = coroutine_now();
+        // If the tick took too long, the next one starts right away, but the lost time is not caught up
+        if (tick_due_at < scheduler_started_at) tick_due_at = scheduler_started_at;
+        coroutine_sleep_until(tick_due_at);
+        uint64_t frame_ended_at = coroutine_now();
+
+        uint64_t idle = coroutine_idle_time() - idle_time;
+        idle_time += idle;
+        stat_push_sample(SE_SCHEDULER_TIMES, (frame_ended_at - scheduler_started_at - idle)/1000.0f/1000.0f/1000.0f);
+        stat_push_sample(SE_IDLE_SHARE, (float)idle/(float)(frame_ended_at - frame_started_at));
+        push_scheduler_stats();
+        check_busiest_connection(frame_ended_at, false);
+        frame_started_at = frame_ended_at;
     }
 }
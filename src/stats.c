@@ -63,7 +63,7 @@ typedef struct {
     };
 } Stat;
 
-static_assert(NUMBER_OF_STAT_ENTRIES == 16, "Number of Stat Enties has changed");
+static_assert(NUMBER_OF_STAT_ENTRIES == 31, "Number of Stat Enties has changed");
 static Stat stats[NUMBER_OF_STAT_ENTRIES] = {
     [SE_UPTIME] = {
         .kind = SK_TIMER,
@@ -129,6 +129,66 @@ static Stat stats[NUMBER_OF_STAT_ENTRIES] = {
         .kind = SK_COUNTER,
         .description = "Total players rejected"
     },
+    [SE_MESSAGES_DROPPED] = {
+        .kind = SK_COUNTER,
+        .description = "Total state updates dropped for slow players"
+    },
+    [SE_PLAYERS_DROPPED] = {
+        .kind = SK_COUNTER,
+        .description = "Total slow players disconnected"
+    },
+    [SE_HANDSHAKE_TIMES] = {
+        .kind = SK_AVERAGE,
+        .description = "Average time to complete a handshake"
+    },
+    [SE_HANDSHAKES_FAILED] = {
+        .kind = SK_COUNTER,
+        .description = "Total handshakes failed"
+    },
+    [SE_HANDSHAKES_TIMED_OUT] = {
+        .kind = SK_COUNTER,
+        .description = "Total handshakes timed out"
+    },
+    [SE_SCHEDULER_TIMES] = {
+        .kind = SK_AVERAGE,
+        .description = "Average time to run the connections per tick"
+    },
+    [SE_IDLE_SHARE] = {
+        .kind = SK_AVERAGE,
+        .description = "Average share of the time the server is idle"
+    },
+    [SE_CONNECTION_STACK_USAGE] = {
+        .kind = SK_AVERAGE,
+        .description = "Average stack bytes used by a connection (--stack-debug)"
+    },
+    [SE_SCHEDULER_POLLS] = {
+        .kind = SK_AVERAGE,
+        .description = "Average poll()/epoll_wait() calls per tick"
+    },
+    [SE_SCHEDULER_READY_FDS] = {
+        .kind = SK_AVERAGE,
+        .description = "Average ready fds per poll()/epoll_wait() call"
+    },
+    [SE_SCHEDULER_SWITCHES] = {
+        .kind = SK_AVERAGE,
+        .description = "Average context switches per tick (--coroutine-stats)"
+    },
+    [SE_WAKE_LATENCY] = {
+        .kind = SK_AVERAGE,
+        .description = "Average time from a coroutine wake up to running it (--coroutine-stats)"
+    },
+    [SE_BUSIEST_CONNECTION_CPU_SHARE] = {
+        .kind = SK_AVERAGE,
+        .description = "Average share of the CPU time taken by the busiest connection (--coroutine-stats)"
+    },
+    [SE_CONNECTIONS_SHED] = {
+        .kind = SK_COUNTER,
+        .description = "Total connections shed by the per-IP limits"
+    },
+    [SE_PLAYERS_RATE_LIMITED] = {
+        .kind = SK_COUNTER,
+        .description = "Total players disconnected for exceeding the message rate of their IP"
+    },
 };
 
 static float stat_samples_average(Stat_Samples self)
@@ -21,6 +21,21 @@ typedef enum {
     SE_PLAYERS_LEFT,
     SE_BOGUS_AMOGUS_MESSAGES,
     SE_PLAYERS_REJECTED,
+    SE_MESSAGES_DROPPED,
+    SE_PLAYERS_DROPPED,
+    SE_HANDSHAKE_TIMES,
+    SE_HANDSHAKES_FAILED,
+    SE_HANDSHAKES_TIMED_OUT,
+    SE_SCHEDULER_TIMES,
+    SE_IDLE_SHARE,
+    SE_CONNECTION_STACK_USAGE,
+    SE_SCHEDULER_POLLS,
+    SE_SCHEDULER_READY_FDS,
+    SE_SCHEDULER_SWITCHES,
+    SE_WAKE_LATENCY,
+    SE_BUSIEST_CONNECTION_CPU_SHARE,
+    SE_CONNECTIONS_SHED,
+    SE_PLAYERS_RATE_LIMITED,
     NUMBER_OF_STAT_ENTRIES,
 } Stat_Entry;
 
@@ -0,0 +1,508 @@
+#include <assert.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "uring.h"
+#include "coroutine.h"
+#define NOB_STRIP_PREFIX
+#include "nob.h"
+
+// Size of the submission queue. The completion queue is twice as big.
+#define URING_ENTRIES 4096
+// The buffers the kernel picks from for the multishot recvs. They are copied out and given back as
+// soon as the completion is processed, so they only need to cover a single uring_poll().
+#define URING_RECV_BUFFERS 1024 // Must be a power of two
+#define URING_RECV_BUFFER_SIZE 2048
+#define URING_RECV_GROUP 0
+// How many bytes may wait to be sent per connection before writing reports CWS_ERROR_WOULD_BLOCK.
+// Plays the role of the send buffer of the socket, so the slow players still hit their send queue
+// limits (see Cws_Send_Queue).
+#define URING_SEND_LIMIT (64*1024)
+
+// Kept in the lower bits of user_data. The upper ones are the Uring_Conn pointer.
+typedef enum {
+    UO_RECV = 0,
+    UO_SEND,
+} Uring_Op;
+#define URING_OP_MASK 0x7
+
+typedef struct {
+    unsigned char *items;
+    size_t count;
+    size_t capacity;
+    size_t pos; // Read position of received. How much of sending is sent.
+} Uring_Bytes;
+
+typedef struct {
+    int fd;
+    Uring_Bytes received;    // Completed recvs not read yet
+    Uring_Bytes staged;      // Written, but not submitted yet
+    Uring_Bytes sending;     // Submitted. Is not touched until its send completes.
+    bool recv_inflight;      // The multishot recv is armed
+    bool send_inflight;
+    bool eof;
+    int error;               // errno of the failed request, 0 if none
+    bool dirty;              // Has something to submit (see Uring.dirty)
+    bool shutdown_write;     // shutdown(SHUT_WR) is postponed until everything is sent
+    bool closed;             // close() was called. Freed as soon as nothing is in flight.
+    size_t reader;           // id+1 of the coroutine sleeping in read() or peek(), 0 if none
+    size_t writer;           // id+1 of the coroutine sleeping in uring_socket_sleep_write(), 0 if none
+} Uring_Conn;
+
+typedef struct {
+    Uring_Conn **items;
+    size_t count;
+    size_t capacity;
+} Uring_Conns;
+
+typedef struct {
+    int fd;
+
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_flags;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    struct io_uring_sqe *sqes;
+    unsigned sq_local_tail;  // Includes the SQEs that are not published to the kernel yet
+
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+
+    struct io_uring_buf_ring *buf_ring;
+    unsigned char *buf_memory;
+    uint16_t buf_tail;
+
+    // The connections that have something to submit on the next uring_poll()
+    Uring_Conns dirty;
+} Uring;
+
+static Uring uring = { .fd = -1 };
+
+static void uring__conn_mark_dirty(Uring_Conn *conn)
+{
+    if (conn->dirty) return;
+    conn->dirty = true;
+    da_append(&uring.dirty, conn);
+}
+
+static void uring__conn_wake_up(Uring_Conn *conn)
+{
+    if (conn->reader) {
+        coroutine_wake_up(conn->reader - 1);
+        conn->reader = 0;
+    }
+    if (conn->writer) {
+        coroutine_wake_up(conn->writer - 1);
+        conn->writer = 0;
+    }
+}
+
+static bool uring__conn_inflight(Uring_Conn *conn)
+{
+    return conn->recv_inflight || conn->send_inflight;
+}
+
+static size_t uring__conn_unsent(Uring_Conn *conn)
+{
+    return conn->staged.count + conn->sending.count - conn->sending.pos;
+}
+
+// NOTE: Whoever sleeps on the connection must be woken up before it is freed, or nothing ever will
+static void uring__conn_free(Uring_Conn *conn)
+{
+    close(conn->fd);
+    free(conn->received.items);
+    free(conn->staged.items);
+    free(conn->sending.items);
+    free(conn);
+}
+
+// Publishes the local SQEs to the kernel and submits them
+static void uring__submit(void)
+{
+    __atomic_store_n(uring.sq_tail, uring.sq_local_tail, __ATOMIC_RELEASE);
+    __atomic_store_n(&uring.buf_ring->tail, uring.buf_tail, __ATOMIC_RELEASE);
+    unsigned to_submit = uring.sq_local_tail - __atomic_load_n(uring.sq_head, __ATOMIC_ACQUIRE);
+    while (true) {
+        int ret = syscall(__NR_io_uring_enter, uring.fd, to_submit, 0, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (ret >= 0) break;
+        if (errno == EINTR) continue;
+        // EBUSY/EAGAIN mean the completion queue is full. What was not submitted stays in the
+        // submission queue until the next time.
+        if (errno == EBUSY || errno == EAGAIN) break;
+        fprintf(stderr, "ERROR: io_uring_enter: %s\n", strerror(errno));
+        abort();
+    }
+}
+
+static struct io_uring_sqe *uring__get_sqe(void)
+{
+    if (uring.sq_local_tail - __atomic_load_n(uring.sq_head, __ATOMIC_ACQUIRE) >= uring.sq_entries) {
+        // The submission queue is full. Handing it over to the kernel to make room.
+        uring__submit();
+        assert(uring.sq_local_tail - __atomic_load_n(uring.sq_head, __ATOMIC_ACQUIRE) < uring.sq_entries);
+    }
+    struct io_uring_sqe *sqe = &uring.sqes[uring.sq_local_tail & uring.sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    uring.sq_local_tail += 1;
+    return sqe;
+}
+
+static void uring__give_buffer(uint16_t bid)
+{
+    struct io_uring_buf *buf = &uring.buf_ring->bufs[uring.buf_tail & (URING_RECV_BUFFERS - 1)];
+    buf->addr = (uint64_t)(uintptr_t)(uring.buf_memory + (size_t)bid*URING_RECV_BUFFER_SIZE);
+    buf->len = URING_RECV_BUFFER_SIZE;
+    buf->bid = bid;
+    uring.buf_tail += 1;
+}
+
+static void uring__conn_prepare(Uring_Conn *conn)
+{
+    conn->dirty = false;
+    if (conn->closed) {
+        if (!uring__conn_inflight(conn)) {
+            uring__conn_wake_up(conn);
+            uring__conn_free(conn);
+        }
+        return;
+    }
+
+    if (!conn->recv_inflight && !conn->eof && conn->error == 0) {
+        struct io_uring_sqe *sqe = uring__get_sqe();
+        sqe->opcode = IORING_OP_RECV;
+        sqe->fd = conn->fd;
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = URING_RECV_GROUP;
+        sqe->user_data = (uint64_t)(uintptr_t)conn | UO_RECV;
+        conn->recv_inflight = true;
+    }
+
+    if (!conn->send_inflight && conn->error == 0) {
+        if (conn->sending.pos == conn->sending.count && conn->staged.count > 0) {
+            // Swapping the buffers, so the writes may keep going while this one is being sent
+            Uring_Bytes sent = conn->sending;
+            conn->sending = conn->staged;
+            conn->staged = sent;
+            conn->staged.count = 0;
+            conn->staged.pos = 0;
+            conn->sending.pos = 0;
+        }
+        if (conn->sending.pos < conn->sending.count) {
+            struct io_uring_sqe *sqe = uring__get_sqe();
+            sqe->opcode = IORING_OP_SEND;
+            sqe->fd = conn->fd;
+            sqe->addr = (uint64_t)(uintptr_t)(conn->sending.items + conn->sending.pos);
+            sqe->len = conn->sending.count - conn->sending.pos;
+            sqe->msg_flags = MSG_NOSIGNAL;
+            sqe->user_data = (uint64_t)(uintptr_t)conn | UO_SEND;
+            conn->send_inflight = true;
+        }
+    }
+
+    if (conn->shutdown_write && uring__conn_unsent(conn) == 0) {
+        shutdown(conn->fd, SHUT_WR);
+        conn->shutdown_write = false;
+    }
+}
+
+static void uring__process_recv(Uring_Conn *conn, struct io_uring_cqe *cqe)
+{
+    if (cqe->flags & IORING_CQE_F_BUFFER) {
+        uint16_t bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        if (cqe->res > 0 && !conn->closed) {
+            da_append_many(&conn->received, uring.buf_memory + (size_t)bid*URING_RECV_BUFFER_SIZE, (size_t)cqe->res);
+        }
+        uring__give_buffer(bid);
+    }
+
+    if (cqe->res == 0) {
+        conn->eof = true;
+    } else if (cqe->res < 0 && cqe->res != -ENOBUFS) {
+        // NOTE: -ENOBUFS only means that we ran out of the buffers. The recv is armed again below.
+        conn->error = -cqe->res;
+    }
+
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        conn->recv_inflight = false;
+        if (!conn->eof && conn->error == 0) uring__conn_mark_dirty(conn);
+    }
+}
+
+static void uring__process_send(Uring_Conn *conn, struct io_uring_cqe *cqe)
+{
+    conn->send_inflight = false;
+    if (cqe->res < 0) {
+        conn->error = -cqe->res;
+    } else {
+        conn->sending.pos += (size_t)cqe->res;
+        if (conn->sending.pos == conn->sending.count) {
+            conn->sending.count = 0;
+            conn->sending.pos = 0;
+        }
+    }
+    if (uring__conn_unsent(conn) > 0 || conn->shutdown_write) uring__conn_mark_dirty(conn);
+}
+
+static void uring__process_completions(void)
+{
+    unsigned head = *uring.cq_head;
+    unsigned tail = __atomic_load_n(uring.cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; ++head) {
+        struct io_uring_cqe *cqe = &uring.cqes[head & uring.cq_mask];
+        Uring_Conn *conn = (Uring_Conn*)(uintptr_t)(cqe->user_data & ~(uint64_t)URING_OP_MASK);
+        switch ((Uring_Op)(cqe->user_data & URING_OP_MASK)) {
+            case UO_RECV: uring__process_recv(conn, cqe); break;
+            case UO_SEND: uring__process_send(conn, cqe); break;
+            default: assert(0 && "unreachable");
+        }
+        uring__conn_wake_up(conn);
+        if (conn->closed && !uring__conn_inflight(conn) && !conn->dirty) uring__conn_free(conn);
+    }
+    __atomic_store_n(uring.cq_head, head, __ATOMIC_RELEASE);
+}
+
+void uring_poll(void)
+{
+    for (size_t i = 0; i < uring.dirty.count; ++i) {
+        uring__conn_prepare(uring.dirty.items[i]);
+    }
+    uring.dirty.count = 0;
+
+    do {
+        uring__submit();
+        uring__process_completions();
+    } while (__atomic_load_n(uring.sq_flags, __ATOMIC_ACQUIRE) & IORING_SQ_CQ_OVERFLOW);
+}
+
+void uring_poller(void *data)
+{
+    UNUSED(data);
+    while (true) {
+        // NOTE: the ring fd becomes readable when there are completions to reap
+        coroutine_sleep_read(uring.fd);
+        uring_poll();
+    }
+}
+
+bool uring_init(void)
+{
+    struct io_uring_params params = {0};
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = 2*URING_ENTRIES;
+    int fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+    if (fd < 0) {
+        fprintf(stderr, "ERROR: io_uring_setup: %s\n", strerror(errno));
+        return false;
+    }
+    // The features this backend relies on: a single mmap for both rings and stable submissions, so
+    // nothing has to outlive io_uring_enter() except the buffers themselves
+    unsigned required = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_SUBMIT_STABLE | IORING_FEAT_NODROP;
+    if ((params.features & required) != required) {
+        fprintf(stderr, "ERROR: io_uring is too old\n");
+        close(fd);
+        return false;
+    }
+
+    size_t sq_size = params.sq_off.array + params.sq_entries*sizeof(unsigned);
+    size_t cq_size = params.cq_off.cqes + params.cq_entries*sizeof(struct io_uring_cqe);
+    size_t rings_size = sq_size > cq_size ? sq_size : cq_size;
+    unsigned char *rings = mmap(NULL, rings_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (rings == MAP_FAILED) {
+        fprintf(stderr, "ERROR: could not map io_uring rings: %s\n", strerror(errno));
+        close(fd);
+        return false;
+    }
+    struct io_uring_sqe *sqes = mmap(NULL, params.sq_entries*sizeof(struct io_uring_sqe), PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+        fprintf(stderr, "ERROR: could not map io_uring submission entries: %s\n", strerror(errno));
+        close(fd);
+        return false;
+    }
+
+    struct io_uring_buf_ring *buf_ring = mmap(NULL, URING_RECV_BUFFERS*sizeof(struct io_uring_buf), PROT_READ|PROT_WRITE, MAP_ANONYMOUS|MAP_PRIVATE, -1, 0);
+    if (buf_ring == MAP_FAILED) {
+        fprintf(stderr, "ERROR: could not allocate io_uring buffer ring: %s\n", strerror(errno));
+        close(fd);
+        return false;
+    }
+    struct io_uring_buf_reg reg = {
+        .ring_addr = (uint64_t)(uintptr_t)buf_ring,
+        .ring_entries = URING_RECV_BUFFERS,
+        .bgid = URING_RECV_GROUP,
+    };
+    if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        fprintf(stderr, "ERROR: could not register io_uring buffer ring: %s\n", strerror(errno));
+        close(fd);
+        return false;
+    }
+
+    uring.fd = fd;
+    uring.sq_head    = (unsigned*)(rings + params.sq_off.head);
+    uring.sq_tail    = (unsigned*)(rings + params.sq_off.tail);
+    uring.sq_flags   = (unsigned*)(rings + params.sq_off.flags);
+    uring.sq_mask    = *(unsigned*)(rings + params.sq_off.ring_mask);
+    uring.sq_entries = *(unsigned*)(rings + params.sq_off.ring_entries);
+    uring.sqes       = sqes;
+    uring.sq_local_tail = *uring.sq_tail;
+    // NOTE: the SQEs are always used in order, so the indirection array maps every slot to itself
+    unsigned *sq_array = (unsigned*)(rings + params.sq_off.array);
+    for (unsigned i = 0; i < uring.sq_entries; ++i) sq_array[i] = i;
+
+    uring.cq_head = (unsigned*)(rings + params.cq_off.head);
+    uring.cq_tail = (unsigned*)(rings + params.cq_off.tail);
+    uring.cq_mask = *(unsigned*)(rings + params.cq_off.ring_mask);
+    uring.cqes    = (struct io_uring_cqe*)(rings + params.cq_off.cqes);
+
+    uring.buf_ring = buf_ring;
+    uring.buf_memory = malloc((size_t)URING_RECV_BUFFERS*URING_RECV_BUFFER_SIZE);
+    assert(uring.buf_memory != NULL && "Buy more RAM lol");
+    for (uint16_t bid = 0; bid < URING_RECV_BUFFERS; ++bid) uring__give_buffer(bid);
+    __atomic_store_n(&uring.buf_ring->tail, uring.buf_tail, __ATOMIC_RELEASE);
+
+    return true;
+}
+
+static int uring__socket_read_impl(Uring_Conn *conn, void *buffer, size_t len, bool peek)
+{
+    while (true) {
+        size_t available = conn->received.count - conn->received.pos;
+        if (available > 0) {
+            if (len > available) len = available;
+            memcpy(buffer, conn->received.items + conn->received.pos, len);
+            if (!peek) {
+                conn->received.pos += len;
+                if (conn->received.pos == conn->received.count) {
+                    conn->received.count = 0;
+                    conn->received.pos = 0;
+                }
+            }
+            return (int)len;
+        }
+        if (conn->error) {
+            errno = conn->error;
+            return (int)CWS_ERROR_ERRNO;
+        }
+        if (conn->eof) return (int)CWS_ERROR_CONNECTION_CLOSED;
+
+        assert(conn->reader == 0 && "Only one coroutine may read a socket at a time");
+        conn->reader = coroutine_id() + 1;
+        coroutine_sleep();
+    }
+}
+
+static int uring__socket_read(void *data, void *buffer, size_t len)
+{
+    return uring__socket_read_impl(data, buffer, len, false);
+}
+
+static int uring__socket_peek(void *data, void *buffer, size_t len)
+{
+    return uring__socket_read_impl(data, buffer, len, true);
+}
+
+static int uring__socket_try_writev(void *data, const Cws_Iovec *iov, size_t iovcnt)
+{
+    Uring_Conn *conn = data;
+    if (conn->error) {
+        errno = conn->error;
+        return (int)CWS_ERROR_ERRNO;
+    }
+
+    size_t unsent = uring__conn_unsent(conn);
+    if (unsent >= URING_SEND_LIMIT) return (int)CWS_ERROR_WOULD_BLOCK;
+    size_t room = URING_SEND_LIMIT - unsent;
+    size_t written = 0;
+    for (size_t i = 0; i < iovcnt && room > 0; ++i) {
+        size_t n = iov[i].len < room ? iov[i].len : room;
+        da_append_many(&conn->staged, iov[i].data, n);
+        written += n;
+        room -= n;
+    }
+    uring__conn_mark_dirty(conn);
+    return (int)written;
+}
+
+static int uring__socket_writev(void *data, const Cws_Iovec *iov, size_t iovcnt)
+{
+    while (true) {
+        int n = uring__socket_try_writev(data, iov, iovcnt);
+        if (n != (int)CWS_ERROR_WOULD_BLOCK) return n;
+        uring_socket_sleep_write((Cws_Socket) {.data = data});
+    }
+}
+
+static int uring__socket_write(void *data, const void *buffer, size_t len)
+{
+    Cws_Iovec iov = {.data = (void*)buffer, .len = len};
+    return uring__socket_writev(data, &iov, 1);
+}
+
+static int uring__socket_shutdown(void *data, Cws_Shutdown_How how)
+{
+    Uring_Conn *conn = data;
+    if (how == CWS_SHUTDOWN_WRITE && uring__conn_unsent(conn) > 0) {
+        // What is already written must go out first
+        conn->shutdown_write = true;
+        uring__conn_mark_dirty(conn);
+        return 0;
+    }
+    if (shutdown(conn->fd, (int)how) < 0) return (int)CWS_ERROR_ERRNO;
+    return 0;
+}
+
+static int uring__socket_close(void *data)
+{
+    Uring_Conn *conn = data;
+    conn->closed = true;
+    if (uring__conn_inflight(conn)) {
+        // Makes the requests in flight complete, so the connection can be freed
+        shutdown(conn->fd, SHUT_RDWR);
+    } else if (!conn->dirty) {
+        uring__conn_wake_up(conn);
+        uring__conn_free(conn);
+    }
+    return 0;
+}
+
+Cws_Socket uring_socket_from_fd(int fd)
+{
+    Uring_Conn *conn = calloc(1, sizeof(*conn));
+    assert(conn != NULL && "Buy more RAM lol");
+    static_assert(_Alignof(Uring_Conn) > URING_OP_MASK, "Uring_Op does not fit into the lower bits of Uring_Conn pointer");
+    conn->fd = fd;
+    // Arming the multishot recv on the next uring_poll()
+    uring__conn_mark_dirty(conn);
+    return (Cws_Socket) {
+        .data       = conn,
+        .read       = uring__socket_read,
+        .peek       = uring__socket_peek,
+        .write      = uring__socket_write,
+        .writev     = uring__socket_writev,
+        .try_writev = uring__socket_try_writev,
+        .shutdown   = uring__socket_shutdown,
+        .close      = uring__socket_close,
+    };
+}
+
+void uring_socket_sleep_write(Cws_Socket socket)
+{
+    Uring_Conn *conn = socket.data;
+    if (conn->error || uring__conn_unsent(conn) < URING_SEND_LIMIT) return;
+    assert(conn->writer == 0 && "Only one coroutine may wait to write a socket at a time");
+    conn->writer = coroutine_id() + 1;
+    coroutine_sleep();
+}
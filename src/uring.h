@@ -0,0 +1,37 @@
+#ifndef URING_H_
+#define URING_H_
+
+// io_uring backend of Cws_Socket. An alternative to cws_socket_from_fd() in
+// server.c, enabled with `node build.js server --io-uring`.
+//
+// - Every connection keeps a multishot recv in flight. Its completions are
+//   buffered per connection and wake up the coroutine waiting in read().
+// - Writing only copies the bytes into the send buffer of the connection. The
+//   sends of all the connections are submitted together by uring_poll(), so the
+//   whole tick goes out with a few io_uring_enter() calls.
+// - Nothing is submitted or completed unless somebody calls uring_poll(). The
+//   server does that from the main coroutine after every tick, and from the
+//   uring_poller() coroutine whenever completions arrive.
+
+#include <stdbool.h>
+#include "cws.h"
+
+// Sets up the ring. Returns false if io_uring is not available, in which case
+// none of the functions below may be used.
+bool uring_init(void);
+
+Cws_Socket uring_socket_from_fd(int fd);
+
+// Submits everything queued since the last call and processes the completions
+// that are ready without waiting for more.
+void uring_poll(void);
+
+// Coroutine that calls uring_poll() every time the ring has completions, so the
+// connections are served while the main coroutine sleeps between the ticks.
+void uring_poller(void *data);
+
+// Puts the current coroutine to sleep until the send buffer of the socket has
+// room again. The uring counterpart of coroutine_sleep_write().
+void uring_socket_sleep_write(Cws_Socket socket);
+
+#endif // URING_H_